@@ -0,0 +1,385 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_RUNS 1000
+
+typedef struct
+{
+    double wall_ms;
+    double cpu_ms;
+    double peak_rss_kb;
+} Sample;
+
+typedef struct
+{
+    double median;
+    double mean;
+    double stddev;
+    double ci95;
+    double min;
+    double max;
+} Stats;
+
+typedef struct
+{
+    const char* name;
+    bool        failed;
+    Stats       wall;
+    Stats       cpu;
+    Stats       rss;
+    bool        has_baseline;
+    double      baseline_ms;
+} Result;
+
+typedef struct
+{
+    int         runs;
+    int         warmup;
+    double      threshold;
+    const char* json_path;
+    const char* baseline_path;
+    const char* clocks;
+} Options;
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+static double timeval_ms(struct timeval tv)
+{
+    return (double)tv.tv_sec * 1e3 + (double)tv.tv_usec / 1e3;
+}
+
+// Runs the script once with its output discarded. Returns false if it
+// couldn't be run, or didn't exit cleanly.
+static bool run_once(const char* clocks, const char* script, Sample* sample)
+{
+    const double start = now_ms();
+    const pid_t  pid   = fork();
+    if (pid == -1)
+        return false;
+
+    if (pid == 0)
+    {
+        const int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1)
+        {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execl(clocks, clocks, script, (char*)NULL);
+        _exit(127);
+    }
+
+    int           status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1)
+        return false;
+
+    sample->wall_ms     = now_ms() - start;
+    sample->cpu_ms      = timeval_ms(usage.ru_utime) + timeval_ms(usage.ru_stime);
+    sample->peak_rss_kb = (double)usage.ru_maxrss;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Two-sided 95% critical values of Student's t distribution, by degrees
+// of freedom, which are close enough to the normal one past 30.
+static double t_critical(int df)
+{
+    static const double T95[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+                                 2.262,  2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120,
+                                 2.110,  2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+                                 2.060,  2.056, 2.052, 2.048, 2.045, 2.042};
+    if (df < 1)
+        return 0;
+    return df <= 30 ? T95[df - 1] : 1.96;
+}
+
+// ci95 is the half width of the 95% confidence interval of the mean.
+static Stats compute_stats(double* values, int count)
+{
+    qsort(values, count, sizeof(double), compare_doubles);
+
+    Stats stats;
+    stats.min    = values[0];
+    stats.max    = values[count - 1];
+    stats.median = count % 2 == 1 ? values[count / 2]
+                                  : (values[count / 2 - 1] + values[count / 2]) / 2;
+
+    double sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += values[i];
+    stats.mean = sum / count;
+
+    double squares = 0;
+    for (int i = 0; i < count; i++)
+        squares += (values[i] - stats.mean) * (values[i] - stats.mean);
+    stats.stddev = count > 1 ? sqrt(squares / (count - 1)) : 0;
+    stats.ci95   = t_critical(count - 1) * stats.stddev / sqrt(count);
+    return stats;
+}
+
+static const char* script_name(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
+}
+
+static void run_benchmark(const Options* options, const char* script, Result* result)
+{
+    static Sample samples[MAX_RUNS];
+    static double values[MAX_RUNS];
+
+    result->name         = script_name(script);
+    result->failed       = false;
+    result->has_baseline = false;
+
+    for (int i = 0; i < options->warmup + options->runs; i++)
+    {
+        Sample sample;
+        if (!run_once(options->clocks, script, &sample))
+        {
+            fprintf(stderr, "%s failed to run.\n", script);
+            result->failed = true;
+            return;
+        }
+        if (i >= options->warmup)
+            samples[i - options->warmup] = sample;
+    }
+
+    for (int i = 0; i < options->runs; i++)
+        values[i] = samples[i].wall_ms;
+    result->wall = compute_stats(values, options->runs);
+
+    for (int i = 0; i < options->runs; i++)
+        values[i] = samples[i].cpu_ms;
+    result->cpu = compute_stats(values, options->runs);
+
+    for (int i = 0; i < options->runs; i++)
+        values[i] = samples[i].peak_rss_kb;
+    result->rss = compute_stats(values, options->runs);
+}
+
+static char* read_file(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    const size_t size = ftell(file);
+    fseek(file, 0L, SEEK_SET);
+
+    char* buffer = (char*)malloc(size + 1);
+    if (buffer != NULL)
+        buffer[fread(buffer, 1, size, file)] = '\0';
+
+    fclose(file);
+    return buffer;
+}
+
+// Finds the median wall time of the named benchmark in JSON written by
+// write_json(), which puts "name" before "wall_ms" in each benchmark.
+static bool baseline_median(const char* json, const char* name, double* median)
+{
+    char key[512];
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+
+    const char* entry = strstr(json, key);
+    if (entry == NULL)
+        return false;
+
+    const char* wall = strstr(entry, "\"wall_ms\"");
+    if (wall == NULL)
+        return false;
+
+    const char* field = strstr(wall, "\"median\":");
+    if (field == NULL)
+        return false;
+
+    *median = strtod(field + strlen("\"median\":"), NULL);
+    return true;
+}
+
+static void write_stats(FILE* out, const char* name, const Stats* stats, bool last)
+{
+    fprintf(out,
+            "      \"%s\": {\"median\": %.3f, \"mean\": %.3f, \"stddev\": %.3f, "
+            "\"ci95\": %.3f, \"min\": %.3f, \"max\": %.3f}%s\n",
+            name, stats->median, stats->mean, stats->stddev, stats->ci95, stats->min,
+            stats->max, last ? "" : ",");
+}
+
+static bool write_json(const Options* options, const Result* results, int count)
+{
+    FILE* out = fopen(options->json_path, "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Could not write \"%s\".\n", options->json_path);
+        return false;
+    }
+
+    fprintf(out, "{\n  \"runs\": %d,\n  \"warmup\": %d,\n  \"benchmarks\": [\n",
+            options->runs, options->warmup);
+    int written = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (results[i].failed)
+            continue;
+
+        fprintf(out, "%s    {\n      \"name\": \"%s\",\n", written++ > 0 ? ",\n" : "",
+                results[i].name);
+        write_stats(out, "wall_ms", &results[i].wall, false);
+        write_stats(out, "cpu_ms", &results[i].cpu, false);
+        write_stats(out, "peak_rss_kb", &results[i].rss, true);
+        fprintf(out, "    }");
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    fclose(out);
+    return true;
+}
+
+static void print_header(bool with_baseline)
+{
+    printf("%-24s %12s %10s %10s %12s %12s%s\n", "benchmark", "wall median", "+/- ci95",
+           "stddev", "cpu median", "peak rss", with_baseline ? "   vs baseline" : "");
+}
+
+// Returns whether the benchmark got slower than the threshold allows.
+static bool print_result(const Options* options, const Result* result)
+{
+    if (result->failed)
+    {
+        printf("%-24s %12s\n", result->name, "failed");
+        return false;
+    }
+
+    printf("%-24s %9.2f ms %7.2f ms %7.2f ms %9.2f ms %9.0f KB", result->name,
+           result->wall.median, result->wall.ci95, result->wall.stddev, result->cpu.median,
+           result->rss.median);
+
+    bool regressed = false;
+    if (result->has_baseline && result->baseline_ms > 0)
+    {
+        const double change = (result->wall.median / result->baseline_ms - 1) * 100;
+        regressed           = change > options->threshold;
+        printf("   %+7.2f%%%s", change, regressed ? " REGRESSION" : "");
+    }
+    printf("\n");
+    return regressed;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "Usage: clocks_bench [-n runs] [-w warmup] [-o results.json]\n"
+            "                    [-b baseline.json] [-t threshold%%] clocks script...\n");
+    exit(64);
+}
+
+static bool parse_number(const char* arg, double min, double max, double* out)
+{
+    char* end = NULL;
+    *out      = arg != NULL ? strtod(arg, &end) : 0;
+    return end != NULL && end != arg && *end == '\0' && *out >= min && *out <= max;
+}
+
+int main(int argc, const char* argv[])
+{
+    Options options = {.runs          = 10,
+                       .warmup        = 2,
+                       .threshold     = 5,
+                       .json_path     = NULL,
+                       .baseline_path = NULL,
+                       .clocks        = NULL};
+
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        const char* flag  = argv[arg];
+        const char* value = arg + 1 < argc ? argv[arg + 1] : NULL;
+
+        double number;
+        if (strcmp(flag, "-n") == 0 && parse_number(value, 1, MAX_RUNS, &number))
+            options.runs = (int)number;
+        else if (strcmp(flag, "-w") == 0 && parse_number(value, 0, MAX_RUNS, &number))
+            options.warmup = (int)number;
+        else if (strcmp(flag, "-t") == 0 && parse_number(value, 0, 1e6, &number))
+            options.threshold = number;
+        else if (strcmp(flag, "-o") == 0 && value != NULL)
+            options.json_path = value;
+        else if (strcmp(flag, "-b") == 0 && value != NULL)
+            options.baseline_path = value;
+        else
+            usage();
+    }
+    if (argc - arg < 2)
+        usage();
+
+    options.clocks = argv[arg++];
+    if (options.warmup + options.runs > MAX_RUNS)
+        usage();
+
+    char* baseline = NULL;
+    if (options.baseline_path != NULL)
+    {
+        baseline = read_file(options.baseline_path);
+        if (baseline == NULL)
+            fprintf(stderr, "Could not read baseline \"%s\".\n", options.baseline_path);
+    }
+
+    const int count   = argc - arg;
+    Result*   results = (Result*)malloc(sizeof(Result) * count);
+    if (results == NULL)
+        return 1;
+
+    printf("%d runs after %d warmup runs each\n", options.runs, options.warmup);
+    print_header(baseline != NULL);
+
+    // Scripts which fail are reported, and left out of the results, but
+    // only regressions fail the run.
+    bool failed    = false;
+    int  regressed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        Result* result = &results[i];
+        run_benchmark(&options, argv[arg + i], result);
+        if (baseline != NULL && !result->failed)
+            result->has_baseline = baseline_median(baseline, result->name,
+                                                   &result->baseline_ms);
+
+        regressed += print_result(&options, result);
+        fflush(stdout);
+    }
+
+    if (options.json_path != NULL && !write_json(&options, results, count))
+        failed = true;
+
+    if (regressed > 0)
+        printf("%d benchmark%s regressed by more than %.1f%%\n", regressed,
+               regressed == 1 ? "" : "s", options.threshold);
+
+    free(baseline);
+    free(results);
+    return failed || regressed > 0 ? 1 : 0;
+}
@@ -0,0 +1,394 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <clocks/memory.h>
+#include <clocks/object.h>
+#include <clocks/table.h>
+#include <clocks/value.h>
+#include <clocks/vm.h>
+
+#define MAX_KEYS 65536
+
+// Slots of the tables the load benchmarks fill. Tables grow past 0.75
+// load, so 385 to 767 keys all fit in this many.
+#define LOAD_CAPACITY 1024
+
+#define LIVE_BLOCKS 1024
+
+#define GC_OBJECTS 100000
+
+static ObjString* keys[MAX_KEYS];
+static ObjString* missing[MAX_KEYS];
+
+static volatile uint64_t sink;
+
+static VM* vm;
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void report(const char* name, const char* detail, double elapsed_ns, long ops)
+{
+    printf("%-22s %-24s %10.2f ns/op\n", name, detail, elapsed_ns / (double)ops);
+}
+
+static void make_keys()
+{
+    char buffer[32];
+    for (int i = 0; i < MAX_KEYS; i++)
+    {
+        int length = snprintf(buffer, sizeof(buffer), "key_%d", i);
+        keys[i]    = copy_string(vm, buffer, length);
+
+        length     = snprintf(buffer, sizeof(buffer), "missing_%d", i);
+        missing[i] = copy_string(vm, buffer, length);
+    }
+}
+
+// Collecting leaves the threshold at a multiple of the live heap, which
+// would let a later allocation collect mid measurement.
+static void collect()
+{
+    collect_garbage(vm);
+    vm->next_gc_thresh = SIZE_MAX;
+}
+
+static void bench_finds(const Table* table, ObjString** hits, int hit_count,
+                        const char* detail)
+{
+    const int rounds = (1 << 22) / hit_count;
+
+    double start = now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < hit_count; i++)
+        {
+            Value value;
+            sink += table_find(table, hits[i], &value);
+        }
+    }
+    report("find_hit", detail, now_ns() - start, (long)hit_count * rounds);
+
+    start = now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < hit_count; i++)
+        {
+            Value value;
+            sink += table_find(table, missing[i], &value);
+        }
+    }
+    report("find_miss", detail, now_ns() - start, (long)hit_count * rounds);
+}
+
+static void bench_table_loads()
+{
+    static const int COUNTS[] = {385, 512, 640, 767};
+    for (size_t c = 0; c < sizeof(COUNTS) / sizeof(COUNTS[0]); c++)
+    {
+        Table table;
+        init_table(&table);
+
+        const int    count = COUNTS[c];
+        const double start = now_ns();
+        for (int i = 0; i < count; i++)
+            table_insert(vm, &table, keys[i], NUMBER_VAL(i));
+        const double elapsed = now_ns() - start;
+
+        char detail[32];
+        snprintf(detail, sizeof(detail), "load %.2f", (double)table.count / table.capacity);
+        report("insert", detail, elapsed, count);
+        bench_finds(&table, keys, count, detail);
+
+        free_table(vm, &table);
+    }
+}
+
+// Tables up to TABLE_SMALL_CAPACITY keys are searched linearly, and larger
+// ones are hashed, so the sizes cover both sides of it. Each insert round
+// builds a table from empty and frees it.
+static void bench_table_sizes()
+{
+    static const int SIZES[] = {4, 8, 16, 64, 1024, MAX_KEYS};
+    for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); s++)
+    {
+        const int size   = SIZES[s];
+        const int rounds = (1 << 22) / size;
+
+        const double start = now_ns();
+        for (int r = 0; r < rounds; r++)
+        {
+            Table table;
+            init_table(&table);
+            for (int i = 0; i < size; i++)
+                table_insert(vm, &table, keys[i], NUMBER_VAL(i));
+            sink += table.count;
+            free_table(vm, &table);
+        }
+
+        char detail[32];
+        snprintf(detail, sizeof(detail), "%d keys", size);
+        report("insert", detail, now_ns() - start, (long)size * rounds);
+
+        Table table;
+        init_table(&table);
+        for (int i = 0; i < size; i++)
+            table_insert(vm, &table, keys[i], NUMBER_VAL(i));
+        bench_finds(&table, keys, size, detail);
+        free_table(vm, &table);
+    }
+}
+
+// Removed keys leave tombstones behind, which lookups have to probe past
+// but which still count towards the load.
+static void bench_table_tombstones()
+{
+    static const double RATIOS[] = {0, 0.25, 0.5, 0.75};
+    const int           count    = LOAD_CAPACITY * 3 / 4 - 1;
+
+    for (size_t r = 0; r < sizeof(RATIOS) / sizeof(RATIOS[0]); r++)
+    {
+        Table table;
+        init_table(&table);
+        for (int i = 0; i < count; i++)
+            table_insert(vm, &table, keys[i], NUMBER_VAL(i));
+
+        const int removed = (int)(count * RATIOS[r]);
+        for (int i = 0; i < removed; i++)
+            table_remove(&table, keys[i]);
+
+        char detail[32];
+        snprintf(detail, sizeof(detail), "tombstones %.2f", RATIOS[r]);
+        bench_finds(&table, &keys[removed], count - removed, detail);
+
+        free_table(vm, &table);
+    }
+}
+
+static void bench_hash_string()
+{
+    static const int LENGTHS[] = {1, 4, 8, 16, 32, 64, 256, 1024};
+
+    char chars[1024];
+    for (int i = 0; i < (int)sizeof(chars); i++)
+        chars[i] = (char)('a' + i % 26);
+
+    for (size_t l = 0; l < sizeof(LENGTHS) / sizeof(LENGTHS[0]); l++)
+    {
+        const int  length = LENGTHS[l];
+        const long ops    = (1L << 26) / (length + 16);
+
+        const double start = now_ns();
+        for (long i = 0; i < ops; i++)
+        {
+            chars[0] = (char)i;
+            sink += hash_string(chars, length);
+        }
+
+        char detail[32];
+        snprintf(detail, sizeof(detail), "%d bytes", length);
+        report("hash_string", detail, now_ns() - start, ops);
+    }
+}
+
+static void bench_copy_string()
+{
+    const int rounds = 64;
+
+    double start = now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < MAX_KEYS; i++)
+            sink += (uintptr_t)copy_string(vm, keys[i]->chars, keys[i]->length);
+    }
+    report("copy_string", "interned", now_ns() - start, (long)MAX_KEYS * rounds);
+
+    // Every string is new, so each one is allocated and interned, growing
+    // the strings table along the way.
+    char buffer[32];
+    start = now_ns();
+    for (int i = 0; i < MAX_KEYS * 4; i++)
+    {
+        const int length = snprintf(buffer, sizeof(buffer), "fresh_string_%d", i);
+        sink += (uintptr_t)copy_string(vm, buffer, length);
+    }
+    report("copy_string", "new", now_ns() - start, (long)MAX_KEYS * 4);
+}
+
+// Looks up every key in the strings table, as interning does.
+static void bench_find_string()
+{
+    const int rounds = 64;
+
+    const double start = now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < MAX_KEYS; i++)
+        {
+            const ObjString* key = keys[i];
+            sink += (uintptr_t)table_find_string(&vm->strings, key->chars,
+                                                 key->length, key->hash);
+        }
+    }
+
+    char detail[32];
+    snprintf(detail, sizeof(detail), "%d strings", vm->strings.count);
+    report("find_string", detail, now_ns() - start, (long)MAX_KEYS * rounds);
+}
+
+static void bench_reallocate()
+{
+    const long ops = 1L << 22;
+
+    double start = now_ns();
+    for (long i = 0; i < ops; i++)
+    {
+        void* block = reallocate(vm, NULL, 0, 32);
+        sink += (uintptr_t)block;
+        reallocate(vm, block, 32, 0);
+    }
+    report("reallocate", "alloc/free 32 bytes", now_ns() - start, ops);
+
+    // A pool of live blocks of mixed sizes, one of which is replaced by a
+    // block of another size on every step.
+    static void*  blocks[LIVE_BLOCKS];
+    static size_t sizes[LIVE_BLOCKS];
+
+    uint32_t state = 2463534242u;
+    for (int i = 0; i < LIVE_BLOCKS; i++)
+    {
+        sizes[i]  = 16 + (size_t)(i * 37 % 1008);
+        blocks[i] = reallocate(vm, NULL, 0, sizes[i]);
+    }
+
+    start = now_ns();
+    for (long i = 0; i < ops; i++)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+
+        const int    slot = (int)(state % LIVE_BLOCKS);
+        const size_t size = 16 + (state >> 10) % 1008;
+        reallocate(vm, blocks[slot], sizes[slot], 0);
+        blocks[slot] = reallocate(vm, NULL, 0, size);
+        sizes[slot]  = size;
+    }
+    report("reallocate", "mixed 16-1024 bytes", now_ns() - start, ops);
+
+    for (int i = 0; i < LIVE_BLOCKS; i++)
+        reallocate(vm, blocks[i], sizes[i], 0);
+
+    const int rounds = 256;
+    start            = now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        int    capacity = 0;
+        Value* values   = NULL;
+        while (capacity < 65536)
+        {
+            const int old_capacity = capacity;
+            capacity               = GROW_CAPACITY(old_capacity);
+            values = GROW_ARRAY(vm, Value, values, old_capacity, capacity);
+        }
+        sink += (uintptr_t)values;
+        FREE_ARRAY(vm, Value, values, capacity);
+    }
+    report("reallocate", "grow array to 64K", now_ns() - start, rounds);
+}
+
+static ObjString* intern(const char* chars)
+{
+    return copy_string(vm, chars, (int)strlen(chars));
+}
+
+// Nothing collects while a heap is built, as the threshold is out of
+// reach, so it only needs a root once it is measured.
+static void measure_collection(Value heap, const char* detail, int objects)
+{
+    table_insert(vm, &vm->globals, intern("heap"), heap);
+
+    const double start = now_ns();
+    collect();
+    report("collect_garbage", detail, now_ns() - start, objects);
+
+    table_remove(&vm->globals, intern("heap"));
+    collect();
+}
+
+// Runs last, since the first collection frees the keys.
+static void bench_gc()
+{
+    collect();
+
+    for (int i = 0; i < GC_OBJECTS; i++)
+    {
+        char      buffer[32];
+        const int length = snprintf(buffer, sizeof(buffer), "garbage_%d", i);
+        copy_string(vm, buffer, length);
+    }
+    measure_collection(NIL_VAL, "dead strings", GC_OBJECTS);
+
+    ObjInstance* owner = new_instance(vm, new_class(vm, intern("Owner")));
+    for (int i = 0; i < GC_OBJECTS; i++)
+    {
+        char      buffer[32];
+        const int length = snprintf(buffer, sizeof(buffer), "live_%d", i);
+        table_insert(vm, &owner->fields, copy_string(vm, buffer, length), NUMBER_VAL(i));
+    }
+    measure_collection(OBJ_VAL(owner), "live strings", GC_OBJECTS);
+
+    // Each node refers to the one allocated before it, so marking walks one
+    // long chain.
+    ObjClass*    klass = new_class(vm, intern("Node"));
+    ObjString*   next  = intern("next");
+    ObjInstance* node  = new_instance(vm, klass);
+    for (int i = 1; i < GC_OBJECTS; i++)
+    {
+        ObjInstance* head = new_instance(vm, klass);
+        table_insert(vm, &head->fields, next, OBJ_VAL(node));
+        node = head;
+    }
+    measure_collection(OBJ_VAL(node), "linked instances", GC_OBJECTS);
+
+    // Every other instance is unreachable, so the sweep frees and keeps
+    // objects in turn.
+    owner = new_instance(vm, klass);
+    for (int i = 0; i < GC_OBJECTS; i++)
+    {
+        char      buffer[32];
+        const int length = snprintf(buffer, sizeof(buffer), "field_%d", i);
+
+        ObjInstance* instance = new_instance(vm, klass);
+        if (i % 2 == 0)
+            table_insert(vm, &owner->fields, copy_string(vm, buffer, length),
+                         OBJ_VAL(instance));
+    }
+    measure_collection(OBJ_VAL(owner), "half live instances", GC_OBJECTS);
+}
+
+int main()
+{
+    vm                 = vm_new();
+    vm->next_gc_thresh = SIZE_MAX;
+    make_keys();
+
+    bench_table_sizes();
+    bench_table_loads();
+    bench_table_tombstones();
+    bench_find_string();
+    bench_hash_string();
+    bench_copy_string();
+    bench_reallocate();
+    bench_gc();
+
+    vm_free(vm);
+    return 0;
+}
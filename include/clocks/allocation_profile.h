@@ -0,0 +1,83 @@
+#ifndef ALLOCATION_PROFILE_H
+#define ALLOCATION_PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// The objects allocated at one line of one function, of one type. Counts
+// are estimated from the samples, so they are not whole numbers. Objects
+// allocated outside of any call have no function.
+typedef struct
+{
+    const ObjFunction* func;
+    int                line;
+    ObjType            type;
+    bool               compiling;
+
+    double objects;
+    double bytes;
+    // Of those objects, how many outlived at least one collection, how
+    // many collections they outlived in all, and how many are still live.
+    double survived;
+    double survivals;
+    double live;
+} AllocationSite;
+
+// An object which was sampled, tracked until it is collected.
+typedef struct
+{
+    const Obj* object;
+    int        site;
+    double     objects;
+    int        collections;
+} SampledObject;
+
+// Samples one allocated byte in every interval, on average, and charges
+// the object it falls in to the site that allocated it. The intervals are
+// random, so periodic allocations can't all fall between two samples. An
+// interval of 1 records every object exactly.
+typedef struct
+{
+    int64_t  countdown;
+    int      interval;
+    uint32_t random;
+
+    AllocationSite* sites;
+    int             site_count;
+    int             site_capacity;
+
+    // Indices into sites by function, line and type.
+    int* index;
+    int  index_capacity;
+
+    SampledObject* sampled;
+    int            sampled_count;
+    int            sampled_capacity;
+} AllocationProfile;
+
+AllocationProfile* new_allocation_profile(int interval);
+void               free_allocation_profile(AllocationProfile* profile);
+
+void sample_allocation(VM* vm, AllocationProfile* profile, const Obj* object, size_t size);
+
+static inline void profile_allocation(VM* vm, AllocationProfile* profile, const Obj* object,
+                                      size_t size)
+{
+    profile->countdown -= (int64_t)size;
+    if (profile->countdown <= 0)
+        sample_allocation(vm, profile, object, size);
+}
+
+void mark_allocation_profile(VM* vm, const AllocationProfile* profile);
+
+// Called once the heap is marked, before the sweep frees the unmarked
+// objects.
+void sweep_allocation_profile(const VM* vm, AllocationProfile* profile);
+
+// Lists the top sites by bytes allocated.
+void print_allocation_profile(const AllocationProfile* profile, FILE* out);
+
+#endif  // ALLOCATION_PROFILE_H
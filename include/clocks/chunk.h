@@ -45,6 +45,19 @@ typedef enum
     OpMethod,
 } OpCode;
 
+#define OPCODE_COUNT (OpMethod + 1)
+
+#ifdef COMPILER_CAPTURE_BY_VALUE
+// How OpClosure captures each upvalue. Locals that are never reassigned
+// once captured are copied into the closure instead of getting an upvalue.
+typedef enum
+{
+    CaptureUpvalue,
+    CaptureLocal,
+    CaptureLocalValue,
+} CaptureKind;
+#endif
+
 #ifdef CHUNK_LINE_RUN_LENGTH_ENCODING
 typedef struct
 {
@@ -69,13 +82,13 @@ typedef struct
 } Chunk;
 
 void init_chunk(Chunk* chunk);
-void free_chunk(Chunk* chunk);
-void write_chunk(Chunk* chunk, uint8_t byte, int line);
+void free_chunk(VM* vm, Chunk* chunk);
+void write_chunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
 
 #ifdef CHUNK_LINE_RUN_LENGTH_ENCODING
 int get_line(const Chunk* chunk, int offset);
 #endif
 
-int add_constant(Chunk* chunk, Value value);
+int add_constant(VM* vm, Chunk* chunk, Value value);
 
 #endif  // CHUNK_H
@@ -15,6 +15,19 @@
 #define DEBUG_LOG_GC           // Allocation information (bytes, type) and GC phases (mark, blacken)
 #endif
 
+// Lets clocks --profile-opcodes count the opcodes a script executes, at the
+// cost of a branch per instruction even when it isn't asked for.
+// #define PROFILE_OPCODES
+
+// Lets clocks --perf-map name Lox functions for perf, see perf_map.h. The
+// calls through trampolines happen in an interpreter loop of their own,
+// chosen at startup, so the usual loop pays nothing for them.
+#define PERF_MAP
+
+// Builds in USDT probes for bpftrace and other tracers, see probes.h. Each
+// probe is a nop, or a nop behind a never taken branch, until traced.
+#define USDT_PROBES
+
 #ifdef CLOCKS_OPTIMIZATIONS
 #define TABLE_OPTIMIZED_FIND_ENTRY
 #define VM_CACHE_IP
@@ -27,6 +40,95 @@
 
 #define TABLE_FNV_GCC_OPTIMIZATION
 #define VM_OPTIMIZED_POP
+
+#define TABLE_SMALL_LINEAR
+#define OBJECT_METHOD_SELECTORS
+#define OBJECT_CACHE_SUPER_CALLS
+#define COMPILER_CAPTURE_BY_VALUE
+#define OBJECT_CLOSURE_FLEXIBLE_ARRAY
+#define OBJECT_COMPACT_HEADER
+#define VALUE_SHORT_STRINGS
+#define VALUE_SMALL_INTEGERS
+#endif
+
+// Any one optimization can be left out by defining CLOCKS_DISABLE_ followed
+// by its name, e.g. CLOCKS_DISABLE_VM_CACHE_IP, to measure it against the
+// others.
+#ifdef CLOCKS_DISABLE_TABLE_OPTIMIZED_FIND_ENTRY
+#undef TABLE_OPTIMIZED_FIND_ENTRY
+#endif
+#ifdef CLOCKS_DISABLE_VM_CACHE_IP
+#undef VM_CACHE_IP
+#endif
+#ifdef CLOCKS_DISABLE_VALUE_NAN_BOXING
+#undef VALUE_NAN_BOXING
+#endif
+#ifdef CLOCKS_DISABLE_CHUNK_LINE_RUN_LENGTH_ENCODING
+#undef CHUNK_LINE_RUN_LENGTH_ENCODING
+#endif
+#ifdef CLOCKS_DISABLE_GC_OPTIMIZE_CLEARING_MARK
+#undef GC_OPTIMIZE_CLEARING_MARK
+#endif
+#ifdef CLOCKS_DISABLE_OBJECT_CACHE_CLASS_INITIALIZER
+#undef OBJECT_CACHE_CLASS_INITIALIZER
+#endif
+#ifdef CLOCKS_DISABLE_OBJECT_STRING_FLEXIBLE_ARRAY
+#undef OBJECT_STRING_FLEXIBLE_ARRAY
+#endif
+#ifdef CLOCKS_DISABLE_TABLE_FNV_GCC_OPTIMIZATION
+#undef TABLE_FNV_GCC_OPTIMIZATION
+#endif
+#ifdef CLOCKS_DISABLE_VM_OPTIMIZED_POP
+#undef VM_OPTIMIZED_POP
+#endif
+#ifdef CLOCKS_DISABLE_TABLE_SMALL_LINEAR
+#undef TABLE_SMALL_LINEAR
+#endif
+#ifdef CLOCKS_DISABLE_OBJECT_METHOD_SELECTORS
+#undef OBJECT_METHOD_SELECTORS
+#endif
+#ifdef CLOCKS_DISABLE_OBJECT_CACHE_SUPER_CALLS
+#undef OBJECT_CACHE_SUPER_CALLS
+#endif
+#ifdef CLOCKS_DISABLE_COMPILER_CAPTURE_BY_VALUE
+#undef COMPILER_CAPTURE_BY_VALUE
+#endif
+#ifdef CLOCKS_DISABLE_OBJECT_CLOSURE_FLEXIBLE_ARRAY
+#undef OBJECT_CLOSURE_FLEXIBLE_ARRAY
+#endif
+#ifdef CLOCKS_DISABLE_OBJECT_COMPACT_HEADER
+#undef OBJECT_COMPACT_HEADER
+#endif
+#ifdef CLOCKS_DISABLE_VALUE_SHORT_STRINGS
+#undef VALUE_SHORT_STRINGS
+#endif
+#ifdef CLOCKS_DISABLE_VALUE_SMALL_INTEGERS
+#undef VALUE_SMALL_INTEGERS
+#endif
+
+// Short strings and small integers are stored in the payload of a NaN boxed
+// value.
+#ifndef VALUE_NAN_BOXING
+#undef VALUE_SHORT_STRINGS
+#undef VALUE_SMALL_INTEGERS
+#endif
+
+// Trampolines for perf only exist for these targets.
+#if !defined(__linux__) || !(defined(__x86_64__) || defined(__aarch64__))
+#undef PERF_MAP
+#endif
+
+// The compact header keeps pointers in 48 bits. Linux only hands out user
+// addresses above that on x86-64 and AArch64 when a mapping asks for them,
+// while Android tags the top byte of heap pointers.
+#if !defined(__linux__) || defined(__ANDROID__) || defined(__ILP32__) || \
+    !(defined(__x86_64__) || defined(__aarch64__))
+#undef OBJECT_COMPACT_HEADER
+#endif
+
+// USDT probes are ELF notes, written for the same targets.
+#if !defined(__GNUC__) || !defined(__ELF__) || !(defined(__x86_64__) || defined(__aarch64__))
+#undef USDT_PROBES
 #endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
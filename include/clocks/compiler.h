@@ -4,8 +4,10 @@
 #include "chunk.h"
 #include "object.h"
 
-ObjFunction* compile(const char* source);
+typedef struct Parser Parser;
 
-void mark_compiler_roots();
+ObjFunction* compile(VM* vm, const char* source);
+
+void mark_compiler_roots(VM* vm);
 
 #endif  // COMPILER_H
@@ -1,9 +1,14 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
+#include <stdio.h>
+
 #include "chunk.h"
 
-void disassemble_chunk(const Chunk* chunk, const char* name);
-int  disassemble_instruction(const Chunk* chunk, int offset);
+void disassemble_chunk(FILE* out, const Chunk* chunk, const char* name);
+int  disassemble_instruction(FILE* out, const Chunk* chunk, int offset);
+
+// Returns NULL for a byte that isn't an opcode.
+const char* opcode_name(uint8_t instruction);
 
 #endif  // DEBUG_H
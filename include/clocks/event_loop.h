@@ -0,0 +1,34 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+#ifdef __linux__
+
+// Fibers passed to schedule() run on the VM's event loop. When one of them
+// reads, writes or sleeps and would block, it is suspended and the loop
+// switches to another fiber that is ready, waiting in epoll once none is.
+// Outside of the loop, the same natives simply block.
+typedef struct EventLoop EventLoop;
+
+// Defines the event loop natives: schedule, run_loop, sleep, open,
+// command, read, write and close.
+void define_event_loop_natives(VM* vm);
+
+// Switches to the next fiber to run once the running loop fiber is done.
+void loop_fiber_done(VM* vm);
+
+// Suspends the running loop fiber behind the others that are ready.
+Value loop_yield(VM* vm, int arg_count);
+
+// Drops every loop fiber after a runtime error unwound the loop.
+void reset_event_loop(VM* vm);
+
+void mark_event_loop(VM* vm);
+void free_event_loop(VM* vm);
+
+#endif
+
+#endif  // EVENT_LOOP_H
@@ -0,0 +1,40 @@
+#ifndef HEAP_SNAPSHOT_H
+#define HEAP_SNAPSHOT_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+typedef struct
+{
+    const Obj* from;
+    const Obj* to;
+} HeapReference;
+
+// The references mark_heap() marks, from the object being blackened, or
+// from NULL for the roots.
+typedef struct HeapSnapshot
+{
+    const Obj*     source;
+    HeapReference* references;
+    size_t         count;
+    size_t         capacity;
+} HeapSnapshot;
+
+void grow_heap_snapshot(HeapSnapshot* snapshot);
+
+static inline void record_reference(HeapSnapshot* snapshot, const Obj* object)
+{
+    if (snapshot->count == snapshot->capacity)
+        grow_heap_snapshot(snapshot);
+    snapshot->references[snapshot->count++] = (HeapReference){snapshot->source, object};
+}
+
+// Writes the objects reachable from the roots as JSON, one object per
+// line, with its type, size, name and the objects it refers to, which
+// tools/heap_analyzer.c reads. Objects are identified by their address.
+bool write_heap_snapshot(VM* vm, FILE* out);
+bool save_heap_snapshot(VM* vm, const char* path);
+
+#endif  // HEAP_SNAPSHOT_H
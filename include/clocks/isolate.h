@@ -0,0 +1,52 @@
+#ifndef ISOLATE_H
+#define ISOLATE_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "value.h"
+
+// A channel is a queue of messages shared between VMs, which may run on
+// different threads. It is reference counted, since every VM holding an
+// ObjChannel for it keeps it alive.
+typedef struct Channel Channel;
+
+typedef struct Isolate Isolate;
+
+// A value on its way from one VM to another. Messages hold no references
+// into the sending VM's heap.
+typedef struct Message Message;
+
+// Returns NULL if value can't be sent, see channel_send().
+Message* message_encode(Value value);
+// Returns the message's value in vm, and frees the message.
+Value message_decode(VM* vm, Message* message);
+void  message_free(Message* message);
+
+// Returns a channel with a single reference held by the caller.
+Channel* channel_create();
+void     channel_retain(Channel* channel);
+void     channel_release(Channel* channel);
+
+// Nil, booleans and numbers are copied into the message. A heap string's
+// characters are copied into the message, then into the receiving VM's
+// heap, where they are interned. Channels are passed by reference. Returns
+// false, sending nothing, for any other value.
+bool channel_send(Channel* channel, Value value);
+
+void channel_put(Channel* channel, Message* message);
+
+// Blocks until a message is available.
+Value channel_receive(VM* vm, Channel* channel);
+
+// Runs the script at path in a new VM on its own thread, with the global
+// parent bound to channel. Output goes to the spawning VM's streams.
+bool spawn_isolate(VM* vm, const char* path, Channel* channel);
+
+// Waits for every isolate spawned by vm to finish.
+void join_isolates(VM* vm);
+
+// Returns NULL after reporting to err if the file can't be read.
+char* read_source_file(const char* path, FILE* err);
+
+#endif  // ISOLATE_H
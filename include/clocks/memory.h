@@ -4,29 +4,66 @@
 #include "common.h"
 #include "value.h"
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity)*2)
 
-#define GROW_ARRAY(type, pointer, old_size, new_size)     \
-    (type*)reallocate(pointer, sizeof(type) * (old_size), \
+#define GROW_ARRAY(vm, type, pointer, old_size, new_size)     \
+    (type*)reallocate(vm, pointer, sizeof(type) * (old_size), \
                       sizeof(type) * (new_size))
 
-#define FREE_ARRAY(type, pointer, old_size) \
-    reallocate(pointer, sizeof(type) * (old_size), 0);
+#define FREE_ARRAY(vm, type, pointer, old_size) \
+    reallocate(vm, pointer, sizeof(type) * (old_size), 0);
 
-void* reallocate(void* pointer, size_t old_size, size_t new_size);
+// Pauses under 100us, 1ms, 10ms and 100ms, and longer ones.
+#define GC_PAUSE_BUCKETS 5
 
-void mark_object(Obj* object);
+// Kept by every collection, which only costs it a few clock reads. If the
+// CLOCKS_GC_LOG environment variable is set, each collection also logs a
+// line to the VM's err stream.
+typedef struct
+{
+    uint64_t collections;
+    uint64_t total_pause_ns;
+    uint64_t max_pause_ns;
+    uint64_t mark_ns;
+    uint64_t sweep_ns;
+    uint64_t pauses[GC_PAUSE_BUCKETS];
 
-void mark_value(Value value);
+    uint64_t bytes_freed;
+    size_t   last_bytes_freed;
+    // The largest heap a collection started from.
+    size_t   peak_heap;
 
-void collect_garbage();
+    // When the VM was created.
+    uint64_t start_ns;
+    bool     log;
+} GcStats;
 
-void free_objects();
+void     init_gc_stats(GcStats* stats);
+uint64_t monotonic_ns();
+
+void* reallocate(VM* vm, void* pointer, size_t old_size, size_t new_size);
+
+void mark_object(VM* vm, Obj* object);
+
+void mark_value(VM* vm, Value value);
+
+void collect_garbage(VM* vm);
+
+// Marks what a collection would, without sweeping, for a heap snapshot,
+// which records every reference marked. unmark_heap() clears the marks.
+void mark_heap(VM* vm);
+void unmark_heap(VM* vm);
+bool is_marked(const VM* vm, const Obj* object);
+
+// The bytes the object and the arrays it owns take up.
+size_t object_size(const Obj* object);
+
+void free_objects(VM* vm);
 
 #endif  // MEMORY_H
@@ -6,6 +6,9 @@
 #include "value.h"
 
 typedef struct ObjUpvalue ObjUpvalue;
+typedef struct ObjClosure ObjClosure;
+typedef struct ObjClass   ObjClass;
+typedef struct ObjFiber   ObjFiber;
 
 typedef enum
 {
@@ -17,8 +20,52 @@ typedef enum
     ObjTypeClass,
     ObjTypeInstance,
     ObjTypeBoundMethod,
+    ObjTypeChannel,
+    ObjTypeFiber,
 } ObjType;
 
+// The name traces, profiles and heap snapshots show for the type.
+const char* obj_type_name(ObjType type);
+
+#ifdef OBJECT_COMPACT_HEADER
+// The type and mark bit are packed into the upper 16 bits of the next
+// pointer, which are unused by user space addresses on x86-64 and AArch64.
+#define OBJ_HEADER_NEXT_MASK  ((uintptr_t)0x0000ffffffffffff)
+#define OBJ_HEADER_TYPE_SHIFT 48
+#define OBJ_HEADER_TYPE_MASK  ((uintptr_t)0x7f << OBJ_HEADER_TYPE_SHIFT)
+#define OBJ_HEADER_MARK_BIT   ((uintptr_t)1 << 63)
+
+struct Obj
+{
+    uintptr_t header;
+};
+
+static inline ObjType obj_type(const Obj* object)
+{
+    return (ObjType)((object->header & OBJ_HEADER_TYPE_MASK) >> OBJ_HEADER_TYPE_SHIFT);
+}
+
+static inline bool obj_mark(const Obj* object)
+{
+    return (object->header & OBJ_HEADER_MARK_BIT) != 0;
+}
+
+static inline void obj_set_mark(Obj* object, bool mark)
+{
+    object->header = (object->header & ~OBJ_HEADER_MARK_BIT)
+                     | (mark ? OBJ_HEADER_MARK_BIT : 0);
+}
+
+static inline Obj* obj_next(const Obj* object)
+{
+    return (Obj*)(object->header & OBJ_HEADER_NEXT_MASK);
+}
+
+static inline void obj_set_next(Obj* object, const Obj* next)
+{
+    object->header = (object->header & ~OBJ_HEADER_NEXT_MASK) | (uintptr_t)next;
+}
+#else
 struct Obj
 {
     ObjType type;
@@ -30,20 +77,57 @@ struct Obj
     struct Obj* next;
 };
 
-#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+static inline ObjType obj_type(const Obj* object)
+{
+    return object->type;
+}
+
+static inline bool obj_mark(const Obj* object)
+{
+#ifdef GC_OPTIMIZE_CLEARING_MARK
+    return object->mark;
+#else
+    return object->is_marked;
+#endif
+}
+
+static inline void obj_set_mark(Obj* object, bool mark)
+{
+#ifdef GC_OPTIMIZE_CLEARING_MARK
+    object->mark = mark;
+#else
+    object->is_marked = mark;
+#endif
+}
+
+static inline Obj* obj_next(const Obj* object)
+{
+    return object->next;
+}
+
+static inline void obj_set_next(Obj* object, const Obj* next)
+{
+    object->next = (Obj*)next;
+}
+#endif
+
+#define OBJ_TYPE(value) (obj_type(AS_OBJ(value)))
 
 static inline bool is_obj_type(Value value, ObjType type)
 {
-    return IS_OBJ(value) && AS_OBJ(value)->type == type;
+    return IS_OBJ(value) && obj_type(AS_OBJ(value)) == type;
 }
 
-void print_object(const Value* value);
+void print_object(FILE* out, const Value* value);
 
 struct ObjString
 {
     Obj      obj;
     int      length;
     uint32_t hash;
+#ifdef OBJECT_METHOD_SELECTORS
+    int selector;
+#endif
 #ifdef OBJECT_STRING_FLEXIBLE_ARRAY
     char chars[];
 #else
@@ -51,20 +135,67 @@ struct ObjString
 #endif
 };
 
-#define IS_STRING(value)  is_obj_type(value, ObjTypeString)
+// Under VALUE_SHORT_STRINGS a string value is either a short string or an
+// ObjString, while AS_STRING() and AS_CSTRING() only apply to the latter.
+// Identifiers are always ObjStrings, since they're used as table keys.
+#ifdef VALUE_SHORT_STRINGS
+#define IS_STRING(value) (IS_SHORT_STRING(value) || is_obj_type(value, ObjTypeString))
+#else
+#define IS_STRING(value) is_obj_type(value, ObjTypeString)
+#endif
 #define AS_STRING(value)  ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 
+// The characters of a string value, which may point into the view's own
+// buffer for a short string.
+typedef struct
+{
+    const char* chars;
+    int         length;
+#ifdef VALUE_SHORT_STRINGS
+    char buffer[SHORT_STRING_MAX];
+#endif
+} StringView;
+
+static inline void string_view(Value value, StringView* view)
+{
+#ifdef VALUE_SHORT_STRINGS
+    if (IS_SHORT_STRING(value))
+    {
+        view->length = short_string_chars(value, view->buffer);
+        view->chars  = view->buffer;
+        return;
+    }
+#endif
+    view->chars  = AS_CSTRING(value);
+    view->length = AS_STRING(value)->length;
+}
+
 #ifdef OBJECT_STRING_FLEXIBLE_ARRAY
-ObjString* allocate_string(int length);
+ObjString* allocate_string(VM* vm, int length);
+ObjString* intern_allocated_string(VM* vm, ObjString* string);
 #else
-ObjString* take_string(char* chars, int length);
+ObjString* take_string(VM* vm, char* chars, int length);
 #endif
 
-ObjString* copy_string(const char* chars, int length);
+ObjString* copy_string(VM* vm, const char* chars, int length);
+
+Value string_value(VM* vm, const char* chars, int length);
 
 uint32_t hash_string(const char* key, int length);
 
+#ifdef OBJECT_CACHE_SUPER_CALLS
+// Each super call site remembers the method it resolved to, along with the
+// superclass it was resolved against. A class's methods can't change once
+// its body has run, so the entry stays valid for as long as the call site
+// keeps seeing the same superclass.
+typedef struct
+{
+    const ObjClass* superclass;
+    ObjClosure*     method;
+} SuperCallCache;
+#endif
+
 typedef struct
 {
     Obj        obj;
@@ -72,14 +203,22 @@ typedef struct
     int        upvalue_count;
     Chunk      chunk;
     ObjString* name;
+#ifdef OBJECT_CACHE_SUPER_CALLS
+    int             super_cache_count;
+    SuperCallCache* super_caches;
+#endif
+#ifdef PERF_MAP
+    // Calls go through it while a perf map is kept, see perf_map.h.
+    void* trampoline;
+#endif
 } ObjFunction;
 
 #define IS_FUNCTION(value) is_obj_type(value, ObjTypeFunction)
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 
-ObjFunction* new_function();
+ObjFunction* new_function(VM* vm);
 
-typedef Value (*NativeFn)(int arg_count, const Value* args);
+typedef Value (*NativeFn)(VM* vm, int arg_count, const Value* args);
 
 typedef struct
 {
@@ -90,45 +229,101 @@ typedef struct
 #define IS_NATIVE(value) is_obj_type(value, ObjTypeNative)
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->func)
 
-ObjNative* new_native(NativeFn func);
+ObjNative* new_native(VM* vm, NativeFn func);
 
-typedef struct
+#ifdef COMPILER_CAPTURE_BY_VALUE
+// Either an ObjUpvalue, or the captured value itself.
+typedef Value UpvalueSlot;
+#else
+typedef ObjUpvalue* UpvalueSlot;
+#endif
+
+struct ObjClosure
 {
     Obj          obj;
     ObjFunction* func;
-    ObjUpvalue** upvalues;
     int          upvalue_count;
-} ObjClosure;
+#ifdef OBJECT_CLOSURE_FLEXIBLE_ARRAY
+    UpvalueSlot upvalues[];
+#else
+    UpvalueSlot* upvalues;
+#endif
+};
 
 #define IS_CLOSURE(value) is_obj_type(value, ObjTypeClosure)
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
 
-ObjClosure* new_closure(ObjFunction* func);
+ObjClosure* new_closure(VM* vm, ObjFunction* func);
 
+// An open upvalue points into the stack of the fiber that created it, and
+// keeps that fiber alive.
 struct ObjUpvalue
 {
     Obj         obj;
     Value*      location;
     Value       closed;
     ObjUpvalue* next;
+    ObjFiber*   fiber;
 };
 
-ObjUpvalue* new_upvalue(Value* slot);
+#define IS_UPVALUE(value) is_obj_type(value, ObjTypeUpvalue)
+#define AS_UPVALUE(value) ((ObjUpvalue*)AS_OBJ(value))
 
-typedef struct
+ObjUpvalue* new_upvalue(VM* vm, Value* slot);
+
+struct ObjClass
 {
     Obj        obj;
     ObjString* name;
 #ifdef OBJECT_CACHE_CLASS_INITIALIZER
     Value initializer;
 #endif
+#ifdef TABLE_SMALL_LINEAR
+    // The most fields an instance of the class has had, which new instances
+    // make room for up front.
+    int field_count;
+#endif
+#ifdef OBJECT_METHOD_SELECTORS
+    int    method_base;
+    int    method_capacity;
+    Value* methods;
+#else
     Table methods;
-} ObjClass;
+#endif
+};
 
 #define IS_CLASS(value) is_obj_type(value, ObjTypeClass)
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 
-ObjClass* new_class(ObjString* name);
+ObjClass* new_class(VM* vm, ObjString* name);
+
+#ifdef OBJECT_METHOD_SELECTORS
+// Every method name gets a global selector the first time a class defines
+// it, and each class keeps a dense vector of methods indexed by selector,
+// covering only the range from its lowest to its highest selector. Holes
+// are nil, which no method can be, so a lookup is a bounds check and one
+// load.
+#define NO_SELECTOR (-1)
+
+static inline bool class_find_method(const ObjClass* klass, const ObjString* name,
+                                     Value* out_method)
+{
+    // NO_SELECTOR wraps around to a huge index, so it fails the bounds check too.
+    const unsigned index = (unsigned)(name->selector - klass->method_base);
+    if (index >= (unsigned)klass->method_capacity)
+        return false;
+
+    const Value method = klass->methods[index];
+    if (IS_NIL(method))
+        return false;
+
+    *out_method = method;
+    return true;
+}
+
+void class_define_method(VM* vm, ObjClass* klass, ObjString* name, Value method);
+void class_inherit(VM* vm, ObjClass* subclass, const ObjClass* superclass);
+#endif
 
 typedef struct
 {
@@ -140,7 +335,7 @@ typedef struct
 #define IS_INSTANCE(value) is_obj_type(value, ObjTypeInstance)
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 
-ObjInstance* new_instance(ObjClass* klass);
+ObjInstance* new_instance(VM* vm, ObjClass* klass);
 
 typedef struct
 {
@@ -152,6 +347,65 @@ typedef struct
 #define IS_BOUND_METHOD(value) is_obj_type(value, ObjTypeBoundMethod)
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 
-ObjBoundMethod* new_bound_method(Value recv, ObjClosure* method);
+ObjBoundMethod* new_bound_method(VM* vm, Value recv, ObjClosure* method);
+
+typedef struct Channel Channel;
+
+// Each ObjChannel holds one reference to its shared channel.
+typedef struct
+{
+    Obj      obj;
+    Channel* channel;
+} ObjChannel;
+
+#define IS_CHANNEL(value) is_obj_type(value, ObjTypeChannel)
+#define AS_CHANNEL(value) (((ObjChannel*)AS_OBJ(value))->channel)
+
+// Takes over the caller's reference to channel.
+ObjChannel* new_channel(VM* vm, Channel* channel);
+
+typedef struct
+{
+    const ObjClosure* closure;
+    uint8_t*          ip;
+    Value*            slots;
+} CallFrame;
+
+typedef enum
+{
+    FiberNew,
+    FiberSuspended,
+    FiberRunning,
+    FiberDone,
+} FiberState;
+
+// A fiber owns a value stack and call frames of its own. The VM works on
+// the running fiber's stack through its own copies of stack_top,
+// frame_count and the open upvalues, which are saved back into the fiber
+// when it yields or resumes another one. Every fiber waiting on the one
+// it resumed is FiberRunning, and reachable through caller.
+struct ObjFiber
+{
+    Obj         obj;
+    ObjClosure* closure;
+    ObjFiber*   caller;
+    FiberState  state;
+    Value*      stack;
+    Value*      stack_top;
+    int         stack_capacity;
+    CallFrame*  frames;
+    int         frame_count;
+    int         frame_capacity;
+    ObjUpvalue* open_upvalues;
+    // Run by the event loop rather than resumed, see event_loop.h.
+    bool        scheduled;
+};
+
+#define IS_FIBER(value) is_obj_type(value, ObjTypeFiber)
+#define AS_FIBER(value) ((ObjFiber*)AS_OBJ(value))
+
+// Room for frame_capacity frames of UINT8_COUNT slots each. closure is
+// NULL for the VM's main fiber.
+ObjFiber* new_fiber(VM* vm, ObjClosure* closure, int frame_capacity);
 
 #endif  // OBJECT_H
@@ -0,0 +1,23 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "common.h"
+#include "isolate.h"
+#include "value.h"
+
+// Whether fn can be cloned into another VM: a closure whose captured
+// values are all nil, booleans, numbers, strings or such closures. A
+// captured variable that is ever reassigned lives in an upvalue shared
+// with its enclosing function, so it can't be captured.
+bool can_clone_function(Value fn);
+
+// Calls fn once for each value received from inputs, up to the first nil,
+// spread over a pool of worker VMs, and returns a channel holding the
+// results in input order. fn is cloned into each worker, along with the
+// globals it refers to which hold values that could be sent, or functions
+// that could be cloned. A result that can't be sent, or a call that
+// fails, becomes nil. The inputs are consumed even when fn can't be
+// cloned, in which case this returns NULL.
+Channel* parallel_map(VM* vm, Value fn, Channel* inputs);
+
+#endif  // PARALLEL_H
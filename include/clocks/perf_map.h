@@ -0,0 +1,28 @@
+#ifndef PERF_MAP_H
+#define PERF_MAP_H
+
+#include "common.h"
+#include "object.h"
+
+#ifdef PERF_MAP
+
+// Lets perf attribute samples to Lox functions. Each function gets its own
+// copy of a tiny trampoline, which calls back into the interpreter loop,
+// and every copy is listed under the function's name in
+// /tmp/perf-<pid>.map. Calls on the main fiber then go through the callee's
+// trampoline, so the native stack has one trampoline per Lox frame. Code
+// run by other fibers is charged to the function which resumed them.
+typedef struct PerfMap PerfMap;
+
+// Returns NULL if the map file can't be created.
+PerfMap* new_perf_map();
+void     free_perf_map(PerfMap* map);
+
+// Returns a trampoline for func, listed in the map. The trampolines are
+// kept until the map is freed, as perf may have sampled them. Returns NULL
+// if no more can be made.
+void* perf_trampoline(PerfMap* map, const ObjFunction* func);
+
+#endif
+
+#endif  // PERF_MAP_H
@@ -0,0 +1,57 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+#include "common.h"
+
+#ifdef USDT_PROBES
+
+// USDT probes in the clocks provider, for bpftrace and other tracers, e.g.
+//
+//   bpftrace -e 'usdt:./clocks:clocks:gc__end { @ = hist(arg2); }'
+//
+// Each probe is a nop until a tracer attaches to it, which also counts
+// itself in the probe's semaphore. The probes whose arguments take work to
+// compute are only reached while their semaphore is set.
+
+#define _SDT_HAS_SEMAPHORES 1
+#include "sdt.h"
+
+#define CLOCKS_PROBE_SEMAPHORE(name) extern volatile unsigned short clocks_##name##_semaphore;
+
+CLOCKS_PROBE_SEMAPHORE(gc__begin)
+CLOCKS_PROBE_SEMAPHORE(gc__end)
+CLOCKS_PROBE_SEMAPHORE(function__entry)
+CLOCKS_PROBE_SEMAPHORE(function__return)
+CLOCKS_PROBE_SEMAPHORE(object__alloc)
+CLOCKS_PROBE_SEMAPHORE(string__intern)
+
+#define CLOCKS_PROBE_ENABLED(name) __builtin_expect(clocks_##name##_semaphore != 0, 0)
+
+// gc__begin(size_t heap_bytes)
+#define CLOCKS_GC_BEGIN(heap_bytes) DTRACE_PROBE1(clocks, gc__begin, heap_bytes)
+
+// gc__end(size_t heap_bytes, size_t bytes_freed, uint64_t pause_ns)
+#define CLOCKS_GC_END(heap_bytes, bytes_freed, pause_ns) \
+    DTRACE_PROBE3(clocks, gc__end, heap_bytes, bytes_freed, pause_ns)
+
+// function__entry(const char* name, int line, int depth), line being the
+// function's first and depth the number of frames, this one included.
+#define CLOCKS_FUNCTION_ENTRY(name, line, depth) \
+    DTRACE_PROBE3(clocks, function__entry, name, line, depth)
+
+// function__return(const char* name, int line, int depth), as above.
+#define CLOCKS_FUNCTION_RETURN(name, line, depth) \
+    DTRACE_PROBE3(clocks, function__return, name, line, depth)
+
+// object__alloc(const char* type, size_t size)
+#define CLOCKS_OBJECT_ALLOC(type, size) DTRACE_PROBE2(clocks, object__alloc, type, size)
+
+// string__intern(const char* chars, int length, int hit), hit being 1
+// if the string was interned already. Strings short enough to be stored in
+// a value aren't interned.
+#define CLOCKS_STRING_INTERN(chars, length, hit) \
+    DTRACE_PROBE3(clocks, string__intern, chars, length, hit)
+
+#endif
+
+#endif  // PROBES_H
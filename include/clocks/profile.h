@@ -0,0 +1,66 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+
+#ifdef PROFILE_OPCODES
+
+typedef struct
+{
+    const ObjFunction* func;
+    uint64_t           count;
+} FunctionCount;
+
+// Counts of every opcode the VM executes, of each pair of opcodes executed
+// one after the other, and of the instructions run in each function. The
+// functions are kept alive by the profile, so none of their counts can be
+// mistaken for those of a function allocated at the same address later.
+typedef struct
+{
+    uint64_t counts[OPCODE_COUNT];
+    uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT];
+    int      previous;
+
+    FunctionCount* functions;
+    int            function_count;
+    int            function_capacity;
+
+    // The function of the last instruction, and its count.
+    const ObjFunction* last_function;
+    uint64_t*          last_count;
+} OpcodeProfile;
+
+OpcodeProfile* new_opcode_profile();
+void           free_opcode_profile(OpcodeProfile* profile);
+
+uint64_t* function_counter(OpcodeProfile* profile, const ObjFunction* func);
+
+static inline void profile_instruction(OpcodeProfile* profile, const ObjFunction* func,
+                                       uint8_t instruction)
+{
+    profile->counts[instruction]++;
+    if (profile->previous != -1)
+        profile->pairs[profile->previous][instruction]++;
+    profile->previous = instruction;
+
+    if (func != profile->last_function)
+    {
+        profile->last_count    = function_counter(profile, func);
+        profile->last_function = func;
+    }
+    (*profile->last_count)++;
+}
+
+void mark_opcode_profile(VM* vm, const OpcodeProfile* profile);
+
+// Both list the opcodes, pairs and functions from the most executed down.
+void print_opcode_profile(const OpcodeProfile* profile, FILE* out);
+bool write_opcode_profile_json(const OpcodeProfile* profile, FILE* out);
+
+#endif
+
+#endif  // PROFILE_H
@@ -0,0 +1,38 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "value.h"
+
+#ifdef __linux__
+
+// Samples the call stack of a VM's thread at a fixed rate of its CPU time,
+// from a SIGPROF handler. The handler only reads the frames, and records
+// each stack in tables allocated up front, so the VM runs exactly as fast
+// as without a sampler between two samples.
+typedef struct Sampler Sampler;
+
+// Starts sampling the VM, which must run on the calling thread, rate times
+// a second. Returns NULL if the timer could not be set up.
+Sampler* start_sampler(VM* vm, int rate);
+
+// Stops sampling, keeping the stacks sampled so far.
+void stop_sampler(Sampler* sampler);
+void free_sampler(Sampler* sampler);
+
+// The sampled functions are kept alive, so that they can still be named
+// once the script is done.
+void mark_sampler(VM* vm, const Sampler* sampler);
+
+// Writes one line per distinct stack, in the folded format flame graph
+// tools take: the frames from the outermost in, each as function:line,
+// separated by semicolons and followed by the number of samples. Samples
+// taken outside of any call are counted as [vm], and those which didn't
+// fit in the tables as [dropped].
+bool write_folded_stacks(const Sampler* sampler, FILE* out);
+
+#endif
+
+#endif  // SAMPLER_H
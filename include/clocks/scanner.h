@@ -33,8 +33,15 @@ typedef struct
     int         line;
 } Token;
 
-void init_scanner(const char* source);
+typedef struct
+{
+    const char* start;
+    const char* current;
+    int         line;
+} Scanner;
+
+void init_scanner(Scanner* scanner, const char* source);
 
-Token scan_token();
+Token scan_token(Scanner* scanner);
 
 #endif  // SCANNER_H
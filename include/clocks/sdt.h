@@ -0,0 +1,98 @@
+#ifndef SDT_H
+#define SDT_H
+
+// The subset of SystemTap's <sys/sdt.h> which clocks uses, so that probes
+// don't depend on systemtap-sdt-dev being installed: STAP_PROBE and
+// DTRACE_PROBE with up to four arguments, and semaphores when
+// _SDT_HAS_SEMAPHORES is defined. A probe is a single nop. Its address
+// and where to find its arguments are recorded in a .note.stapsdt note,
+// which bpftrace, perf and SystemTap read to place a breakpoint on the nop
+// once they are attached. Elsewhere the macros expand to nothing.
+
+#if defined(__GNUC__) && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+
+// Arguments are described as size@operand, with a negative size for
+// signed ones. Arrays and pointers are addresses.
+#define CLOCKS_SDT_ARRAY(x)  (__builtin_classify_type(x) == 14 || __builtin_classify_type(x) == 5)
+#define CLOCKS_SDT_SIGNED(x) (!CLOCKS_SDT_ARRAY(x) && ((__typeof__(x))-1 < (__typeof__(x))1))
+#define CLOCKS_SDT_SIZE(x)   (CLOCKS_SDT_ARRAY(x) ? sizeof(void*) : sizeof(x))
+
+// %n prints the negated size, hence the inverted sign.
+#define CLOCKS_SDT_ARG(n, x)                                                   \
+    [clocks_sdt_s##n] "n"((CLOCKS_SDT_SIGNED(x) ? 1 : -1) * (int)CLOCKS_SDT_SIZE(x)), \
+        [clocks_sdt_a##n] "nor"(x)
+#define CLOCKS_SDT_OPERAND(n) "%n[clocks_sdt_s" #n "]@%[clocks_sdt_a" #n "]"
+
+#ifdef _SDT_HAS_SEMAPHORES
+#define CLOCKS_SDT_SEMAPHORE(provider, name) ".8byte " #provider "_" #name "_semaphore\n"
+#else
+#define CLOCKS_SDT_SEMAPHORE(provider, name) ".8byte 0\n"
+#endif
+
+// The note points at the nop, at .stapsdt.base, by which tracers adjust
+// the addresses once the binary is loaded, and at the semaphore, if any.
+#define CLOCKS_SDT_PROBE(provider, name, operands, ...)                   \
+    __asm__ __volatile__(                                                 \
+        "990: nop\n"                                                      \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n"                     \
+        ".balign 4\n"                                                     \
+        ".4byte 992f-991f, 994f-993f, 3\n"                                \
+        "991: .asciz \"stapsdt\"\n"                                       \
+        "992: .balign 4\n"                                                \
+        "993: .8byte 990b\n"                                              \
+        ".8byte _.stapsdt.base\n" CLOCKS_SDT_SEMAPHORE(provider, name)    \
+        ".asciz \"" #provider "\"\n"                                      \
+        ".asciz \"" #name "\"\n"                                          \
+        ".asciz \"" operands "\"\n"                                       \
+        "994: .balign 4\n"                                                \
+        ".popsection\n"                                                   \
+        ".ifndef _.stapsdt.base\n"                                        \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+        ".weak _.stapsdt.base\n"                                          \
+        ".hidden _.stapsdt.base\n"                                        \
+        "_.stapsdt.base: .space 1\n"                                      \
+        ".size _.stapsdt.base, 1\n"                                       \
+        ".popsection\n"                                                   \
+        ".endif\n"                                                        \
+        :                                                                 \
+        : __VA_ARGS__)
+
+#define STAP_PROBE(provider, name) CLOCKS_SDT_PROBE(provider, name, "", )
+
+#define STAP_PROBE1(provider, name, a1) \
+    CLOCKS_SDT_PROBE(provider, name, CLOCKS_SDT_OPERAND(1), CLOCKS_SDT_ARG(1, a1))
+
+#define STAP_PROBE2(provider, name, a1, a2)                                             \
+    CLOCKS_SDT_PROBE(provider, name, CLOCKS_SDT_OPERAND(1) " " CLOCKS_SDT_OPERAND(2), \
+                     CLOCKS_SDT_ARG(1, a1), CLOCKS_SDT_ARG(2, a2))
+
+#define STAP_PROBE3(provider, name, a1, a2, a3)                                      \
+    CLOCKS_SDT_PROBE(provider, name,                                                 \
+                     CLOCKS_SDT_OPERAND(1) " " CLOCKS_SDT_OPERAND(2) " "            \
+                         CLOCKS_SDT_OPERAND(3),                                      \
+                     CLOCKS_SDT_ARG(1, a1), CLOCKS_SDT_ARG(2, a2), CLOCKS_SDT_ARG(3, a3))
+
+#define STAP_PROBE4(provider, name, a1, a2, a3, a4)                                  \
+    CLOCKS_SDT_PROBE(provider, name,                                                 \
+                     CLOCKS_SDT_OPERAND(1) " " CLOCKS_SDT_OPERAND(2) " "            \
+                         CLOCKS_SDT_OPERAND(3) " " CLOCKS_SDT_OPERAND(4),           \
+                     CLOCKS_SDT_ARG(1, a1), CLOCKS_SDT_ARG(2, a2), CLOCKS_SDT_ARG(3, a3), \
+                     CLOCKS_SDT_ARG(4, a4))
+
+#else
+
+#define STAP_PROBE(provider, name)
+#define STAP_PROBE1(provider, name, a1)
+#define STAP_PROBE2(provider, name, a1, a2)
+#define STAP_PROBE3(provider, name, a1, a2, a3)
+#define STAP_PROBE4(provider, name, a1, a2, a3, a4)
+
+#endif
+
+#define DTRACE_PROBE(provider, name)                      STAP_PROBE(provider, name)
+#define DTRACE_PROBE1(provider, name, a1)                 STAP_PROBE1(provider, name, a1)
+#define DTRACE_PROBE2(provider, name, a1, a2)             STAP_PROBE2(provider, name, a1, a2)
+#define DTRACE_PROBE3(provider, name, a1, a2, a3)         STAP_PROBE3(provider, name, a1, a2, a3)
+#define DTRACE_PROBE4(provider, name, a1, a2, a3, a4)     STAP_PROBE4(provider, name, a1, a2, a3, a4)
+
+#endif  // SDT_H
@@ -5,32 +5,47 @@
 
 typedef struct ObjString ObjString;
 
+#ifdef TABLE_SMALL_LINEAR
+// Tables with at most this many keys keep them packed at the start of keys
+// and values, without hashes, and are searched linearly. The hashed arrays
+// are allocated only past it.
+#define TABLE_SMALL_CAPACITY 8
+#endif
+
+// Hashed tables keep keys, their cached hashes and values in separate
+// arrays, so probing scans only keys and hashes, and resizing never has to
+// dereference a key to rehash it.
 typedef struct
 {
-    ObjString* key;
-    Value      value;
-} Entry;
-
-typedef struct
-{
-    int    count;
-    int    capacity;
-    Entry* entries;
+    int         count;
+    int         capacity;
+    ObjString** keys;
+    uint32_t*   hashes;
+    Value*      values;
 } Table;
 
 void init_table(Table* table);
-void free_table(Table* table);
+void free_table(VM* vm, Table* table);
 
-bool table_insert(Table* table, ObjString* key, Value value);
+// The bytes allocated for the table's entries.
+size_t table_bytes(const Table* table);
+
+bool table_insert(VM* vm, Table* table, ObjString* key, Value value);
 bool table_find(const Table* table, const ObjString* key, Value* out_val);
 bool table_remove(Table* table, const ObjString* key);
 
-void table_copy(const Table* src, Table* dest);
+void table_copy(VM* vm, const Table* src, Table* dest);
+
+#ifdef TABLE_SMALL_LINEAR
+// Gives an empty table room for count keys, up to TABLE_SMALL_CAPACITY, in
+// a single allocation.
+void table_reserve_small(VM* vm, Table* table, int count);
+#endif
 
 ObjString* table_find_string(const Table* table, const char* chars,
                              int length, uint32_t hash);
 
-void mark_table(const Table* table);
-void table_remove_white(Table* table);
+void mark_table(VM* vm, const Table* table);
+void table_remove_white(const VM* vm, Table* table);
 
 #endif  // TABLE_H
@@ -0,0 +1,23 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+#include "common.h"
+
+// Streams for the traces a VM writes when asked to, see VM. Traces are
+// written through a large buffer, as a line per instruction would otherwise
+// cost a write each.
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+// Opens a trace written to path, or to stderr if path is NULL. Returns NULL
+// if path can't be opened. The trace is complete once closed with fclose().
+FILE* open_trace(const char* path);
+
+#ifdef __linux__
+// Like open_trace(), but keeps only the last ring_size bytes in memory,
+// which are written from their first whole line on when it is closed.
+FILE* open_trace_ring(const char* path, size_t ring_size);
+#endif
+
+#endif  // TRACE_H
@@ -1,9 +1,12 @@
 #ifndef VALUE_H
 #define VALUE_H
 
+#include <stdio.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
+typedef struct VM  VM;
 
 #ifdef VALUE_NAN_BOXING
 
@@ -16,17 +19,38 @@ typedef struct Obj Obj;
 #define TAG_FALSE 2
 #define TAG_TRUE  3
 
+// Bits 48 and 49 of a quiet NaN tag the immediates carrying a payload.
+#define TAG_MASK         ((uint64_t)3 << 48)
+#define TAG_SHORT_STRING ((uint64_t)1 << 48)
+#define TAG_INTEGER      ((uint64_t)2 << 48)
+
 typedef uint64_t Value;
 
 #define IS_BOOL(value)   (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)    ((value) == NIL_VAL)
-#define IS_NUMBER(value) (((value)&QNAN) != QNAN)
+#define IS_DOUBLE(value) (((value)&QNAN) != QNAN)
 #define IS_OBJ(value)    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value)   ((value) == TRUE_VAL)
-#define AS_NUMBER(value) value_to_num(value)
 #define AS_OBJ(value)    ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
+#ifdef VALUE_SMALL_INTEGERS
+// Numbers are either doubles or 32 bit integers stored in the low half of
+// the payload. Both are the same Lox type, and any integer can be widened
+// to a double without losing precision.
+#define IS_INTEGER(value) \
+    (((value) & (SIGN_BIT | QNAN | TAG_MASK)) == (QNAN | TAG_INTEGER))
+#define IS_NUMBER(value)  (IS_DOUBLE(value) || IS_INTEGER(value))
+
+#define AS_INTEGER(value) ((int32_t)(uint32_t)(value))
+#define AS_NUMBER(value)  value_as_number(value)
+
+#define INTEGER_VAL(integer) ((Value)(QNAN | TAG_INTEGER | (uint32_t)(int32_t)(integer)))
+#else
+#define IS_NUMBER(value) IS_DOUBLE(value)
+#define AS_NUMBER(value) value_to_num(value)
+#endif
+
 static inline double value_to_num(Value value)
 {
     double num;
@@ -34,9 +58,16 @@ static inline double value_to_num(Value value)
     return num;
 }
 
-#define NIL_VAL         ((Value)(uint8_t)(QNAN | TAG_NIL))
-#define FALSE_VAL       ((Value)(uint8_t)(QNAN | TAG_FALSE))
-#define TRUE_VAL        ((Value)(uint8_t)(QNAN | TAG_TRUE))
+#ifdef VALUE_SMALL_INTEGERS
+static inline double value_as_number(Value value)
+{
+    return IS_INTEGER(value) ? (double)AS_INTEGER(value) : value_to_num(value);
+}
+#endif
+
+#define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define BOOL_VAL(b)     ((b) ? TRUE_VAL : FALSE_VAL)
 #define NUMBER_VAL(num) num_to_value(num)
 #define OBJ_VAL(obj)    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
@@ -48,6 +79,36 @@ static inline Value num_to_value(double num)
     return value;
 }
 
+#ifdef VALUE_SHORT_STRINGS
+// Strings of up to six bytes live in the payload itself, one byte per octet
+// starting from the lowest, padded with zero bytes.
+#define SHORT_STRING_MAX 6
+
+#define IS_SHORT_STRING(value) \
+    (((value) & (SIGN_BIT | QNAN | TAG_MASK)) == (QNAN | TAG_SHORT_STRING))
+
+static inline Value short_string_val(const char* chars, int length)
+{
+    Value value = QNAN | TAG_SHORT_STRING;
+    for (int i = 0; i < length; i++)
+        value |= (Value)(uint8_t)chars[i] << (8 * i);
+    return value;
+}
+
+static inline int short_string_chars(Value value, char* chars)
+{
+    int length = 0;
+    for (; length < SHORT_STRING_MAX; length++)
+    {
+        const char c = (char)(value >> (8 * length));
+        if (c == '\0')
+            break;
+        chars[length] = c;
+    }
+    return length;
+}
+#endif
+
 #else
 
 typedef enum
@@ -94,9 +155,9 @@ typedef struct
 bool values_equal(Value a, Value b);
 
 void init_value_array(ValueArray* array);
-void free_value_array(ValueArray* array);
-void write_value_array(ValueArray* array, Value value);
+void free_value_array(VM* vm, ValueArray* array);
+void write_value_array(VM* vm, ValueArray* array, Value value);
 
-void print_value(Value value);
+void print_value(FILE* out, Value value);
 
 #endif  // VALUE_H
@@ -1,34 +1,43 @@
 #ifndef VM_H
 #define VM_H
 
+#include "allocation_profile.h"
 #include "common.h"
+#include "compiler.h"
+#include "event_loop.h"
+#include "heap_snapshot.h"
+#include "isolate.h"
+#include "memory.h"
 #include "object.h"
+#include "perf_map.h"
+#include "profile.h"
+#include "sampler.h"
 #include "table.h"
 #include "value.h"
 
 #define FRAMES_MAX 64
-#define STACK_MAX  (FRAMES_MAX * UINT8_COUNT)
 
-typedef struct
-{
-    const ObjClosure* closure;
-    uint8_t*          ip;
-    Value*            slots;
-} CallFrame;
+// Fibers start with room for fewer calls than the main fiber, so each one
+// stays small, and grow up to FRAMES_MAX as they nest deeper.
+#define FIBER_INITIAL_FRAMES 16
 
-typedef struct
+struct VM
 {
-    Value* stack_top;
-    Value  stack[STACK_MAX];
-
-    int       frame_count;
-    CallFrame frames[FRAMES_MAX];
+    // Registers of the running fiber, see ObjFiber.
+    Value*     stack_top;
+    Value*     stack;
+    int        frame_count;
+    int        frame_capacity;
+    CallFrame* frames;
+    ObjFiber*  fiber;
+    ObjFiber*  main_fiber;
 
     Table globals;
     Table strings;
 
-    size_t bytes_allocated;
-    size_t next_gc_thresh;
+    size_t  bytes_allocated;
+    size_t  next_gc_thresh;
+    GcStats gc_stats;
 
 #ifdef GC_OPTIMIZE_CLEARING_MARK
     bool mark_value;
@@ -36,13 +45,58 @@ typedef struct
 
     ObjString* init_string;
 
+#ifdef OBJECT_METHOD_SELECTORS
+    ValueArray selectors;
+#endif
+
     Obj*        obj_head;
     ObjUpvalue* open_upvalues_head;
 
     int   gray_count;
     int   gray_capacity;
     Obj** gray_stack;
-} VM;
+
+    // The compilation in progress, if any, whose functions are GC roots.
+    Parser* parser;
+
+    // Streams for print statements and error reports, stdout and stderr
+    // unless the embedder redirects them.
+    FILE* out;
+    FILE* err;
+
+    // Streams for the instructions run() executes, the bytecode compiled and
+    // the collector's work, or NULL when they aren't traced, see trace.h.
+    FILE* trace_execution;
+    FILE* trace_code;
+    FILE* trace_gc;
+
+    // Isolates spawned by this VM, joined when it is freed.
+    Isolate* isolates;
+
+#ifdef __linux__
+    // Created by the first native that needs it.
+    EventLoop* event_loop;
+
+    // Samples the frames, if not NULL, see sampler.h.
+    Sampler* sampler;
+#endif
+
+#ifdef PERF_MAP
+    // Lists the functions called for perf, if not NULL.
+    PerfMap* perf_map;
+#endif
+
+    // Records the references marked while a snapshot is taken.
+    HeapSnapshot* heap_snapshot;
+
+    // Samples the objects allocated, if not NULL.
+    AllocationProfile* allocation_profile;
+
+#ifdef PROFILE_OPCODES
+    // Counts the instructions run() executes, if not NULL.
+    OpcodeProfile* opcode_profile;
+#endif
+};
 
 typedef enum
 {
@@ -51,21 +105,34 @@ typedef enum
     InterpretRuntimeError
 } InterpretResult;
 
-extern VM vm;
+// Each VM is an isolated interpreter with its own heap, globals and
+// interned strings. A VM must only be used by one thread at a time.
+VM*  vm_new();
+void vm_free(VM* vm);
+
+InterpretResult vm_interpret(VM* vm, const char* source);
+
+// Calls callee with args and stores what it returns in out_result. Only
+// valid while vm isn't already running code.
+InterpretResult vm_call(VM* vm, Value callee, int arg_count, const Value* args,
+                        Value* out_result);
 
-void init_vm();
-void free_vm();
+// Switches to fiber, saving the running one as it is. A new fiber starts
+// with value as its argument, if its function takes one, and a suspended
+// one gets it as the result of the call that suspended it. Natives which
+// switch fibers drop their own call from the stack first.
+void vm_transfer(VM* vm, ObjFiber* fiber, Value value);
 
-void push(Value value);
+void define_native(VM* vm, const char* name, NativeFn func);
+
+void push(VM* vm, Value value);
 
 #ifdef VM_OPTIMIZED_POP
-Value pop_and_return();
-void  pop();
+Value pop_and_return(VM* vm);
+void  pop(VM* vm);
 #else
-Value pop_and_return();
-Value pop();
+Value pop_and_return(VM* vm);
+Value pop(VM* vm);
 #endif
 
-InterpretResult interpret(const char* source);
-
 #endif  // VM_H
@@ -0,0 +1,262 @@
+#include "clocks/allocation_profile.h"
+
+#include <stdlib.h>
+
+#include <clocks/chunk.h>
+#include <clocks/memory.h>
+#include <clocks/vm.h>
+
+// Only the sites which allocated the most bytes are printed.
+#define PRINT_LIMIT 30
+
+static void* allocate_or_exit(size_t size)
+{
+    void* result = calloc(1, size);
+    if (result == NULL)
+        exit(1);
+    return result;
+}
+
+static void* grow_or_exit(void* pointer, size_t size)
+{
+    void* result = realloc(pointer, size);
+    if (result == NULL)
+        exit(1);
+    return result;
+}
+
+// Xorshift, which is plenty to keep the samples from lining up with the
+// allocations.
+static int64_t next_interval(AllocationProfile* profile)
+{
+    if (profile->interval == 1)
+        return 1;
+
+    uint32_t x = profile->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    profile->random = x;
+    return 1 + (int64_t)(x % (uint32_t)(2 * profile->interval - 1));
+}
+
+AllocationProfile* new_allocation_profile(int interval)
+{
+    AllocationProfile* profile = (AllocationProfile*)allocate_or_exit(
+        sizeof(AllocationProfile));
+    profile->interval  = interval;
+    profile->random    = 2463534242u;
+    profile->countdown = next_interval(profile);
+    return profile;
+}
+
+void free_allocation_profile(AllocationProfile* profile)
+{
+    free(profile->sites);
+    free(profile->index);
+    free(profile->sampled);
+    free(profile);
+}
+
+static uint32_t hash_site(const ObjFunction* func, int line, ObjType type)
+{
+    uint32_t hash = (uint32_t)((uintptr_t)func >> 4) * 2654435761u;
+    hash ^= (uint32_t)line * 40503u;
+    hash ^= (uint32_t)type * 97u;
+    return hash;
+}
+
+// Returns the slot of the site in the index, or the empty slot it belongs
+// in.
+static int* find_index(const AllocationProfile* profile, const ObjFunction* func, int line,
+                       ObjType type, bool compiling)
+{
+    const uint32_t mask  = (uint32_t)profile->index_capacity - 1;
+    uint32_t       index = hash_site(func, line, type) & mask;
+    while (true)
+    {
+        int* slot = &profile->index[index];
+        if (*slot == -1)
+            return slot;
+
+        const AllocationSite* site = &profile->sites[*slot];
+        if (site->func == func && site->line == line && site->type == type
+            && site->compiling == compiling)
+            return slot;
+
+        index = (index + 1) & mask;
+    }
+}
+
+static void grow_index(AllocationProfile* profile)
+{
+    free(profile->index);
+    profile->index_capacity = GROW_CAPACITY(profile->index_capacity);
+    profile->index = (int*)grow_or_exit(NULL, sizeof(int) * profile->index_capacity);
+    for (int i = 0; i < profile->index_capacity; i++)
+        profile->index[i] = -1;
+
+    for (int i = 0; i < profile->site_count; i++)
+    {
+        const AllocationSite* site = &profile->sites[i];
+        *find_index(profile, site->func, site->line, site->type, site->compiling) = i;
+    }
+}
+
+static int find_site(AllocationProfile* profile, const ObjFunction* func, int line,
+                     ObjType type, bool compiling)
+{
+    if (profile->site_count + 1 > profile->index_capacity * 3 / 4)
+        grow_index(profile);
+
+    int* slot = find_index(profile, func, line, type, compiling);
+    if (*slot != -1)
+        return *slot;
+
+    if (profile->site_count == profile->site_capacity)
+    {
+        profile->site_capacity = GROW_CAPACITY(profile->site_capacity);
+        profile->sites         = (AllocationSite*)grow_or_exit(
+            profile->sites, sizeof(AllocationSite) * profile->site_capacity);
+    }
+
+    *slot                = profile->site_count;
+    AllocationSite* site = &profile->sites[profile->site_count++];
+    *site = (AllocationSite){.func = func, .line = line, .type = type, .compiling = compiling};
+    return *slot;
+}
+
+static int current_line(const CallFrame* frame)
+{
+    const ObjFunction* func   = frame->closure->func;
+    int                offset = (int)(frame->ip - func->chunk.code) - 1;
+    if (offset < 0)
+        offset = 0;
+
+#ifdef CHUNK_LINE_RUN_LENGTH_ENCODING
+    return get_line(&func->chunk, offset);
+#else
+    return func->chunk.lines[offset];
+#endif
+}
+
+// Every sampled byte stands for interval bytes, so an object with k of
+// them stands for k * interval bytes, in objects of its size.
+void sample_allocation(VM* vm, AllocationProfile* profile, const Obj* object, size_t size)
+{
+    int64_t points = 0;
+    while (profile->countdown <= 0)
+    {
+        profile->countdown += next_interval(profile);
+        points++;
+    }
+
+    const ObjFunction* func = NULL;
+    int                line = 0;
+    if (vm->frame_count > 0)
+    {
+        const CallFrame* frame = &vm->frames[vm->frame_count - 1];
+        func                   = frame->closure->func;
+        line                   = current_line(frame);
+    }
+
+    const int       index = find_site(profile, func, line, obj_type(object),
+                                      func == NULL && vm->parser != NULL);
+    AllocationSite* site  = &profile->sites[index];
+    const double    bytes = (double)points * profile->interval;
+    site->bytes += bytes;
+    site->objects += bytes / (double)size;
+    site->live += bytes / (double)size;
+
+    if (profile->sampled_count == profile->sampled_capacity)
+    {
+        profile->sampled_capacity = GROW_CAPACITY(profile->sampled_capacity);
+        profile->sampled          = (SampledObject*)grow_or_exit(
+            profile->sampled, sizeof(SampledObject) * profile->sampled_capacity);
+    }
+    profile->sampled[profile->sampled_count++] = (SampledObject){object, index,
+                                                                 bytes / (double)size, 0};
+}
+
+void mark_allocation_profile(VM* vm, const AllocationProfile* profile)
+{
+    for (int i = 0; i < profile->site_count; i++)
+        mark_object(vm, (Obj*)profile->sites[i].func);
+}
+
+void sweep_allocation_profile(const VM* vm, AllocationProfile* profile)
+{
+    int kept = 0;
+    for (int i = 0; i < profile->sampled_count; i++)
+    {
+        SampledObject*  sampled = &profile->sampled[i];
+        AllocationSite* site    = &profile->sites[sampled->site];
+#ifdef GC_OPTIMIZE_CLEARING_MARK
+        const bool marked = obj_mark(sampled->object) == vm->mark_value;
+#else
+        (void)vm;
+        const bool marked = obj_mark(sampled->object);
+#endif
+        if (!marked)
+        {
+            site->live -= sampled->objects;
+            continue;
+        }
+
+        if (sampled->collections++ == 0)
+            site->survived += sampled->objects;
+        site->survivals += sampled->objects;
+        profile->sampled[kept++] = *sampled;
+    }
+    profile->sampled_count = kept;
+}
+
+static int compare_sites(const void* a, const void* b)
+{
+    const double x = ((const AllocationSite*)a)->bytes;
+    const double y = ((const AllocationSite*)b)->bytes;
+    return (x < y) - (x > y);
+}
+
+static double percent(double part, double total)
+{
+    return total > 0 ? 100.0 * part / total : 0;
+}
+
+void print_allocation_profile(const AllocationProfile* profile, FILE* out)
+{
+    AllocationSite* sites = (AllocationSite*)allocate_or_exit(
+        sizeof(AllocationSite) * (profile->site_count + 1));
+    double total = 0;
+    for (int i = 0; i < profile->site_count; i++)
+    {
+        sites[i] = profile->sites[i];
+        total += sites[i].bytes;
+    }
+    qsort(sites, profile->site_count, sizeof(AllocationSite), compare_sites);
+
+    // survived is the share of objects which outlived a collection, and gcs
+    // the mean number of collections they outlived.
+    fprintf(out, "== allocations (about %.0f bytes, sampled every %d) ==\n", total,
+            profile->interval);
+    fprintf(out, "%-32s %-12s %12s %7s %10s %9s %8s %10s\n", "site", "type", "bytes", "",
+            "objects", "survived", "gcs", "live");
+    for (int i = 0; i < profile->site_count && i < PRINT_LIMIT; i++)
+    {
+        const AllocationSite* site = &sites[i];
+
+        char name[32];
+        if (site->func != NULL)
+            snprintf(name, sizeof(name), "%s:%d",
+                     site->func->name != NULL ? site->func->name->chars : "script",
+                     site->line);
+        else
+            snprintf(name, sizeof(name), "%s", site->compiling ? "[compile]" : "[vm]");
+
+        fprintf(out, "%-32s %-12s %12.0f %6.2f%% %10.0f %8.1f%% %8.2f %10.0f\n", name,
+                obj_type_name(site->type), site->bytes, percent(site->bytes, total),
+                site->objects, percent(site->survived, site->objects),
+                site->objects > 0 ? site->survivals / site->objects : 0, site->live);
+    }
+    free(sites);
+}
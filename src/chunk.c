@@ -19,29 +19,29 @@ void init_chunk(Chunk* chunk)
     init_value_array(&chunk->constants);
 }
 
-void free_chunk(Chunk* chunk)
+void free_chunk(VM* vm, Chunk* chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
 #ifdef CHUNK_LINE_RUN_LENGTH_ENCODING
-    FREE_ARRAY(LineStart, chunk->lines, chunk->line_capacity)
+    FREE_ARRAY(vm, LineStart, chunk->lines, chunk->line_capacity)
 #else
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
 #endif
-    free_value_array(&chunk->constants);
+    free_value_array(vm, &chunk->constants);
     init_chunk(chunk);
 }
 
-void write_chunk(Chunk* chunk, uint8_t byte, int line)
+void write_chunk(VM* vm, Chunk* chunk, uint8_t byte, int line)
 {
     if (chunk->capacity < chunk->count + 1)
     {
         const int old_capacity = chunk->capacity;
 
         chunk->capacity = GROW_CAPACITY(old_capacity);
-        chunk->code     = GROW_ARRAY(uint8_t, chunk->code,
+        chunk->code     = GROW_ARRAY(vm, uint8_t, chunk->code,
                                      old_capacity, chunk->capacity);
 #ifndef CHUNK_LINE_RUN_LENGTH_ENCODING
-        chunk->lines = GROW_ARRAY(int, chunk->lines,
+        chunk->lines = GROW_ARRAY(vm, int, chunk->lines,
                                   old_capacity, chunk->capacity);
 #endif
     }
@@ -58,7 +58,7 @@ void write_chunk(Chunk* chunk, uint8_t byte, int line)
     {
         const int old_capacity = chunk->line_capacity;
         chunk->line_capacity   = GROW_CAPACITY(old_capacity);
-        chunk->lines           = GROW_ARRAY(LineStart, chunk->lines,
+        chunk->lines           = GROW_ARRAY(vm, LineStart, chunk->lines,
                                             old_capacity, chunk->line_capacity);
     }
 
@@ -84,7 +84,7 @@ int get_line(const Chunk* chunk, int offset)
         const LineStart* current = &chunk->lines[mid];
 
         if (offset < current->offset)
-            end = mid + 1;
+            end = mid - 1;
         else if (mid == chunk->line_count - 1 || offset < chunk->lines[mid + 1].offset)
             return current->line;
         else
@@ -93,10 +93,10 @@ int get_line(const Chunk* chunk, int offset)
 }
 #endif
 
-int add_constant(Chunk* chunk, Value value)
+int add_constant(VM* vm, Chunk* chunk, Value value)
 {
-    push(value);
-    write_value_array(&chunk->constants, value);
-    pop();
+    push(vm, value);
+    write_value_array(vm, &chunk->constants, value);
+    pop(vm);
     return chunk->constants.count - 1;
 }
@@ -6,22 +6,13 @@
 
 #include <clocks/chunk.h>
 #include <clocks/common.h>
+#include <clocks/debug.h>
 #include <clocks/memory.h>
 #include <clocks/object.h>
 #include <clocks/scanner.h>
 #include <clocks/value.h>
+#include <clocks/vm.h>
 
-#ifdef DEBUG_PRINT_CODE
-#include <clocks/debug.h>
-#endif
-
-typedef struct
-{
-    Token current;
-    Token previous;
-    bool  had_error;
-    bool  panic_mode;
-} Parser;
 
 typedef enum
 {
@@ -38,7 +29,7 @@ typedef enum
     PrecPrimary
 } Precedence;
 
-typedef void (*ParseFn)(bool can_assign);
+typedef void (*ParseFn)(Parser* parser, bool can_assign);
 
 typedef struct
 {
@@ -52,8 +43,22 @@ typedef struct
     Token name;
     int   depth;
     bool  is_captured;
+#ifdef COMPILER_CAPTURE_BY_VALUE
+    bool is_assigned;
+#endif
 } Local;
 
+#ifdef COMPILER_CAPTURE_BY_VALUE
+// An OpClosure capture operand for a local of the function being compiled.
+// Once the local goes out of scope without ever being reassigned, the
+// operand is patched to capture its value instead of an upvalue.
+typedef struct
+{
+    int local;
+    int offset;
+} CaptureSite;
+#endif
+
 typedef struct
 {
     uint8_t index;
@@ -77,6 +82,11 @@ typedef struct Compiler
     int              local_count;
     Upvalue          upvalues[UINT8_COUNT];
     int              scope_depth;
+#ifdef COMPILER_CAPTURE_BY_VALUE
+    CaptureSite* capture_sites;
+    int          capture_count;
+    int          capture_capacity;
+#endif
 } Compiler;
 
 typedef struct ClassCompiler
@@ -85,179 +95,197 @@ typedef struct ClassCompiler
     bool                  has_superclass;
 } ClassCompiler;
 
+// All state of a single compilation, including the functions and classes
+// being compiled, which the VM reaches through to mark them as roots.
+struct Parser
+{
+    VM*            vm;
+    Scanner        scanner;
+    Token          current;
+    Token          previous;
+    bool           had_error;
+    bool           panic_mode;
+    Compiler*      compiler;
+    ClassCompiler* class_compiler;
+};
+
 static const ParseRule* get_rule(TokenType type);
 
-static void    parse_precedence(Precedence prec);
-static void    expression();
-static void    statement();
-static void    declaration();
-static uint8_t identifier_constant(const Token* name);
-static int     resolve_local(const Compiler* compiler, const Token* name);
-static int     resolve_upvalue(Compiler* compiler, const Token* name);
-static uint8_t argument_list();
+static void    parse_precedence(Parser* parser, Precedence prec);
+static void    expression(Parser* parser);
+static void    statement(Parser* parser);
+static void    declaration(Parser* parser);
+static uint8_t identifier_constant(Parser* parser, const Token* name);
+static int     resolve_local(Parser* parser, const Compiler* compiler, const Token* name);
+static int     resolve_upvalue(Parser* parser, Compiler* compiler, const Token* name);
+static uint8_t argument_list(Parser* parser);
 static Token   synthetic_token(const char* text);
 
-Parser         parser;
-Compiler*      current       = NULL;
-ClassCompiler* current_class = NULL;
-
-static Chunk* current_chunk()
+static Chunk* current_chunk(Parser* parser)
 {
-    return &current->func->chunk;
+    return &parser->compiler->func->chunk;
 }
 
-static void error_at(const Token* token, const char* message)
+static void error_at(Parser* parser, const Token* token, const char* message)
 {
-    if (parser.panic_mode)
+    if (parser->panic_mode)
         return;
-    parser.panic_mode = true;
-    parser.had_error  = true;
+    parser->panic_mode = true;
+    parser->had_error  = true;
 
-    fprintf(stderr, "[line %d] Error", token->line);
+    fprintf(parser->vm->err, "[line %d] Error", token->line);
 
     if (token->type == TokenEOF)
-        fprintf(stderr, " at end");
+        fprintf(parser->vm->err, " at end");
     else if (token->type == TokenError)
     {}
     else
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(parser->vm->err, " at '%.*s'", token->length, token->start);
 
-    fprintf(stderr, ": %s\n", message);
+    fprintf(parser->vm->err, ": %s\n", message);
 }
 
-static void error(const char* message)
+static void error(Parser* parser, const char* message)
 {
-    error_at(&parser.previous, message);
+    error_at(parser, &parser->previous, message);
 }
 
-static void error_at_current(const char* message)
+static void error_at_current(Parser* parser, const char* message)
 {
-    error_at(&parser.current, message);
+    error_at(parser, &parser->current, message);
 }
 
-static void advance()
+static void advance(Parser* parser)
 {
-    parser.previous = parser.current;
+    parser->previous = parser->current;
     while (true)
     {
-        parser.current = scan_token();
-        if (parser.current.type != TokenError)
+        parser->current = scan_token(&parser->scanner);
+        if (parser->current.type != TokenError)
             break;
-        error_at_current(parser.current.start);
+        error_at_current(parser, parser->current.start);
     }
 }
 
-static void consume(TokenType type, const char* message)
+static void consume(Parser* parser, TokenType type, const char* message)
 {
-    if (parser.current.type == type)
-        advance();
+    if (parser->current.type == type)
+        advance(parser);
     else
-        error_at_current(message);
+        error_at_current(parser, message);
 }
 
-static bool check(TokenType type)
+static bool check(Parser* parser, TokenType type)
 {
-    return parser.current.type == type;
+    return parser->current.type == type;
 }
 
-static bool match(TokenType type)
+static bool match(Parser* parser, TokenType type)
 {
-    if (!check(type))
+    if (!check(parser, type))
         return false;
-    advance();
+    advance(parser);
     return true;
 }
 
-static void emit_byte(uint8_t byte)
+static void emit_byte(Parser* parser, uint8_t byte)
 {
-    write_chunk(current_chunk(), byte, parser.previous.line);
+    write_chunk(parser->vm, current_chunk(parser), byte, parser->previous.line);
 }
 
-static void emit_bytes(uint8_t byte1, uint8_t byte2)
+static void emit_bytes(Parser* parser, uint8_t byte1, uint8_t byte2)
 {
-    emit_byte(byte1);
-    emit_byte(byte2);
+    emit_byte(parser, byte1);
+    emit_byte(parser, byte2);
 }
 
 #define BACKPATCH_PLACEHOLDER 0xFF
 
-static int emit_jump(uint8_t jump_instruction)
+static int emit_jump(Parser* parser, uint8_t jump_instruction)
 {
-    emit_byte(jump_instruction);
-    emit_byte(BACKPATCH_PLACEHOLDER);
-    emit_byte(BACKPATCH_PLACEHOLDER);
-    return current_chunk()->count - 2;
+    emit_byte(parser, jump_instruction);
+    emit_byte(parser, BACKPATCH_PLACEHOLDER);
+    emit_byte(parser, BACKPATCH_PLACEHOLDER);
+    return current_chunk(parser)->count - 2;
 }
 
-static void emit_loop(int loop_start)
+static void emit_loop(Parser* parser, int loop_start)
 {
-    emit_byte(OpLoop);
+    emit_byte(parser, OpLoop);
 
-    const int offset = current_chunk()->count - loop_start + 2;
+    const int offset = current_chunk(parser)->count - loop_start + 2;
     if (offset > UINT16_MAX)
-        error("Loop body too large.");
+        error(parser, "Loop body too large.");
 
-    emit_byte((offset >> 8) & BACKPATCH_PLACEHOLDER);
-    emit_byte(offset & BACKPATCH_PLACEHOLDER);
+    emit_byte(parser, (offset >> 8) & BACKPATCH_PLACEHOLDER);
+    emit_byte(parser, offset & BACKPATCH_PLACEHOLDER);
 }
 
-static void backpatch(int offset)
+static void backpatch(Parser* parser, int offset)
 {
-    const int jump = current_chunk()->count - offset - 2;
+    const int jump = current_chunk(parser)->count - offset - 2;
     if (jump > UINT16_MAX)
-        error("Too much code to jump over.");
+        error(parser, "Too much code to jump over.");
 
-    current_chunk()->code[offset]     = (jump >> 8) & BACKPATCH_PLACEHOLDER;
-    current_chunk()->code[offset + 1] = (jump & BACKPATCH_PLACEHOLDER);
+    current_chunk(parser)->code[offset]     = (jump >> 8) & BACKPATCH_PLACEHOLDER;
+    current_chunk(parser)->code[offset + 1] = (jump & BACKPATCH_PLACEHOLDER);
 }
 
 #undef BACKPATCH_PLACEHOLDER
 
-static void emit_return()
+static void emit_return(Parser* parser)
 {
-    if (current->type == FuncTypeInitializer)
-        emit_bytes(OpReadLocal, 0);
+    if (parser->compiler->type == FuncTypeInitializer)
+        emit_bytes(parser, OpReadLocal, 0);
     else
-        emit_byte(OpNil);
+        emit_byte(parser, OpNil);
 
-    emit_byte(OpReturn);
+    emit_byte(parser, OpReturn);
 }
 
-static uint8_t make_constant(Value value)
+static uint8_t make_constant(Parser* parser, Value value)
 {
-    const int constant_index = add_constant(current_chunk(), value);
+    const int constant_index = add_constant(parser->vm, current_chunk(parser), value);
     if (constant_index > UINT8_MAX)
     {
-        error("Too many constants in one chunk.");
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
     return (uint8_t)constant_index;
 }
 
-static void emit_constant(Value value)
+static void emit_constant(Parser* parser, Value value)
 {
-    emit_bytes(OpConstant, make_constant(value));
+    emit_bytes(parser, OpConstant, make_constant(parser, value));
 }
 
-static void init_compiler(Compiler* compiler, FunctionType type)
+static void init_compiler(Parser* parser, Compiler* compiler, FunctionType type)
 {
-    compiler->enclosing   = current;
+    compiler->enclosing   = parser->compiler;
     compiler->func        = NULL;
     compiler->type        = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
-    compiler->func        = new_function();
+#ifdef COMPILER_CAPTURE_BY_VALUE
+    compiler->capture_sites    = NULL;
+    compiler->capture_count    = 0;
+    compiler->capture_capacity = 0;
+#endif
+    compiler->func = new_function(parser->vm);
 
-    current = compiler;
+    parser->compiler = compiler;
     if (type != FuncTypeScript)
     {
-        current->func->name = copy_string(parser.previous.start,
-                                          parser.previous.length);
+        parser->compiler->func->name = copy_string(parser->vm, parser->previous.start,
+                                                   parser->previous.length);
     }
 
-    Local* local       = &current->locals[current->local_count++];
+    Local* local       = &parser->compiler->locals[parser->compiler->local_count++];
     local->depth       = 0;
     local->is_captured = false;
+#ifdef COMPILER_CAPTURE_BY_VALUE
+    local->is_assigned = false;
+#endif
 
     if (type != FuncTypeFunction)
     {
@@ -271,152 +299,224 @@ static void init_compiler(Compiler* compiler, FunctionType type)
     }
 }
 
-static ObjFunction* end_compiler()
+#ifdef COMPILER_CAPTURE_BY_VALUE
+static void add_capture_site(Parser* parser, int local, int offset)
+{
+    Compiler* compiler = parser->compiler;
+    if (compiler->capture_capacity < compiler->capture_count + 1)
+    {
+        const int old_capacity = compiler->capture_capacity;
+
+        compiler->capture_capacity = GROW_CAPACITY(old_capacity);
+        compiler->capture_sites    = GROW_ARRAY(parser->vm, CaptureSite, compiler->capture_sites,
+                                                old_capacity, compiler->capture_capacity);
+    }
+
+    CaptureSite* site = &compiler->capture_sites[compiler->capture_count++];
+    site->local       = local;
+    site->offset      = offset;
+}
+
+static void resolve_capture_sites(Parser* parser, int local)
+{
+    const bool by_value = !parser->compiler->locals[local].is_assigned;
+
+    int kept = 0;
+    for (int i = 0; i < parser->compiler->capture_count; i++)
+    {
+        const CaptureSite site = parser->compiler->capture_sites[i];
+        if (site.local != local)
+            parser->compiler->capture_sites[kept++] = site;
+        else if (by_value)
+            current_chunk(parser)->code[site.offset] = CaptureLocalValue;
+    }
+    parser->compiler->capture_count = kept;
+}
+
+static void mark_upvalue_assigned(Parser* parser, Compiler* compiler, int index)
 {
-    emit_return();
-    ObjFunction* compiled_function = current->func;
-#ifdef DEBUG_PRINT_CODE
-    if (!parser.had_error)
-        disassemble_chunk(current_chunk(), compiled_function->name != NULL
-                                             ? compiled_function->name->chars
-                                             : "<script>");
+    const Upvalue* upvalue = &compiler->upvalues[index];
+    if (upvalue->is_local)
+        compiler->enclosing->locals[upvalue->index].is_assigned = true;
+    else
+        mark_upvalue_assigned(parser, compiler->enclosing, upvalue->index);
+}
 #endif
-    current = current->enclosing;
+
+static ObjFunction* end_compiler(Parser* parser)
+{
+    emit_return(parser);
+#ifdef COMPILER_CAPTURE_BY_VALUE
+    for (int i = 0; i < parser->compiler->local_count; i++)
+    {
+        if (parser->compiler->locals[i].is_captured)
+            resolve_capture_sites(parser, i);
+    }
+    FREE_ARRAY(parser->vm, CaptureSite, parser->compiler->capture_sites, parser->compiler->capture_capacity);
+#endif
+    ObjFunction* compiled_function = parser->compiler->func;
+    if (!parser->had_error && parser->vm->trace_code != NULL)
+        disassemble_chunk(parser->vm->trace_code, current_chunk(parser),
+                          compiled_function->name != NULL ? compiled_function->name->chars
+                                                          : "<script>");
+    parser->compiler = parser->compiler->enclosing;
     return compiled_function;
 }
 
-static void begin_scope()
+static void begin_scope(Parser* parser)
 {
-    current->scope_depth++;
+    parser->compiler->scope_depth++;
 }
 
-static void end_scope()
+static void end_scope(Parser* parser)
 {
-    current->scope_depth--;
-    while (current->local_count > 0
-           && current->locals[current->local_count - 1].depth > current->scope_depth)
+    parser->compiler->scope_depth--;
+    while (parser->compiler->local_count > 0
+           && parser->compiler->locals[parser->compiler->local_count - 1].depth > parser->compiler->scope_depth)
     {
-        if (current->locals[current->local_count - 1].is_captured)
-            emit_byte(OpCloseUpvalue);
+#ifdef COMPILER_CAPTURE_BY_VALUE
+        const Local* local = &parser->compiler->locals[parser->compiler->local_count - 1];
+        if (local->is_captured)
+            resolve_capture_sites(parser, parser->compiler->local_count - 1);
+
+        if (local->is_captured && local->is_assigned)
+#else
+        if (parser->compiler->locals[parser->compiler->local_count - 1].is_captured)
+#endif
+            emit_byte(parser, OpCloseUpvalue);
         else
-            emit_byte(OpPop);
-        current->local_count--;
+            emit_byte(parser, OpPop);
+        parser->compiler->local_count--;
     }
 }
 
-static void grouping(__attribute__((unused)) bool can_assign)
+static void grouping(Parser* parser, __attribute__((unused)) bool can_assign)
 {
-    expression();
-    consume(TokenRightParen, "Expect ')' after expression.");
+    expression(parser);
+    consume(parser, TokenRightParen, "Expect ')' after expression.");
 }
 
-static void number(__attribute__((unused)) bool can_assign)
+static void number(Parser* parser, __attribute__((unused)) bool can_assign)
 {
-    const double value = strtod(parser.previous.start, NULL);
-    emit_constant(NUMBER_VAL(value));
+    const double value = strtod(parser->previous.start, NULL);
+#ifdef VALUE_SMALL_INTEGERS
+    if (value <= INT32_MAX
+        && memchr(parser->previous.start, '.', parser->previous.length) == NULL)
+    {
+        emit_constant(parser, INTEGER_VAL((int32_t)value));
+        return;
+    }
+#endif
+    emit_constant(parser, NUMBER_VAL(value));
 }
 
-static void string(__attribute__((unused)) bool can_assign)
+static void string(Parser* parser, __attribute__((unused)) bool can_assign)
 {
-    emit_constant(OBJ_VAL(copy_string(parser.previous.start + 1,
-                                      parser.previous.length - 2)));
+    emit_constant(parser, string_value(parser->vm, parser->previous.start + 1,
+                                       parser->previous.length - 2));
 }
 
-static void named_variable(Token name, bool can_assign)
+static void named_variable(Parser* parser, Token name, bool can_assign)
 {
     uint8_t read_op   = 0;
     uint8_t assign_op = 0;
 
-    int variable_index = resolve_local(current, &name);
+    int variable_index = resolve_local(parser, parser->compiler, &name);
     if (variable_index != -1)
     {
         read_op   = OpReadLocal;
         assign_op = OpAssignLocal;
     }
-    else if ((variable_index = resolve_upvalue(current, &name)) != -1)
+    else if ((variable_index = resolve_upvalue(parser, parser->compiler, &name)) != -1)
     {
         read_op   = OpReadUpvalue;
         assign_op = OpAssignUpvalue;
     }
     else
     {
-        variable_index = identifier_constant(&name);
+        variable_index = identifier_constant(parser, &name);
         read_op        = OpReadGlobal;
         assign_op      = OpAssignGlobal;
     }
 
-    if (can_assign && match(TokenEqual))
+    if (can_assign && match(parser, TokenEqual))
     {
-        expression();
-        emit_bytes(assign_op, variable_index);
+        expression(parser);
+#ifdef COMPILER_CAPTURE_BY_VALUE
+        if (assign_op == OpAssignLocal)
+            parser->compiler->locals[variable_index].is_assigned = true;
+        else if (assign_op == OpAssignUpvalue)
+            mark_upvalue_assigned(parser, parser->compiler, variable_index);
+#endif
+        emit_bytes(parser, assign_op, variable_index);
     }
     else
-        emit_bytes(read_op, variable_index);
+        emit_bytes(parser, read_op, variable_index);
 }
 
-static void variable(bool can_assign)
+static void variable(Parser* parser, bool can_assign)
 {
-    named_variable(parser.previous, can_assign);
+    named_variable(parser, parser->previous, can_assign);
 }
 
-static void unary(__attribute__((unused)) bool can_assign)
+static void unary(Parser* parser, __attribute__((unused)) bool can_assign)
 {
-    const TokenType op_type = parser.previous.type;
+    const TokenType op_type = parser->previous.type;
 
-    parse_precedence(PrecUnary);
+    parse_precedence(parser, PrecUnary);
 
     switch (op_type)
     {
         case TokenMinus:
-            emit_byte(OpNegate);
+            emit_byte(parser, OpNegate);
             break;
         case TokenBang:
-            emit_byte(OpNot);
+            emit_byte(parser, OpNot);
             break;
         default:
             return;
     }
 }
 
-static void binary(__attribute__((unused)) bool can_assign)
+static void binary(Parser* parser, __attribute__((unused)) bool can_assign)
 {
-    const TokenType  op_type = parser.previous.type;
+    const TokenType  op_type = parser->previous.type;
     const ParseRule* rule    = get_rule(op_type);
 
-    parse_precedence((Precedence)(rule->prec + 1));
+    parse_precedence(parser, (Precedence)(rule->prec + 1));
 
     switch (op_type)
     {
         case TokenBangEqual:
-            emit_bytes(OpEqual, OpNot);
+            emit_bytes(parser, OpEqual, OpNot);
             break;
         case TokenEqualEqual:
-            emit_byte(OpEqual);
+            emit_byte(parser, OpEqual);
             break;
         case TokenGreater:
-            emit_byte(OpGreater);
+            emit_byte(parser, OpGreater);
             break;
         case TokenGreaterEqual:
-            emit_bytes(OpLess, OpNot);
+            emit_bytes(parser, OpLess, OpNot);
             break;
         case TokenLess:
-            emit_byte(OpLess);
+            emit_byte(parser, OpLess);
             break;
         case TokenLessEqual:
-            emit_bytes(OpGreater, OpNot);
+            emit_bytes(parser, OpGreater, OpNot);
             break;
 
         case TokenPlus:
-            emit_byte(OpAdd);
+            emit_byte(parser, OpAdd);
             break;
         case TokenMinus:
-            emit_byte(OpSubtract);
+            emit_byte(parser, OpSubtract);
             break;
         case TokenStar:
-            emit_byte(OpMultiply);
+            emit_byte(parser, OpMultiply);
             break;
         case TokenSlash:
-            emit_byte(OpDivide);
+            emit_byte(parser, OpDivide);
             break;
 
         default:
@@ -424,106 +524,129 @@ static void binary(__attribute__((unused)) bool can_assign)
     }
 }
 
-static void literal(__attribute__((unused)) bool can_assign)
+static void literal(Parser* parser, __attribute__((unused)) bool can_assign)
 {
-    switch (parser.previous.type)
+    switch (parser->previous.type)
     {
         case TokenNil:
-            emit_byte(OpNil);
+            emit_byte(parser, OpNil);
             break;
         case TokenTrue:
-            emit_byte(OpTrue);
+            emit_byte(parser, OpTrue);
             break;
         case TokenFalse:
-            emit_byte(OpFalse);
+            emit_byte(parser, OpFalse);
             break;
         default:
             return;
     }
 }
 
-static void and_fn(__attribute__((unused)) bool can_assign)
+static void and_fn(Parser* parser, __attribute__((unused)) bool can_assign)
 {
-    const int end_jump = emit_jump(OpJumpIfFalse);
-    emit_byte(OpPop);
-    parse_precedence(PrecAnd);
-    backpatch(end_jump);
+    const int end_jump = emit_jump(parser, OpJumpIfFalse);
+    emit_byte(parser, OpPop);
+    parse_precedence(parser, PrecAnd);
+    backpatch(parser, end_jump);
 }
 
-static void or_fn(__attribute__((unused)) bool can_assign)
+static void or_fn(Parser* parser, __attribute__((unused)) bool can_assign)
 {
-    const int else_jump = emit_jump(OpJumpIfFalse);
-    const int end_jump  = emit_jump(OpJump);
+    const int else_jump = emit_jump(parser, OpJumpIfFalse);
+    const int end_jump  = emit_jump(parser, OpJump);
 
-    backpatch(else_jump);
-    emit_byte(OpPop);
+    backpatch(parser, else_jump);
+    emit_byte(parser, OpPop);
 
-    parse_precedence(PrecOr);
-    backpatch(end_jump);
+    parse_precedence(parser, PrecOr);
+    backpatch(parser, end_jump);
 }
 
-static void call(__attribute__((unused)) bool can_assign)
+static void call(Parser* parser, __attribute__((unused)) bool can_assign)
 {
-    const uint8_t arg_count = argument_list();
-    emit_bytes(OpCall, arg_count);
+    const uint8_t arg_count = argument_list(parser);
+    emit_bytes(parser, OpCall, arg_count);
 }
 
-static void dot(bool can_assign)
+static void dot(Parser* parser, bool can_assign)
 {
-    consume(TokenIdentifier, "Expect property name after '.'.");
+    consume(parser, TokenIdentifier, "Expect property name after '.'.");
 
-    const uint8_t property = identifier_constant(&parser.previous);
+    const uint8_t property = identifier_constant(parser, &parser->previous);
 
-    if (can_assign && match(TokenEqual))
+    if (can_assign && match(parser, TokenEqual))
     {
-        expression();
-        emit_bytes(OpSetField, property);
+        expression(parser);
+        emit_bytes(parser, OpSetField, property);
     }
-    else if (match(TokenLeftParen))
+    else if (match(parser, TokenLeftParen))
     {
-        const uint8_t arg_count = argument_list();
-        emit_bytes(OpInvoke, property);
-        emit_byte(arg_count);
+        const uint8_t arg_count = argument_list(parser);
+        emit_bytes(parser, OpInvoke, property);
+        emit_byte(parser, arg_count);
     }
     else
-        emit_bytes(OpGetProperty, property);
+        emit_bytes(parser, OpGetProperty, property);
 }
 
-static void this_fn(__attribute__((unused)) bool can_assign)
+static void this_fn(Parser* parser, __attribute__((unused)) bool can_assign)
 {
-    if (current_class == NULL)
+    if (parser->class_compiler == NULL)
     {
-        error("Can't use 'this' outside of a class.");
+        error(parser, "Can't use 'this' outside of a class.");
         return;
     }
 
-    variable(false);
+    variable(parser, false);
 }
 
-static void super_fn(__attribute__((unused)) bool can_assign)
+#ifdef OBJECT_CACHE_SUPER_CALLS
+static uint8_t make_super_cache(Parser* parser)
 {
-    if (current_class == NULL)
-        error("Can't use 'super' outside of a class.");
-    else if (!current_class->has_superclass)
-        error("Can't use 'super' in a class with no superclass");
+    ObjFunction* func = parser->compiler->func;
+    if (func->super_cache_count == UINT8_COUNT)
+    {
+        error(parser, "Too many super calls in one function.");
+        return 0;
+    }
 
-    consume(TokenDot, "Expect '.' after 'super'");
-    consume(TokenIdentifier, "Expect superclass method name.");
-    const uint8_t superclass_method = identifier_constant(&parser.previous);
+    func->super_caches = GROW_ARRAY(parser->vm, SuperCallCache, func->super_caches,
+                                    func->super_cache_count, func->super_cache_count + 1);
 
-    named_variable(synthetic_token("this"), false);
+    SuperCallCache* cache = &func->super_caches[func->super_cache_count];
+    cache->superclass     = NULL;
+    cache->method         = NULL;
+    return (uint8_t)func->super_cache_count++;
+}
+#endif
 
-    if (match(TokenLeftParen))
+static void super_fn(Parser* parser, __attribute__((unused)) bool can_assign)
+{
+    if (parser->class_compiler == NULL)
+        error(parser, "Can't use 'super' outside of a class.");
+    else if (!parser->class_compiler->has_superclass)
+        error(parser, "Can't use 'super' in a class with no superclass");
+
+    consume(parser, TokenDot, "Expect '.' after 'super'");
+    consume(parser, TokenIdentifier, "Expect superclass method name.");
+    const uint8_t superclass_method = identifier_constant(parser, &parser->previous);
+
+    named_variable(parser, synthetic_token("this"), false);
+
+    if (match(parser, TokenLeftParen))
     {
-        const uint8_t arg_count = argument_list();
-        named_variable(synthetic_token("super"), false);
-        emit_bytes(OpSuperInvoke, superclass_method);
-        emit_byte(arg_count);
+        const uint8_t arg_count = argument_list(parser);
+        named_variable(parser, synthetic_token("super"), false);
+        emit_bytes(parser, OpSuperInvoke, superclass_method);
+        emit_byte(parser, arg_count);
+#ifdef OBJECT_CACHE_SUPER_CALLS
+        emit_byte(parser, make_super_cache(parser));
+#endif
     }
     else
     {
-        named_variable(synthetic_token("super"), false);
-        emit_bytes(OpGetSuper, superclass_method);
+        named_variable(parser, synthetic_token("super"), false);
+        emit_bytes(parser, OpGetSuper, superclass_method);
     }
 }
 
@@ -575,34 +698,34 @@ static const ParseRule* get_rule(TokenType type)
     return &RULES[type];
 }
 
-static void parse_precedence(Precedence prec)
+static void parse_precedence(Parser* parser, Precedence prec)
 {
-    advance();
+    advance(parser);
 
-    const ParseFn prefix_rule = get_rule(parser.previous.type)->prefix;
+    const ParseFn prefix_rule = get_rule(parser->previous.type)->prefix;
     if (prefix_rule == NULL)
     {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     const bool can_assign = (prec <= PrecAssignment);
-    prefix_rule(can_assign);
+    prefix_rule(parser, can_assign);
 
-    while (prec <= get_rule(parser.current.type)->prec)
+    while (prec <= get_rule(parser->current.type)->prec)
     {
-        advance();
-        const ParseFn infix_rule = get_rule(parser.previous.type)->infix;
-        infix_rule(can_assign);
+        advance(parser);
+        const ParseFn infix_rule = get_rule(parser->previous.type)->infix;
+        infix_rule(parser, can_assign);
     }
 
-    if (can_assign && match(TokenEqual))
-        error("Invalid assignment target.");
+    if (can_assign && match(parser, TokenEqual))
+        error(parser, "Invalid assignment target.");
 }
 
-static uint8_t identifier_constant(const Token* name)
+static uint8_t identifier_constant(Parser* parser, const Token* name)
 {
-    return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
+    return make_constant(parser, OBJ_VAL(copy_string(parser->vm, name->start, name->length)));
 }
 
 static bool identifiers_equal(const Token* a, const Token* b)
@@ -611,7 +734,7 @@ static bool identifiers_equal(const Token* a, const Token* b)
                                     : memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolve_local(const Compiler* compiler, const Token* name)
+static int resolve_local(Parser* parser, const Compiler* compiler, const Token* name)
 {
     for (int i = compiler->local_count - 1; i >= 0; i--)
     {
@@ -619,7 +742,7 @@ static int resolve_local(const Compiler* compiler, const Token* name)
         if (identifiers_equal(name, &local->name))
         {
             if (local->depth == -1)
-                error("Can't read local variable in its own initializer.");
+                error(parser, "Can't read local variable in its own initializer.");
             return i;
         }
     }
@@ -638,12 +761,12 @@ static int upvalue_exists(const Compiler* compiler, uint8_t index,
     return -1;
 }
 
-static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local)
+static int add_upvalue(Parser* parser, Compiler* compiler, uint8_t index, bool is_local)
 {
     const int upvalue_count = compiler->func->upvalue_count;
     if (upvalue_count == UINT8_COUNT)
     {
-        error("Too many closure variables in function.");
+        error(parser, "Too many closure variables in function.");
         return 0;
     }
 
@@ -656,183 +779,206 @@ static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local)
     return compiler->func->upvalue_count++;
 }
 
-static int resolve_upvalue(Compiler* compiler, const Token* name)
+static int resolve_upvalue(Parser* parser, Compiler* compiler, const Token* name)
 {
     if (compiler->enclosing == NULL)
         return -1;
 
-    const int base_local = resolve_local(compiler->enclosing, name);
+    const int base_local = resolve_local(parser, compiler->enclosing, name);
     if (base_local != -1)
     {
         compiler->enclosing->locals[base_local].is_captured = true;
-        return add_upvalue(compiler, (uint8_t)base_local, true);
+        return add_upvalue(parser, compiler, (uint8_t)base_local, true);
     }
 
-    const int outer_upvalue = resolve_upvalue(compiler->enclosing, name);
+    const int outer_upvalue = resolve_upvalue(parser, compiler->enclosing, name);
     if (outer_upvalue != -1)
-        return add_upvalue(compiler, (uint8_t)outer_upvalue, false);
+        return add_upvalue(parser, compiler, (uint8_t)outer_upvalue, false);
 
     return -1;
 }
 
-static void add_local(Token name)
+static void add_local(Parser* parser, Token name)
 {
-    if (current->local_count == UINT8_COUNT)
+    if (parser->compiler->local_count == UINT8_COUNT)
     {
-        error("Too many local variables in function.");
+        error(parser, "Too many local variables in function.");
         return;
     }
 
-    Local* local       = &current->locals[current->local_count++];
+    Local* local       = &parser->compiler->locals[parser->compiler->local_count++];
     local->name        = name;
     local->depth       = -1;
     local->is_captured = false;
+#ifdef COMPILER_CAPTURE_BY_VALUE
+    local->is_assigned = false;
+#endif
 }
 
-static void declare_variable()
+static void declare_variable(Parser* parser)
 {
-    if (current->scope_depth == 0)
+    if (parser->compiler->scope_depth == 0)
         return;
 
-    const Token* variable_name = &parser.previous;
-    for (int i = current->local_count - 1; i >= 0; i--)
+    const Token* variable_name = &parser->previous;
+    for (int i = parser->compiler->local_count - 1; i >= 0; i--)
     {
-        const Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scope_depth)
+        const Local* local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scope_depth)
             break;
         if (identifiers_equal(variable_name, &local->name))
-            error("Already a variable with this name in this scope");
+            error(parser, "Already a variable with this name in this scope");
     }
 
-    add_local(*variable_name);
+    add_local(parser, *variable_name);
 }
 
-static uint8_t parse_variable(const char* message)
+static uint8_t parse_variable(Parser* parser, const char* message)
 {
-    consume(TokenIdentifier, message);
+    consume(parser, TokenIdentifier, message);
 
-    declare_variable();
-    if (current->scope_depth > 0)
+    declare_variable(parser);
+    if (parser->compiler->scope_depth > 0)
         return 0;
 
-    return identifier_constant(&parser.previous);
+    return identifier_constant(parser, &parser->previous);
 }
 
-static void mark_initialized()
+static void mark_initialized(Parser* parser)
 {
-    if (current->scope_depth == 0)
+    if (parser->compiler->scope_depth == 0)
         return;
-    current->locals[current->local_count - 1].depth = current->scope_depth;
+    parser->compiler->locals[parser->compiler->local_count - 1].depth = parser->compiler->scope_depth;
 }
 
-static void define_variable(uint8_t global)
+static void define_variable(Parser* parser, uint8_t global)
 {
-    if (current->scope_depth > 0)
+    if (parser->compiler->scope_depth > 0)
     {
-        mark_initialized();
+        mark_initialized(parser);
         return;
     }
-    emit_bytes(OpDefineGlobal, global);
+    emit_bytes(parser, OpDefineGlobal, global);
 }
 
-static uint8_t argument_list()
+static uint8_t argument_list(Parser* parser)
 {
     uint8_t arg_count = 0;
-    if (!check(TokenRightParen))
+    if (!check(parser, TokenRightParen))
     {
         do
         {
-            expression();
+            expression(parser);
             if (arg_count == 255)
-                error("Can't have more than 255 arguments.");
+                error(parser, "Can't have more than 255 arguments.");
             arg_count++;
         }
-        while (match(TokenComma));
+        while (match(parser, TokenComma));
     }
-    consume(TokenRightParen, "Expect ')' after arguments.");
+    consume(parser, TokenRightParen, "Expect ')' after arguments.");
     return arg_count;
 }
 
-static void expression()
+static void expression(Parser* parser)
 {
-    parse_precedence(PrecAssignment);
+    parse_precedence(parser, PrecAssignment);
 }
 
-static void block()
+static void block(Parser* parser)
 {
-    while (!check(TokenRightBrace) && !check(TokenEOF))
-        declaration();
-    consume(TokenRightBrace, "Expect '}' after block.");
+    while (!check(parser, TokenRightBrace) && !check(parser, TokenEOF))
+        declaration(parser);
+    consume(parser, TokenRightBrace, "Expect '}' after block.");
 }
 
-static void var_declaration()
+static void var_declaration(Parser* parser)
 {
-    const uint8_t variable_name = parse_variable("Expect variable name.");
+    const uint8_t variable_name = parse_variable(parser, "Expect variable name.");
 
-    if (match(TokenEqual))
-        expression();
+    if (match(parser, TokenEqual))
+        expression(parser);
     else
-        emit_byte(OpNil);
-    consume(TokenSemicolon, "Expect ';' after variable declaration.");
+        emit_byte(parser, OpNil);
+    consume(parser, TokenSemicolon, "Expect ';' after variable declaration.");
 
-    define_variable(variable_name);
+    define_variable(parser, variable_name);
 }
 
-static void function(FunctionType type)
+static void function(Parser* parser, FunctionType type)
 {
     Compiler compiler;
-    init_compiler(&compiler, type);
+    init_compiler(parser, &compiler, type);
 
-    begin_scope();
-    consume(TokenLeftParen, "Expect '(' after function name.");
-    if (!check(TokenRightParen))
+    begin_scope(parser);
+    consume(parser, TokenLeftParen, "Expect '(' after function name.");
+    if (!check(parser, TokenRightParen))
     {
         do {
-            current->func->arity++;
-            if (current->func->arity > 255)
-                error_at_current("Can't have more than 255 parameters");
+            parser->compiler->func->arity++;
+            if (parser->compiler->func->arity > 255)
+                error_at_current(parser, "Can't have more than 255 parameters");
 
-            const uint8_t parameter_name = parse_variable("Expect parameter name");
-            define_variable(parameter_name);
+            const uint8_t parameter_name = parse_variable(parser, "Expect parameter name");
+            define_variable(parser, parameter_name);
         }
-        while (match(TokenComma));
+        while (match(parser, TokenComma));
     }
-    consume(TokenRightParen, "Expect ')' after function name.");
-    consume(TokenLeftBrace, "Expect '{' after function name.");
-    block();
-
-    const ObjFunction* compiled_function = end_compiler();
-    emit_bytes(OpClosure, make_constant(OBJ_VAL(compiled_function)));
+    consume(parser, TokenRightParen, "Expect ')' after function name.");
+    consume(parser, TokenLeftBrace, "Expect '{' after function name.");
+    block(parser);
+
+    const ObjFunction* compiled_function = end_compiler(parser);
+    emit_bytes(parser, OpClosure, make_constant(parser, OBJ_VAL(compiled_function)));
+
+#ifdef COMPILER_CAPTURE_BY_VALUE
+    // A local function's own slot only receives the closure after OpClosure
+    // has run, so a closure referring to itself must capture it by reference.
+    const int self_slot = (type == FuncTypeFunction && parser->compiler->scope_depth > 0)
+                            ? parser->compiler->local_count - 1
+                            : -1;
+#endif
 
     for (int i = 0; i < compiled_function->upvalue_count; i++)
     {
-        emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-        emit_byte(compiler.upvalues[i].index);
+#ifdef COMPILER_CAPTURE_BY_VALUE
+        const Upvalue* upvalue = &compiler.upvalues[i];
+        if (upvalue->is_local)
+        {
+            if (upvalue->index == self_slot)
+                parser->compiler->locals[self_slot].is_assigned = true;
+            add_capture_site(parser, upvalue->index, current_chunk(parser)->count);
+        }
+        emit_byte(parser, upvalue->is_local ? CaptureLocal : CaptureUpvalue);
+        emit_byte(parser, upvalue->index);
+#else
+        emit_byte(parser, compiler.upvalues[i].is_local ? 1 : 0);
+        emit_byte(parser, compiler.upvalues[i].index);
+#endif
     }
 }
 
-static void fun_declaration()
+static void fun_declaration(Parser* parser)
 {
-    const uint8_t function_name = parse_variable("Expect function name");
-    mark_initialized();
-    function(FuncTypeFunction);
-    define_variable(function_name);
+    const uint8_t function_name = parse_variable(parser, "Expect function name");
+    mark_initialized(parser);
+    function(parser, FuncTypeFunction);
+    define_variable(parser, function_name);
 }
 
-static void method()
+static void method(Parser* parser)
 {
-    consume(TokenIdentifier, "Expect method name.");
+    consume(parser, TokenIdentifier, "Expect method name.");
 
-    const uint8_t method = identifier_constant(&parser.previous);
+    const uint8_t method = identifier_constant(parser, &parser->previous);
 
-    const FunctionType type = (parser.previous.length == 4
-                               && memcmp(parser.previous.start, "init", 4) == 0)
+    const FunctionType type = (parser->previous.length == 4
+                               && memcmp(parser->previous.start, "init", 4) == 0)
                                 ? FuncTypeInitializer
                                 : FuncTypeMethod;
 
-    function(type);
+    function(parser, type);
 
-    emit_bytes(OpMethod, method);
+    emit_bytes(parser, OpMethod, method);
 }
 
 static Token synthetic_token(const char* text)
@@ -843,205 +989,205 @@ static Token synthetic_token(const char* text)
     return token;
 }
 
-static void class_declaration()
+static void class_declaration(Parser* parser)
 {
-    consume(TokenIdentifier, "Expect class name.");
-    const Token class_name = parser.previous;
+    consume(parser, TokenIdentifier, "Expect class name.");
+    const Token class_name = parser->previous;
 
-    const uint8_t class = identifier_constant(&class_name);
-    declare_variable();
+    const uint8_t class = identifier_constant(parser, &class_name);
+    declare_variable(parser);
 
-    emit_bytes(OpClass, class);
-    define_variable(class);
+    emit_bytes(parser, OpClass, class);
+    define_variable(parser, class);
 
     ClassCompiler class_compiler;
     class_compiler.has_superclass = false;
-    class_compiler.enclosing      = current_class;
-    current_class                 = &class_compiler;
+    class_compiler.enclosing      = parser->class_compiler;
+    parser->class_compiler                 = &class_compiler;
 
-    if (match(TokenLess))
+    if (match(parser, TokenLess))
     {
         class_compiler.has_superclass = true;
 
-        consume(TokenIdentifier, "Expect superclass name.");
-        variable(false);
+        consume(parser, TokenIdentifier, "Expect superclass name.");
+        variable(parser, false);
 
-        if (identifiers_equal(&class_name, &parser.previous))
-            error("A class can't inherit from itself.");
+        if (identifiers_equal(&class_name, &parser->previous))
+            error(parser, "A class can't inherit from itself.");
 
-        begin_scope();
-        add_local(synthetic_token("super"));
-        define_variable(0);
+        begin_scope(parser);
+        add_local(parser, synthetic_token("super"));
+        define_variable(parser, 0);
 
-        named_variable(class_name, false);
-        emit_byte(OpInherit);
+        named_variable(parser, class_name, false);
+        emit_byte(parser, OpInherit);
     }
 
-    named_variable(class_name, false);
-    consume(TokenLeftBrace, "Expect '{' before class body.");
+    named_variable(parser, class_name, false);
+    consume(parser, TokenLeftBrace, "Expect '{' before class body.");
 
-    while (!check(TokenRightBrace) && !check(TokenEOF))
-        method();
+    while (!check(parser, TokenRightBrace) && !check(parser, TokenEOF))
+        method(parser);
 
-    consume(TokenRightBrace, "Expect '}' after class body.");
-    emit_byte(OpPop);
+    consume(parser, TokenRightBrace, "Expect '}' after class body.");
+    emit_byte(parser, OpPop);
 
     if (class_compiler.has_superclass)
-        end_scope();
+        end_scope(parser);
 
-    current_class = current_class->enclosing;
+    parser->class_compiler = parser->class_compiler->enclosing;
 }
 
-static void print_statement()
+static void print_statement(Parser* parser)
 {
-    expression();
-    consume(TokenSemicolon, "Expect ';' after value.");
-    emit_byte(OpPrint);
+    expression(parser);
+    consume(parser, TokenSemicolon, "Expect ';' after value.");
+    emit_byte(parser, OpPrint);
 }
 
-static void expression_statement()
+static void expression_statement(Parser* parser)
 {
-    expression();
-    consume(TokenSemicolon, "Expect ';' after expression.");
-    emit_byte(OpPop);
+    expression(parser);
+    consume(parser, TokenSemicolon, "Expect ';' after expression.");
+    emit_byte(parser, OpPop);
 }
 
-static void if_statement()
+static void if_statement(Parser* parser)
 {
-    consume(TokenLeftParen, "Expect '(' after 'if'.");
-    expression();
-    consume(TokenRightParen, "Expect ')' after condition.");
+    consume(parser, TokenLeftParen, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, TokenRightParen, "Expect ')' after condition.");
 
-    const int then_jump = emit_jump(OpJumpIfFalse);
-    emit_byte(OpPop);
+    const int then_jump = emit_jump(parser, OpJumpIfFalse);
+    emit_byte(parser, OpPop);
 
-    statement();
+    statement(parser);
 
-    const int else_jump = emit_jump(OpJump);
-    backpatch(then_jump);
-    emit_byte(OpPop);
+    const int else_jump = emit_jump(parser, OpJump);
+    backpatch(parser, then_jump);
+    emit_byte(parser, OpPop);
 
-    if (match(TokenElse))
-        statement();
+    if (match(parser, TokenElse))
+        statement(parser);
 
-    backpatch(else_jump);
+    backpatch(parser, else_jump);
 }
 
-static void while_statement()
+static void while_statement(Parser* parser)
 {
-    const int loop_start = current_chunk()->count;
-    consume(TokenLeftParen, "Expect '(' after 'while'.");
-    expression();
-    consume(TokenRightParen, "Expect ')' after condition.");
+    const int loop_start = current_chunk(parser)->count;
+    consume(parser, TokenLeftParen, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TokenRightParen, "Expect ')' after condition.");
 
-    const int exit_jump = emit_jump(OpJumpIfFalse);
-    emit_byte(OpPop);
+    const int exit_jump = emit_jump(parser, OpJumpIfFalse);
+    emit_byte(parser, OpPop);
 
-    statement();
-    emit_loop(loop_start);
+    statement(parser);
+    emit_loop(parser, loop_start);
 
-    backpatch(exit_jump);
-    emit_byte(OpPop);
+    backpatch(parser, exit_jump);
+    emit_byte(parser, OpPop);
 }
 
-static void for_statement()
+static void for_statement(Parser* parser)
 {
-    begin_scope();
-    consume(TokenLeftParen, "Expect '(' after 'for'.");
+    begin_scope(parser);
+    consume(parser, TokenLeftParen, "Expect '(' after 'for'.");
 
-    if (match(TokenSemicolon))
+    if (match(parser, TokenSemicolon))
     {}
-    else if (match(TokenVar))
-        var_declaration();
+    else if (match(parser, TokenVar))
+        var_declaration(parser);
     else
-        expression_statement();
+        expression_statement(parser);
 
-    int loop_start = current_chunk()->count;
+    int loop_start = current_chunk(parser)->count;
 
     int exit_jump = -1;
-    if (!match(TokenSemicolon))
+    if (!match(parser, TokenSemicolon))
     {
-        expression();
-        consume(TokenSemicolon, "Expect ';' after loop condition.");
-        exit_jump = emit_jump(OpJumpIfFalse);
-        emit_byte(OpPop);
+        expression(parser);
+        consume(parser, TokenSemicolon, "Expect ';' after loop condition.");
+        exit_jump = emit_jump(parser, OpJumpIfFalse);
+        emit_byte(parser, OpPop);
     }
 
-    if (!match(TokenRightParen))
+    if (!match(parser, TokenRightParen))
     {
-        const int body_jump       = emit_jump(OpJump);
-        const int increment_start = current_chunk()->count;
+        const int body_jump       = emit_jump(parser, OpJump);
+        const int increment_start = current_chunk(parser)->count;
 
-        expression();
-        emit_byte(OpPop);
-        consume(TokenRightParen, "Expect ')' after for clauses.");
+        expression(parser);
+        emit_byte(parser, OpPop);
+        consume(parser, TokenRightParen, "Expect ')' after for clauses.");
 
-        emit_loop(loop_start);
+        emit_loop(parser, loop_start);
 
         loop_start = increment_start;
-        backpatch(body_jump);
+        backpatch(parser, body_jump);
     }
 
-    statement();
-    emit_loop(loop_start);
+    statement(parser);
+    emit_loop(parser, loop_start);
 
     if (exit_jump != -1)
     {
-        backpatch(exit_jump);
-        emit_byte(OpPop);
+        backpatch(parser, exit_jump);
+        emit_byte(parser, OpPop);
     }
 
-    end_scope();
+    end_scope(parser);
 }
 
-static void return_statement()
+static void return_statement(Parser* parser)
 {
-    if (current->type == FuncTypeScript)
-        error("Can't return from top level code.");
+    if (parser->compiler->type == FuncTypeScript)
+        error(parser, "Can't return from top level code.");
 
-    if (match(TokenSemicolon))
-        emit_return();
+    if (match(parser, TokenSemicolon))
+        emit_return(parser);
     else
     {
-        if (current->type == FuncTypeInitializer)
-            error("Can't return a value from an initializer.");
+        if (parser->compiler->type == FuncTypeInitializer)
+            error(parser, "Can't return a value from an initializer.");
 
-        expression();
-        consume(TokenSemicolon, "Expect ';' after return value.");
-        emit_byte(OpReturn);
+        expression(parser);
+        consume(parser, TokenSemicolon, "Expect ';' after return value.");
+        emit_byte(parser, OpReturn);
     }
 }
 
-static void statement()
+static void statement(Parser* parser)
 {
-    if (match(TokenPrint))
-        print_statement();
-    else if (match(TokenLeftBrace))
+    if (match(parser, TokenPrint))
+        print_statement(parser);
+    else if (match(parser, TokenLeftBrace))
     {
-        begin_scope();
-        block();
-        end_scope();
+        begin_scope(parser);
+        block(parser);
+        end_scope(parser);
     }
-    else if (match(TokenIf))
-        if_statement();
-    else if (match(TokenWhile))
-        while_statement();
-    else if (match(TokenFor))
-        for_statement();
-    else if (match(TokenReturn))
-        return_statement();
+    else if (match(parser, TokenIf))
+        if_statement(parser);
+    else if (match(parser, TokenWhile))
+        while_statement(parser);
+    else if (match(parser, TokenFor))
+        for_statement(parser);
+    else if (match(parser, TokenReturn))
+        return_statement(parser);
     else
-        expression_statement();
+        expression_statement(parser);
 }
 
-static void synchronize()
+static void synchronize(Parser* parser)
 {
-    parser.panic_mode = false;
-    while (parser.current.type != TokenEOF)
+    parser->panic_mode = false;
+    while (parser->current.type != TokenEOF)
     {
-        if (parser.previous.type == TokenSemicolon)
+        if (parser->previous.type == TokenSemicolon)
             return;
-        switch (parser.current.type)
+        switch (parser->current.type)
         {
             case TokenClass:
             case TokenFun:
@@ -1053,49 +1199,61 @@ static void synchronize()
             case TokenReturn:
                 return;
             default:
-                advance();
+                advance(parser);
         }
     }
 }
 
-static void declaration()
+static void declaration(Parser* parser)
 {
-    if (match(TokenVar))
-        var_declaration();
-    else if (match(TokenFun))
-        fun_declaration();
-    else if (match(TokenClass))
-        class_declaration();
+    if (match(parser, TokenVar))
+        var_declaration(parser);
+    else if (match(parser, TokenFun))
+        fun_declaration(parser);
+    else if (match(parser, TokenClass))
+        class_declaration(parser);
     else
-        statement();
+        statement(parser);
 
-    if (parser.panic_mode)
-        synchronize();
+    if (parser->panic_mode)
+        synchronize(parser);
 }
 
-ObjFunction* compile(const char* source)
+ObjFunction* compile(VM* vm, const char* source)
 {
-    init_scanner(source);
+    Parser context;
+    context.vm             = vm;
+    context.compiler       = NULL;
+    context.class_compiler = NULL;
+    context.had_error      = false;
+    context.panic_mode     = false;
+
+    Parser* parser = &context;
+    init_scanner(&parser->scanner, source);
+    vm->parser = parser;
+
     Compiler compiler;
-    init_compiler(&compiler, FuncTypeScript);
-    parser.had_error  = false;
-    parser.panic_mode = false;
+    init_compiler(parser, &compiler, FuncTypeScript);
 
-    advance();
+    advance(parser);
 
-    while (!match(TokenEOF))
-        declaration();
+    while (!match(parser, TokenEOF))
+        declaration(parser);
 
-    ObjFunction* compiled_function = end_compiler();
-    return parser.had_error ? NULL : compiled_function;
+    ObjFunction* compiled_function = end_compiler(parser);
+    vm->parser                     = NULL;
+    return parser->had_error ? NULL : compiled_function;
 }
 
-void mark_compiler_roots()
+void mark_compiler_roots(VM* vm)
 {
-    Compiler* compiler = current;
+    if (vm->parser == NULL)
+        return;
+
+    Compiler* compiler = vm->parser->compiler;
     while (compiler != NULL)
     {
-        mark_object((Obj*)compiler->func);
+        mark_object(vm, (Obj*)compiler->func);
         compiler = compiler->enclosing;
     }
 }
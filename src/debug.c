@@ -7,192 +7,264 @@
 #include <clocks/object.h>
 #include <clocks/value.h>
 
-void disassemble_chunk(const Chunk* chunk, const char* name)
+void disassemble_chunk(FILE* out, const Chunk* chunk, const char* name)
 {
-    printf("== %s ==\n", name);
+    fprintf(out, "== %s ==\n", name);
 
     for (int offset = 0; offset < chunk->count;)
-        offset = disassemble_instruction(chunk, offset);
+        offset = disassemble_instruction(out, chunk, offset);
 }
 
-static int constant_instruction(const char* name, const Chunk* chunk, int offset)
+static int constant_instruction(FILE* out, const char* name, const Chunk* chunk, int offset)
 {
     const uint8_t constant = chunk->code[offset + 1];
 
-    printf("%-16s %4d '", name, constant);
-    print_value(chunk->constants.values[constant]);
-    printf("'\n");
+    fprintf(out, "%-16s %4d '", name, constant);
+    print_value(out, chunk->constants.values[constant]);
+    fprintf(out, "'\n");
 
     return offset + 2;
 }
 
-static int simple_instruction(const char* name, int offset)
+static int simple_instruction(FILE* out, const char* name, int offset)
 {
-    printf("%s\n", name);
+    fprintf(out, "%s\n", name);
     return offset + 1;
 }
 
-static int byte_instruction(const char* name, const Chunk* chunk, int offset)
+static int byte_instruction(FILE* out, const char* name, const Chunk* chunk, int offset)
 {
     const uint8_t slot = chunk->code[offset + 1];
-    printf("%-16s %4d\n", name, slot);
+    fprintf(out, "%-16s %4d\n", name, slot);
     return offset + 2;
 }
 
-static int jump_instruction(const char* name, int sign,
+static int jump_instruction(FILE* out, const char* name, int sign,
                             const Chunk* chunk, int offset)
 {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
-    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+    fprintf(out, "%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
 
-static int closure_instruction(const Chunk* chunk, int offset)
+static int closure_instruction(FILE* out, const Chunk* chunk, int offset)
 {
     offset++;
     const uint8_t constant = chunk->code[offset++];
-    printf("%-16s %4d ", "OpClosure", constant);
-    print_value(chunk->constants.values[constant]);
-    printf("\n");
+    fprintf(out, "%-16s %4d ", "OpClosure", constant);
+    print_value(out, chunk->constants.values[constant]);
+    fprintf(out, "\n");
 
     const ObjFunction* func = AS_FUNCTION(chunk->constants.values[constant]);
     for (int i = 0; i < func->upvalue_count; i++)
     {
+#ifdef COMPILER_CAPTURE_BY_VALUE
+        static const char* captures[] = {"upvalue", "local", "value"};
+
+        const int capture = chunk->code[offset++];
+        const int index   = chunk->code[offset++];
+        fprintf(out, "%04d      |                     %s %d\n",
+                offset - 2, captures[capture], index);
+#else
         const int is_local = chunk->code[offset++];
         const int index    = chunk->code[offset++];
-        printf("%04d      |                     %s %d\n",
-               offset - 2, is_local ? "local" : "upvalue", index);
+        fprintf(out, "%04d      |                     %s %d\n",
+                offset - 2, is_local ? "local" : "upvalue", index);
+#endif
     }
 
     return offset;
 }
 
-static int invoke_instruction(const char* name, const Chunk* chunk, int offset)
+#ifdef OBJECT_CACHE_SUPER_CALLS
+static int super_invoke_instruction(FILE* out, const Chunk* chunk, int offset)
+{
+    const uint8_t constant  = chunk->code[offset + 1];
+    const uint8_t arg_count = chunk->code[offset + 2];
+    const uint8_t cache     = chunk->code[offset + 3];
+    fprintf(out, "%-16s (%d args) %4d '", "OpSuperInvoke", arg_count, constant);
+    print_value(out, chunk->constants.values[constant]);
+    fprintf(out, "' cache %d\n", cache);
+    return offset + 4;
+}
+#endif
+
+static int invoke_instruction(FILE* out, const char* name, const Chunk* chunk, int offset)
 {
     const uint8_t constant  = chunk->code[offset + 1];
     const uint8_t arg_count = chunk->code[offset + 2];
-    printf("%-16s (%d args) %4d '", name, arg_count, constant);
-    print_value(chunk->constants.values[constant]);
-    printf("'\n");
+    fprintf(out, "%-16s (%d args) %4d '", name, arg_count, constant);
+    print_value(out, chunk->constants.values[constant]);
+    fprintf(out, "'\n");
     return offset + 3;
 }
 
-int disassemble_instruction(const Chunk* chunk, int offset)
+static const char* const OPCODE_NAMES[OPCODE_COUNT] = {
+    [OpConstant]      = "OpConstant",
+    [OpNil]           = "OpNil",
+    [OpTrue]          = "OpTrue",
+    [OpFalse]         = "OpFalse",
+    [OpPop]           = "OpPop",
+    [OpReadLocal]     = "OpReadLocal",
+    [OpAssignLocal]   = "OpAssignLocal",
+    [OpReadGlobal]    = "OpReadGlobal",
+    [OpDefineGlobal]  = "OpDefineGlobal",
+    [OpAssignGlobal]  = "OpAssignGlobal",
+    [OpReadUpvalue]   = "OpReadUpvalue",
+    [OpAssignUpvalue] = "OpAssignUpvalue",
+    [OpSetField]      = "OpSetField",
+    [OpGetProperty]   = "OpGetProperty",
+    [OpGetSuper]      = "OpGetSuper",
+    [OpEqual]         = "OpEqual",
+    [OpGreater]       = "OpGreater",
+    [OpLess]          = "OpLess",
+    [OpAdd]           = "OpAdd",
+    [OpSubtract]      = "OpSubtract",
+    [OpMultiply]      = "OpMultiply",
+    [OpDivide]        = "OpDivide",
+    [OpNot]           = "OpNot",
+    [OpNegate]        = "OpNegate",
+    [OpPrint]         = "OpPrint",
+    [OpJump]          = "OpJump",
+    [OpJumpIfFalse]   = "OpJumpIfFalse",
+    [OpLoop]          = "OpLoop",
+    [OpCall]          = "OpCall",
+    [OpInvoke]        = "OpInvoke",
+    [OpSuperInvoke]   = "OpSuperInvoke",
+    [OpClosure]       = "OpClosure",
+    [OpCloseUpvalue]  = "OpCloseUpvalue",
+    [OpReturn]        = "OpReturn",
+    [OpClass]         = "OpClass",
+    [OpInherit]       = "OpInherit",
+    [OpMethod]        = "OpMethod",
+};
+
+const char* opcode_name(uint8_t instruction)
 {
-    printf("%04d ", offset);
+    return instruction < OPCODE_COUNT ? OPCODE_NAMES[instruction] : NULL;
+}
+
+int disassemble_instruction(FILE* out, const Chunk* chunk, int offset)
+{
+    fprintf(out, "%04d ", offset);
 
 #ifdef CHUNK_LINE_RUN_LENGTH_ENCODING
     const int line = get_line(chunk, offset);
     if (offset > 0 && line == get_line(chunk, offset - 1))
-        printf("   | ");
+        fprintf(out, "   | ");
     else
-        printf("%4d ", line);
+        fprintf(out, "%4d ", line);
 #else
     if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
-        printf("   | ");
+        fprintf(out, "   | ");
     else
-        printf("%4d ", chunk->lines[offset]);
+        fprintf(out, "%4d ", chunk->lines[offset]);
 #endif
 
-    const uint8_t instruction = chunk->code[offset];
+    const uint8_t     instruction = chunk->code[offset];
+    const char* const name        = opcode_name(instruction);
     switch (instruction)
     {
         case OpConstant:
-            return constant_instruction("OpConstant", chunk, offset);
+            return constant_instruction(out, name, chunk, offset);
 
         case OpNil:
-            return simple_instruction("OpNil", offset);
+            return simple_instruction(out, name, offset);
         case OpTrue:
-            return simple_instruction("OpTrue", offset);
+            return simple_instruction(out, name, offset);
         case OpFalse:
-            return simple_instruction("OpFalse", offset);
+            return simple_instruction(out, name, offset);
 
         case OpPop:
-            return simple_instruction("OpPop", offset);
+            return simple_instruction(out, name, offset);
 
         case OpReadLocal:
-            return byte_instruction("OpReadLocal", chunk, offset);
+            return byte_instruction(out, name, chunk, offset);
         case OpAssignLocal:
-            return byte_instruction("OpAssignLocal", chunk, offset);
+            return byte_instruction(out, name, chunk, offset);
 
         case OpReadGlobal:
-            return constant_instruction("OpReadGlobal", chunk, offset);
+            return constant_instruction(out, name, chunk, offset);
         case OpDefineGlobal:
-            return constant_instruction("OpDefineGlobal", chunk, offset);
+            return constant_instruction(out, name, chunk, offset);
         case OpAssignGlobal:
-            return constant_instruction("OpAssignGlobal", chunk, offset);
+            return constant_instruction(out, name, chunk, offset);
 
         case OpReadUpvalue:
-            return byte_instruction("OpReadUpvalue", chunk, offset);
+            return byte_instruction(out, name, chunk, offset);
         case OpAssignUpvalue:
-            return byte_instruction("OpAssignUpvalue", chunk, offset);
+            return byte_instruction(out, name, chunk, offset);
 
         case OpSetField:
-            return constant_instruction("OpSetField", chunk, offset);
+            return constant_instruction(out, name, chunk, offset);
         case OpGetProperty:
-            return constant_instruction("OpGetProperty", chunk, offset);
+            return constant_instruction(out, name, chunk, offset);
 
         case OpGetSuper:
-            return constant_instruction("OpGetSuper", chunk, offset);
+            return constant_instruction(out, name, chunk, offset);
 
         case OpEqual:
-            return simple_instruction("OpEqual", offset);
+            return simple_instruction(out, name, offset);
         case OpGreater:
-            return simple_instruction("OpGreater", offset);
+            return simple_instruction(out, name, offset);
         case OpLess:
-            return simple_instruction("OpLess", offset);
+            return simple_instruction(out, name, offset);
 
         case OpAdd:
-            return simple_instruction("OpAdd", offset);
+            return simple_instruction(out, name, offset);
         case OpSubtract:
-            return simple_instruction("OpSubtract", offset);
+            return simple_instruction(out, name, offset);
         case OpMultiply:
-            return simple_instruction("OpMultiply", offset);
+            return simple_instruction(out, name, offset);
         case OpDivide:
-            return simple_instruction("OpDivide", offset);
+            return simple_instruction(out, name, offset);
 
         case OpNot:
-            return simple_instruction("OpNot", offset);
+            return simple_instruction(out, name, offset);
 
         case OpNegate:
-            return simple_instruction("OpNegate", offset);
+            return simple_instruction(out, name, offset);
 
         case OpPrint:
-            return simple_instruction("OpPrint", offset);
+            return simple_instruction(out, name, offset);
 
         case OpJump:
-            return jump_instruction("OpJump", 1, chunk, offset);
+            return jump_instruction(out, name, 1, chunk, offset);
         case OpJumpIfFalse:
-            return jump_instruction("OpJumpIfFalse", 1, chunk, offset);
+            return jump_instruction(out, name, 1, chunk, offset);
         case OpLoop:
-            return jump_instruction("OpLoop", -1, chunk, offset);
+            return jump_instruction(out, name, -1, chunk, offset);
 
         case OpCall:
-            return byte_instruction("OpCall", chunk, offset);
+            return byte_instruction(out, name, chunk, offset);
         case OpInvoke:
-            return invoke_instruction("OpInvoke", chunk, offset);
+            return invoke_instruction(out, name, chunk, offset);
         case OpSuperInvoke:
-            return invoke_instruction("OpSuperInvoke", chunk, offset);
+#ifdef OBJECT_CACHE_SUPER_CALLS
+            return super_invoke_instruction(out, chunk, offset);
+#else
+            return invoke_instruction(out, name, chunk, offset);
+#endif
 
         case OpClosure:
-            return closure_instruction(chunk, offset);
+            return closure_instruction(out, chunk, offset);
 
         case OpCloseUpvalue:
-            return simple_instruction("OpCloseUpvalue", offset);
+            return simple_instruction(out, name, offset);
 
         case OpReturn:
-            return simple_instruction("OpReturn", offset);
+            return simple_instruction(out, name, offset);
 
         case OpInherit:
-            return simple_instruction("OpInherit", offset);
+            return simple_instruction(out, name, offset);
         case OpClass:
-            return constant_instruction("OpClass", chunk, offset);
+            return constant_instruction(out, name, chunk, offset);
         case OpMethod:
-            return constant_instruction("OpMethod", chunk, offset);
+            return constant_instruction(out, name, chunk, offset);
 
         default:
-            printf("Unknown opcode %d\n", instruction);
+            fprintf(out, "Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
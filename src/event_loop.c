@@ -0,0 +1,754 @@
+// pipe2() is a GNU extension.
+#define _GNU_SOURCE
+
+#include "clocks/event_loop.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <clocks/common.h>
+#include <clocks/memory.h>
+#include <clocks/object.h>
+#include <clocks/value.h>
+#include <clocks/vm.h>
+
+#define READ_CHUNK_SIZE 4096
+#define MAX_EVENTS      64
+
+typedef enum
+{
+    WaitRead,
+    WaitWrite,
+    WaitTimer,
+} WaitKind;
+
+// A loop fiber suspended until its fd is ready. A writer holds on to the
+// string it is writing, and how much of it is written already.
+typedef struct Waiter
+{
+    ObjFiber*      fiber;
+    WaitKind       kind;
+    Value          data;
+    int            written;
+    struct Waiter* next;
+} Waiter;
+
+// The loop fibers waiting on one fd, served in the order they started
+// waiting. The fd is registered with epoll for everything they wait for.
+typedef struct Watch
+{
+    int           fd;
+    uint32_t      events;
+    Waiter*       head;
+    Waiter*       tail;
+    struct Watch* prev;
+    struct Watch* next;
+} Watch;
+
+// A ready fiber, along with what the call which suspended it returns.
+typedef struct
+{
+    ObjFiber* fiber;
+    Value     value;
+} Task;
+
+// The reading end of a pipe from a command, which is reaped on close.
+typedef struct Child
+{
+    int           fd;
+    pid_t         pid;
+    struct Child* next;
+} Child;
+
+struct EventLoop
+{
+    int     epoll_fd;
+    Task*   ready;
+    int     ready_head;
+    int     ready_count;
+    int     ready_capacity;
+    Watch*  watches;
+    Child*  children;
+
+    // The fiber that called run_loop(), which carries on once no loop
+    // fiber is left ready or waiting.
+    ObjFiber* scheduler;
+};
+
+static void* allocate_or_exit(size_t size)
+{
+    void* result = malloc(size);
+    if (result == NULL)
+        exit(1);
+    return result;
+}
+
+static EventLoop* event_loop(VM* vm)
+{
+    if (vm->event_loop != NULL)
+        return vm->event_loop;
+
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        return NULL;
+
+    EventLoop* loop      = (EventLoop*)allocate_or_exit(sizeof(EventLoop));
+    loop->epoll_fd       = epoll_fd;
+    loop->ready          = NULL;
+    loop->ready_head     = 0;
+    loop->ready_count    = 0;
+    loop->ready_capacity = 0;
+    loop->watches        = NULL;
+    loop->children       = NULL;
+    loop->scheduler      = NULL;
+    vm->event_loop       = loop;
+    return loop;
+}
+
+static void enqueue(EventLoop* loop, ObjFiber* fiber, Value value)
+{
+    if (loop->ready_count == loop->ready_capacity)
+    {
+        const int capacity = GROW_CAPACITY(loop->ready_capacity);
+        Task*     ready    = (Task*)allocate_or_exit(sizeof(Task) * capacity);
+        for (int i = 0; i < loop->ready_count; i++)
+            ready[i] = loop->ready[(loop->ready_head + i) % loop->ready_capacity];
+
+        free(loop->ready);
+        loop->ready          = ready;
+        loop->ready_head     = 0;
+        loop->ready_capacity = capacity;
+    }
+
+    const int tail    = (loop->ready_head + loop->ready_count) % loop->ready_capacity;
+    loop->ready[tail] = (Task){fiber, value};
+    loop->ready_count++;
+}
+
+static Task dequeue(EventLoop* loop)
+{
+    const Task task  = loop->ready[loop->ready_head];
+    loop->ready_head = (loop->ready_head + 1) % loop->ready_capacity;
+    loop->ready_count--;
+    return task;
+}
+
+static uint32_t wait_events(WaitKind kind)
+{
+    return kind == WaitWrite ? EPOLLOUT : EPOLLIN;
+}
+
+static Watch* find_watch(const EventLoop* loop, int fd)
+{
+    for (Watch* watch = loop->watches; watch != NULL; watch = watch->next)
+        if (watch->fd == fd)
+            return watch;
+    return NULL;
+}
+
+static bool wait_for(VM* vm, WaitKind kind, int fd, Value data, int written)
+{
+    EventLoop* loop = vm->event_loop;
+
+    Watch* watch = find_watch(loop, fd);
+    if (watch == NULL)
+    {
+        watch         = (Watch*)allocate_or_exit(sizeof(Watch));
+        watch->fd     = fd;
+        watch->events = wait_events(kind);
+        watch->head   = NULL;
+        watch->tail   = NULL;
+
+        struct epoll_event event = {.events = watch->events, .data = {.ptr = watch}};
+        // Fails for regular files, which are always ready anyway.
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+        {
+            free(watch);
+            return false;
+        }
+
+        watch->prev = NULL;
+        watch->next = loop->watches;
+        if (loop->watches != NULL)
+            loop->watches->prev = watch;
+        loop->watches = watch;
+    }
+    else if ((watch->events & wait_events(kind)) == 0)
+    {
+        struct epoll_event event = {.events = watch->events | wait_events(kind),
+                                    .data   = {.ptr = watch}};
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1)
+            return false;
+        watch->events = event.events;
+    }
+
+    Waiter* waiter  = (Waiter*)allocate_or_exit(sizeof(Waiter));
+    waiter->fiber   = vm->fiber;
+    waiter->kind    = kind;
+    waiter->data    = data;
+    waiter->written = written;
+    waiter->next    = NULL;
+
+    if (watch->tail != NULL)
+        watch->tail->next = waiter;
+    else
+        watch->head = waiter;
+    watch->tail = waiter;
+    return true;
+}
+
+// Frees the watch along with its waiters, whose fibers the caller has
+// dealt with. A timer's fd belongs to the watch, and is closed too.
+static void remove_watch(EventLoop* loop, Watch* watch)
+{
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+
+    bool    is_timer = false;
+    Waiter* waiter   = watch->head;
+    while (waiter != NULL)
+    {
+        Waiter* next = waiter->next;
+        is_timer |= waiter->kind == WaitTimer;
+        free(waiter);
+        waiter = next;
+    }
+    if (is_timer)
+        close(watch->fd);
+
+    if (watch->prev != NULL)
+        watch->prev->next = watch->next;
+    else
+        loop->watches = watch->next;
+    if (watch->next != NULL)
+        watch->next->prev = watch->prev;
+    free(watch);
+}
+
+static bool would_block()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+// Carries out the operation the waiter's fiber is suspended on, and makes
+// it ready. Returns false, leaving the waiter in place, if the fd turns
+// out not to be ready after all.
+static bool complete(VM* vm, EventLoop* loop, Watch* watch, Waiter* waiter)
+{
+    Value result = NIL_VAL;
+    switch (waiter->kind)
+    {
+        case WaitTimer:
+            break;
+
+        case WaitRead:
+        {
+            char          buffer[READ_CHUNK_SIZE];
+            const ssize_t count = read(watch->fd, buffer, sizeof(buffer));
+            if (count == -1 && would_block())
+                return false;
+            if (count > 0)
+                result = string_value(vm, buffer, (int)count);
+            break;
+        }
+
+        case WaitWrite:
+        {
+            StringView view;
+            string_view(waiter->data, &view);
+
+            const ssize_t count = write(watch->fd, view.chars + waiter->written,
+                                        view.length - waiter->written);
+            if (count == -1 && would_block())
+                return false;
+            if (count == -1)
+                break;
+
+            waiter->written += (int)count;
+            if (waiter->written < view.length)
+                return false;
+            result = NUMBER_VAL(view.length);
+            break;
+        }
+    }
+
+    enqueue(loop, waiter->fiber, result);
+    return true;
+}
+
+// Serves the watch's waiters in order, up to the first of each kind that
+// would block, since those after it would block too.
+static void complete_watch(VM* vm, EventLoop* loop, Watch* watch, uint32_t events)
+{
+    // An error or hang up wakes the readers and the writers alike.
+    if (events & (EPOLLERR | EPOLLHUP))
+        events |= EPOLLIN | EPOLLOUT;
+
+    uint32_t blocked = 0;
+    Waiter** link    = &watch->head;
+    Waiter*  last    = NULL;
+    while (*link != NULL)
+    {
+        Waiter*        waiter = *link;
+        const uint32_t kind   = wait_events(waiter->kind);
+        if ((events & kind) == 0 || (blocked & kind) != 0
+            || !complete(vm, loop, watch, waiter))
+        {
+            blocked |= kind;
+            last     = waiter;
+            link     = &waiter->next;
+            continue;
+        }
+
+        *link = waiter->next;
+        free(waiter);
+    }
+    watch->tail = last;
+
+    if (watch->head == NULL)
+    {
+        remove_watch(loop, watch);
+        return;
+    }
+
+    uint32_t waiting = 0;
+    for (const Waiter* waiter = watch->head; waiter != NULL; waiter = waiter->next)
+        waiting |= wait_events(waiter->kind);
+    if (waiting != watch->events)
+    {
+        struct epoll_event event = {.events = waiting, .data = {.ptr = watch}};
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, watch->fd, &event);
+        watch->events = waiting;
+    }
+}
+
+// Each fd is in one event at most, so completing the waiters of one event
+// leaves the watches of the others in place.
+static void poll_events(VM* vm, EventLoop* loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    const int count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+    for (int i = 0; i < count; i++)
+        complete_watch(vm, loop, (Watch*)events[i].data.ptr, events[i].events);
+}
+
+// Waits for a loop fiber to become ready, or hands back the scheduler once
+// there is nothing left to wait for.
+static Task next_task(VM* vm, EventLoop* loop)
+{
+    while (loop->ready_count == 0 && loop->watches != NULL)
+        poll_events(vm, loop);
+
+    if (loop->ready_count > 0)
+        return dequeue(loop);
+
+    const Task task = {loop->scheduler, NIL_VAL};
+    loop->scheduler = NULL;
+    return task;
+}
+
+static void run_task(VM* vm, EventLoop* loop, Task task)
+{
+    // A running loop fiber waits on the scheduler, so a runtime error
+    // unwinds to it.
+    if (task.fiber->scheduled)
+        task.fiber->caller = loop->scheduler;
+    vm_transfer(vm, task.fiber, task.value);
+}
+
+// Suspends the running loop fiber, whose native call is completed once it
+// is ready again. The call isn't dropped from its stack when the fiber is
+// next in line anyway, as no switch happens.
+static Value suspend(VM* vm, int arg_count)
+{
+    EventLoop* loop  = vm->event_loop;
+    ObjFiber*  fiber = vm->fiber;
+    fiber->caller    = NULL;
+    fiber->state     = FiberSuspended;
+
+    const Task task = next_task(vm, loop);
+    if (task.fiber == fiber)
+    {
+        fiber->caller = loop->scheduler;
+        fiber->state  = FiberRunning;
+        return task.value;
+    }
+
+    vm->stack_top -= arg_count + 1;
+    run_task(vm, loop, task);
+    return NIL_VAL;
+}
+
+void loop_fiber_done(VM* vm)
+{
+    EventLoop* loop = vm->event_loop;
+    run_task(vm, loop, next_task(vm, loop));
+}
+
+Value loop_yield(VM* vm, int arg_count)
+{
+    enqueue(vm->event_loop, vm->fiber, NIL_VAL);
+    return suspend(vm, arg_count);
+}
+
+void reset_event_loop(VM* vm)
+{
+    EventLoop* loop = vm->event_loop;
+    if (loop == NULL)
+        return;
+
+    while (loop->ready_count > 0)
+        dequeue(loop).fiber->state = FiberDone;
+    while (loop->watches != NULL)
+    {
+        for (const Waiter* waiter = loop->watches->head; waiter != NULL; waiter = waiter->next)
+            waiter->fiber->state = FiberDone;
+        remove_watch(loop, loop->watches);
+    }
+    loop->scheduler = NULL;
+}
+
+void mark_event_loop(VM* vm)
+{
+    const EventLoop* loop = vm->event_loop;
+    if (loop == NULL)
+        return;
+
+    for (int i = 0; i < loop->ready_count; i++)
+    {
+        const Task* task = &loop->ready[(loop->ready_head + i) % loop->ready_capacity];
+        mark_object(vm, (Obj*)task->fiber);
+        mark_value(vm, task->value);
+    }
+    for (const Watch* watch = loop->watches; watch != NULL; watch = watch->next)
+    {
+        for (const Waiter* waiter = watch->head; waiter != NULL; waiter = waiter->next)
+        {
+            mark_object(vm, (Obj*)waiter->fiber);
+            mark_value(vm, waiter->data);
+        }
+    }
+    mark_object(vm, (Obj*)loop->scheduler);
+}
+
+static void reap_child(EventLoop* loop, int fd)
+{
+    for (Child** child = &loop->children; *child != NULL; child = &(*child)->next)
+    {
+        if ((*child)->fd != fd)
+            continue;
+
+        Child* reaped = *child;
+        *child        = reaped->next;
+        waitpid(reaped->pid, NULL, 0);
+        free(reaped);
+        return;
+    }
+}
+
+// Commands left open are waited for, like isolates.
+void free_event_loop(VM* vm)
+{
+    EventLoop* loop = vm->event_loop;
+    if (loop == NULL)
+        return;
+
+    reset_event_loop(vm);
+    while (loop->children != NULL)
+    {
+        const int fd = loop->children->fd;
+        close(fd);
+        reap_child(loop, fd);
+    }
+
+    close(loop->epoll_fd);
+    free(loop->ready);
+    free(loop);
+    vm->event_loop = NULL;
+}
+
+// Casting a double which isn't a whole number in range to int would be
+// undefined, so anything but a plausible fd is rejected.
+static bool as_fd(Value value, int* fd)
+{
+    if (!IS_NUMBER(value))
+        return false;
+
+    const double number = AS_NUMBER(value);
+    if (!(number >= 0 && number <= INT_MAX) || number != (double)(int)number)
+        return false;
+
+    *fd = (int)number;
+    return true;
+}
+
+// Returns a copy of the string's characters, terminated for the system
+// calls which take C strings.
+static char* c_string(Value value)
+{
+    StringView view;
+    string_view(value, &view);
+
+    char* chars = (char*)allocate_or_exit(view.length + 1);
+    memcpy(chars, view.chars, view.length);
+    chars[view.length] = '\0';
+    return chars;
+}
+
+// Runs the closure on the event loop, once run_loop() is called.
+static Value schedule_native(VM* vm, int arg_count, const Value* args)
+{
+    if (arg_count != 1 || !IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->func->arity != 0)
+        return NIL_VAL;
+
+    EventLoop* loop = event_loop(vm);
+    if (loop == NULL)
+        return NIL_VAL;
+
+    ObjFiber* fiber  = new_fiber(vm, AS_CLOSURE(args[0]), FIBER_INITIAL_FRAMES);
+    fiber->scheduled = true;
+    enqueue(loop, fiber, NIL_VAL);
+    return OBJ_VAL(fiber);
+}
+
+// Runs the loop fibers until every one of them is done.
+static Value run_loop_native(VM* vm, int arg_count, __attribute__((unused)) const Value* args)
+{
+    EventLoop* loop = vm->event_loop;
+    if (loop == NULL || loop->scheduler != NULL || vm->fiber->scheduled)
+        return NIL_VAL;
+    if (loop->ready_count == 0 && loop->watches == NULL)
+        return NIL_VAL;
+
+    loop->scheduler = vm->fiber;
+    const Task task = next_task(vm, loop);
+
+    vm->stack_top -= arg_count + 1;
+    run_task(vm, loop, task);
+    return NIL_VAL;
+}
+
+static Value sleep_native(VM* vm, int arg_count, const Value* args)
+{
+    if (arg_count != 1 || !IS_NUMBER(args[0]))
+        return NIL_VAL;
+
+    // NaN, the infinities and durations past time_t don't convert, so they
+    // are rejected rather than cast. INT_MAX seconds fit any time_t.
+    if (!isfinite(AS_NUMBER(args[0])) || AS_NUMBER(args[0]) > INT_MAX)
+        return NIL_VAL;
+
+    const double    seconds  = AS_NUMBER(args[0]) > 0 ? AS_NUMBER(args[0]) : 0;
+    struct timespec duration = {.tv_sec  = (time_t)seconds,
+                                .tv_nsec = (long)((seconds - (double)(time_t)seconds) * 1e9)};
+
+    if (!vm->fiber->scheduled)
+    {
+        while (nanosleep(&duration, &duration) == -1 && errno == EINTR)
+            ;
+        return NIL_VAL;
+    }
+
+    // A timer set to zero is disarmed, and would never fire.
+    if (duration.tv_sec == 0 && duration.tv_nsec == 0)
+        duration.tv_nsec = 1;
+
+    const struct itimerspec timer = {.it_value = duration};
+
+    const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1)
+        return NIL_VAL;
+    if (timerfd_settime(fd, 0, &timer, NULL) == -1
+        || !wait_for(vm, WaitTimer, fd, NIL_VAL, 0))
+    {
+        close(fd);
+        return NIL_VAL;
+    }
+    return suspend(vm, arg_count);
+}
+
+// Opens the file at path for reading ("r"), writing ("w") or appending
+// ("a"), and returns its file descriptor.
+static Value open_native(__attribute__((unused)) VM* vm, int arg_count, const Value* args)
+{
+    if (arg_count < 1 || arg_count > 2 || !IS_STRING(args[0])
+        || (arg_count == 2 && !IS_STRING(args[1])))
+        return NIL_VAL;
+
+    int flags = O_RDONLY;
+    if (arg_count == 2)
+    {
+        StringView mode;
+        string_view(args[1], &mode);
+        if (mode.length != 1)
+            return NIL_VAL;
+
+        switch (mode.chars[0])
+        {
+            case 'r':
+                flags = O_RDONLY;
+                break;
+            case 'w':
+                flags = O_WRONLY | O_CREAT | O_TRUNC;
+                break;
+            case 'a':
+                flags = O_WRONLY | O_CREAT | O_APPEND;
+                break;
+            default:
+                return NIL_VAL;
+        }
+    }
+
+    char*     path = c_string(args[0]);
+    const int fd   = open(path, flags | O_NONBLOCK | O_CLOEXEC, 0666);
+    free(path);
+    return fd != -1 ? NUMBER_VAL(fd) : NIL_VAL;
+}
+
+// Runs the command with the shell, and returns a file descriptor to read
+// its output from.
+static Value command_native(VM* vm, int arg_count, const Value* args)
+{
+    if (arg_count != 1 || !IS_STRING(args[0]))
+        return NIL_VAL;
+
+    EventLoop* loop = event_loop(vm);
+    int        fds[2];
+    if (loop == NULL || pipe2(fds, O_CLOEXEC) == -1)
+        return NIL_VAL;
+
+    char*       command = c_string(args[0]);
+    const pid_t pid     = fork();
+    if (pid == 0)
+    {
+        dup2(fds[1], STDOUT_FILENO);
+        execl("/bin/sh", "sh", "-c", command, (char*)NULL);
+        _exit(127);
+    }
+    free(command);
+    close(fds[1]);
+
+    if (pid == -1)
+    {
+        close(fds[0]);
+        return NIL_VAL;
+    }
+
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    Child* child   = (Child*)allocate_or_exit(sizeof(Child));
+    child->fd      = fds[0];
+    child->pid     = pid;
+    child->next    = loop->children;
+    loop->children = child;
+    return NUMBER_VAL(fds[0]);
+}
+
+// Returns up to READ_CHUNK_SIZE bytes as a string, or nil at the end of
+// the file or on an error.
+static Value read_native(VM* vm, int arg_count, const Value* args)
+{
+    int fd;
+    if (arg_count != 1 || !as_fd(args[0], &fd))
+        return NIL_VAL;
+
+    while (true)
+    {
+        char          buffer[READ_CHUNK_SIZE];
+        const ssize_t count = read(fd, buffer, sizeof(buffer));
+        if (count >= 0)
+            return count > 0 ? string_value(vm, buffer, (int)count) : NIL_VAL;
+        if (!would_block())
+            return NIL_VAL;
+
+        if (vm->fiber->scheduled)
+            return wait_for(vm, WaitRead, fd, NIL_VAL, 0) ? suspend(vm, arg_count)
+                                                                     : NIL_VAL;
+
+        struct pollfd readable = {.fd = fd, .events = POLLIN};
+        poll(&readable, 1, -1);
+    }
+}
+
+// Writes the whole string, and returns its length, or nil on an error.
+static Value write_native(VM* vm, int arg_count, const Value* args)
+{
+    int fd;
+    if (arg_count != 2 || !as_fd(args[0], &fd) || !IS_STRING(args[1]))
+        return NIL_VAL;
+
+    StringView view;
+    string_view(args[1], &view);
+
+    int written = 0;
+    while (written < view.length)
+    {
+        const ssize_t count = write(fd, view.chars + written, view.length - written);
+        if (count >= 0)
+        {
+            written += (int)count;
+            continue;
+        }
+        if (!would_block())
+            return NIL_VAL;
+
+        if (vm->fiber->scheduled)
+            return wait_for(vm, WaitWrite, fd, args[1], written)
+                       ? suspend(vm, arg_count)
+                       : NIL_VAL;
+
+        struct pollfd writable = {.fd = fd, .events = POLLOUT};
+        poll(&writable, 1, -1);
+    }
+    return NUMBER_VAL(written);
+}
+
+static Value close_native(VM* vm, int arg_count, const Value* args)
+{
+    int fd;
+    if (arg_count != 1 || !as_fd(args[0], &fd))
+        return NIL_VAL;
+
+    // Fibers waiting on fd would otherwise wait forever, since epoll drops
+    // a closed fd. They are resumed with nil, as on an error.
+    EventLoop* loop  = vm->event_loop;
+    Watch*     watch = loop != NULL ? find_watch(loop, fd) : NULL;
+    if (watch != NULL)
+    {
+        for (const Waiter* waiter = watch->head; waiter != NULL; waiter = waiter->next)
+            enqueue(loop, waiter->fiber, NIL_VAL);
+        remove_watch(loop, watch);
+    }
+
+    const bool closed = close(fd) == 0;
+    if (loop != NULL)
+        reap_child(loop, fd);
+    return BOOL_VAL(closed);
+}
+
+void define_event_loop_natives(VM* vm)
+{
+    define_native(vm, "schedule", schedule_native);
+    define_native(vm, "run_loop", run_loop_native);
+    define_native(vm, "sleep", sleep_native);
+    define_native(vm, "open", open_native);
+    define_native(vm, "command", command_native);
+    define_native(vm, "read", read_native);
+    define_native(vm, "write", write_native);
+    define_native(vm, "close", close_native);
+}
+
+#endif
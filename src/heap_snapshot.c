@@ -0,0 +1,165 @@
+#include "clocks/heap_snapshot.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include <clocks/memory.h>
+#include <clocks/object.h>
+#include <clocks/vm.h>
+
+void grow_heap_snapshot(HeapSnapshot* snapshot)
+{
+    snapshot->capacity   = GROW_CAPACITY(snapshot->capacity);
+    snapshot->references = (HeapReference*)realloc(
+        snapshot->references, sizeof(HeapReference) * snapshot->capacity);
+    if (snapshot->references == NULL)
+        exit(1);
+}
+
+static int compare_references(const void* a, const void* b)
+{
+    const HeapReference* x = (const HeapReference*)a;
+    const HeapReference* y = (const HeapReference*)b;
+    if (x->from != y->from)
+        return (uintptr_t)x->from < (uintptr_t)y->from ? -1 : 1;
+    if (x->to != y->to)
+        return (uintptr_t)x->to < (uintptr_t)y->to ? -1 : 1;
+    return 0;
+}
+
+// Sorts the references by the object they are from, dropping duplicates,
+// and returns how many are left.
+static size_t sort_references(HeapSnapshot* snapshot)
+{
+    HeapReference* references = snapshot->references;
+    if (snapshot->count == 0)
+        return 0;
+
+    qsort(references, snapshot->count, sizeof(HeapReference), compare_references);
+
+    size_t count = 1;
+    for (size_t i = 1; i < snapshot->count; i++)
+    {
+        if (compare_references(&references[i], &references[count - 1]) != 0)
+            references[count++] = references[i];
+    }
+    return count;
+}
+
+// Returns the first of the references from the object.
+static size_t find_references(const HeapReference* references, size_t count,
+                              const Obj* from)
+{
+    size_t low  = 0;
+    size_t high = count;
+    while (low < high)
+    {
+        const size_t mid = low + (high - low) / 2;
+        if ((uintptr_t)references[mid].from < (uintptr_t)from)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+static const char* function_name(const ObjFunction* func)
+{
+    return func->name != NULL ? func->name->chars : "script";
+}
+
+// Names are identifiers, which need no escaping.
+static void write_name(FILE* out, const Obj* object)
+{
+    switch (obj_type(object))
+    {
+        case ObjTypeFunction:
+            fprintf(out, ", \"name\": \"%s\"", function_name((const ObjFunction*)object));
+            break;
+        case ObjTypeClosure:
+            fprintf(out, ", \"name\": \"%s\"",
+                    function_name(((const ObjClosure*)object)->func));
+            break;
+        case ObjTypeBoundMethod:
+            fprintf(out, ", \"name\": \"%s\"",
+                    function_name(((const ObjBoundMethod*)object)->method->func));
+            break;
+        case ObjTypeClass:
+            fprintf(out, ", \"name\": \"%s\"", ((const ObjClass*)object)->name->chars);
+            break;
+        case ObjTypeInstance:
+            fprintf(out, ", \"class\": \"%s\"",
+                    ((const ObjInstance*)object)->klass->name->chars);
+            break;
+        default:
+            break;
+    }
+}
+
+static void write_ids(FILE* out, const HeapReference* references, size_t start,
+                      size_t count, const Obj* from)
+{
+    for (size_t i = start; i < count && references[i].from == from; i++)
+        fprintf(out, "%s%" PRIuPTR, i > start ? ", " : "", (uintptr_t)references[i].to);
+}
+
+bool write_heap_snapshot(VM* vm, FILE* out)
+{
+    HeapSnapshot snapshot = {NULL, NULL, 0, 0};
+    vm->heap_snapshot     = &snapshot;
+    mark_heap(vm);
+    vm->heap_snapshot = NULL;
+
+    const HeapReference* references = snapshot.references;
+    const size_t         count      = sort_references(&snapshot);
+
+    size_t unreachable       = 0;
+    size_t unreachable_bytes = 0;
+    for (const Obj* object = vm->obj_head; object != NULL; object = obj_next(object))
+    {
+        if (!is_marked(vm, object))
+        {
+            unreachable++;
+            unreachable_bytes += object_size(object);
+        }
+    }
+
+    fprintf(out, "{\n\"version\": 1,\n\"heap_bytes\": %zu,\n", vm->bytes_allocated);
+    fprintf(out, "\"unreachable_objects\": %zu,\n\"unreachable_bytes\": %zu,\n", unreachable,
+            unreachable_bytes);
+
+    fprintf(out, "\"roots\": [");
+    write_ids(out, references, 0, count, NULL);
+    fprintf(out, "],\n\"objects\": [\n");
+
+    bool first = true;
+    for (const Obj* object = vm->obj_head; object != NULL; object = obj_next(object))
+    {
+        if (!is_marked(vm, object))
+            continue;
+
+        fprintf(out, "%s{\"id\": %" PRIuPTR ", \"type\": \"%s\", \"size\": %zu",
+                first ? "" : ",\n", (uintptr_t)object, obj_type_name(obj_type(object)),
+                object_size(object));
+        write_name(out, object);
+        fprintf(out, ", \"refs\": [");
+        write_ids(out, references, find_references(references, count, object), count, object);
+        fprintf(out, "]}");
+        first = false;
+    }
+    fprintf(out, "\n]\n}\n");
+
+    unmark_heap(vm);
+    free(snapshot.references);
+    return !ferror(out);
+}
+
+bool save_heap_snapshot(VM* vm, const char* path)
+{
+    FILE* out = fopen(path, "w");
+    if (out == NULL)
+        return false;
+
+    const bool written = write_heap_snapshot(vm, out);
+    return fclose(out) == 0 && written;
+}
@@ -0,0 +1,284 @@
+#include "clocks/isolate.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <clocks/common.h>
+#include <clocks/object.h>
+#include <clocks/table.h>
+#include <clocks/value.h>
+#include <clocks/vm.h>
+
+// A message holds either an immediate value, a channel reference, or the
+// characters of a heap string, which live inline after the message.
+struct Message
+{
+    Message* next;
+    Value    value;
+    Channel* channel;
+    int      length;
+    char     chars[];
+};
+
+struct Channel
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;
+    int             ref_count;
+    Message*        head;
+    Message*        tail;
+};
+
+struct Isolate
+{
+    pthread_t thread;
+    VM*       parent_vm;
+    char*     source;
+    Channel*  channel;
+    Isolate*  next;
+};
+
+static void* allocate_or_exit(size_t size)
+{
+    void* result = malloc(size);
+    if (result == NULL)
+        exit(1);
+    return result;
+}
+
+Channel* channel_create()
+{
+    Channel* channel = (Channel*)allocate_or_exit(sizeof(Channel));
+    pthread_mutex_init(&channel->lock, NULL);
+    pthread_cond_init(&channel->ready, NULL);
+    channel->ref_count = 1;
+    channel->head      = NULL;
+    channel->tail      = NULL;
+    return channel;
+}
+
+void channel_retain(Channel* channel)
+{
+    pthread_mutex_lock(&channel->lock);
+    channel->ref_count++;
+    pthread_mutex_unlock(&channel->lock);
+}
+
+void channel_release(Channel* channel)
+{
+    pthread_mutex_lock(&channel->lock);
+    const bool is_last = --channel->ref_count == 0;
+    pthread_mutex_unlock(&channel->lock);
+
+    if (!is_last)
+        return;
+
+    Message* message = channel->head;
+    while (message != NULL)
+    {
+        Message* next = message->next;
+        message_free(message);
+        message = next;
+    }
+
+    pthread_cond_destroy(&channel->ready);
+    pthread_mutex_destroy(&channel->lock);
+    free(channel);
+}
+
+static Message* new_message(int length)
+{
+    Message* message = (Message*)allocate_or_exit(sizeof(Message) + length);
+    message->next    = NULL;
+    message->value   = NIL_VAL;
+    message->channel = NULL;
+    message->length  = -1;
+    return message;
+}
+
+Message* message_encode(Value value)
+{
+    Message* message = NULL;
+    if (IS_NIL(value) || IS_BOOL(value) || IS_NUMBER(value))
+    {
+        message        = new_message(0);
+        message->value = value;
+    }
+#ifdef VALUE_SHORT_STRINGS
+    else if (IS_SHORT_STRING(value))
+    {
+        message        = new_message(0);
+        message->value = value;
+    }
+#endif
+    else if (IS_STRING(value))
+    {
+        const ObjString* string = AS_STRING(value);
+
+        message         = new_message(string->length);
+        message->length = string->length;
+        memcpy(message->chars, string->chars, string->length);
+    }
+    else if (IS_CHANNEL(value))
+    {
+        message          = new_message(0);
+        message->channel = AS_CHANNEL(value);
+        channel_retain(message->channel);
+    }
+    return message;
+}
+
+Value message_decode(VM* vm, Message* message)
+{
+    Value value = message->value;
+    if (message->channel != NULL)
+        value = OBJ_VAL(new_channel(vm, message->channel));
+    else if (message->length != -1)
+        value = string_value(vm, message->chars, message->length);
+
+    free(message);
+    return value;
+}
+
+void message_free(Message* message)
+{
+    if (message->channel != NULL)
+        channel_release(message->channel);
+    free(message);
+}
+
+void channel_put(Channel* channel, Message* message)
+{
+    pthread_mutex_lock(&channel->lock);
+    if (channel->tail == NULL)
+        channel->head = message;
+    else
+        channel->tail->next = message;
+    channel->tail = message;
+    pthread_cond_signal(&channel->ready);
+    pthread_mutex_unlock(&channel->lock);
+}
+
+bool channel_send(Channel* channel, Value value)
+{
+    Message* message = message_encode(value);
+    if (message == NULL)
+        return false;
+
+    channel_put(channel, message);
+    return true;
+}
+
+Value channel_receive(VM* vm, Channel* channel)
+{
+    pthread_mutex_lock(&channel->lock);
+    while (channel->head == NULL)
+        pthread_cond_wait(&channel->ready, &channel->lock);
+
+    Message* message = channel->head;
+    channel->head    = message->next;
+    if (channel->head == NULL)
+        channel->tail = NULL;
+    pthread_mutex_unlock(&channel->lock);
+
+    return message_decode(vm, message);
+}
+
+static void* run_isolate(void* arg)
+{
+    Isolate* isolate = (Isolate*)arg;
+
+    VM* vm  = vm_new();
+    vm->out = isolate->parent_vm->out;
+    vm->err = isolate->parent_vm->err;
+
+    channel_retain(isolate->channel);
+    push(vm, OBJ_VAL(copy_string(vm, "parent", 6)));
+    push(vm, OBJ_VAL(new_channel(vm, isolate->channel)));
+    table_insert(vm, &vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+    pop(vm);
+    pop(vm);
+
+    vm_interpret(vm, isolate->source);
+
+    vm_free(vm);
+    return NULL;
+}
+
+bool spawn_isolate(VM* vm, const char* path, Channel* channel)
+{
+    // Read the script here rather than on the new thread, so that a bad
+    // path fails the spawn instead of leaving the parent waiting forever.
+    char* source = read_source_file(path, vm->err);
+    if (source == NULL)
+        return false;
+
+    Isolate* isolate   = (Isolate*)allocate_or_exit(sizeof(Isolate));
+    isolate->parent_vm = vm;
+    isolate->source    = source;
+    isolate->channel   = channel;
+    channel_retain(channel);
+
+    if (pthread_create(&isolate->thread, NULL, run_isolate, isolate) != 0)
+    {
+        channel_release(channel);
+        free(isolate->source);
+        free(isolate);
+        return false;
+    }
+
+    isolate->next = vm->isolates;
+    vm->isolates  = isolate;
+    return true;
+}
+
+void join_isolates(VM* vm)
+{
+    while (vm->isolates != NULL)
+    {
+        Isolate* isolate = vm->isolates;
+        vm->isolates     = isolate->next;
+
+        pthread_join(isolate->thread, NULL);
+        channel_release(isolate->channel);
+        free(isolate->source);
+        free(isolate);
+    }
+}
+
+char* read_source_file(const char* path, FILE* err)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(err, "Could not open file \"%s\".\n", path);
+        return NULL;
+    }
+
+    fseek(file, 0L, SEEK_END);
+    const size_t file_size = ftell(file);
+    fseek(file, 0L, SEEK_SET);
+
+    char* buffer = (char*)malloc(file_size + 1);
+    if (buffer == NULL)
+    {
+        fprintf(err, "Not enough memory to read \"%s\".\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    const size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
+    if (bytes_read < file_size)
+    {
+        fprintf(err, "Could not read file \"%s\".\n", path);
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+
+    buffer[bytes_read] = '\0';
+
+    fclose(file);
+    return buffer;
+}
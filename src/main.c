@@ -1,14 +1,21 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <clocks/allocation_profile.h>
 #include <clocks/chunk.h>
 #include <clocks/common.h>
 #include <clocks/debug.h>
+#include <clocks/heap_snapshot.h>
+#include <clocks/isolate.h>
+#include <clocks/profile.h>
+#include <clocks/sampler.h>
+#include <clocks/trace.h>
 #include <clocks/vm.h>
 #include <linenoise/linenoise.h>
 
-static void repl()
+static void repl(VM* vm)
 {
     linenoiseHistoryLoad(".clocks_history");
 
@@ -18,72 +25,550 @@ static void repl()
         linenoiseHistoryAdd(line);
         linenoiseHistorySave(".clocks_history");
 
-        interpret(line);
+        vm_interpret(vm, line);
     }
     free(line);
 }
 
-static char* read_file(const char* path)
+static int exit_code(InterpretResult result)
 {
-    FILE* file = fopen(path, "rb");
-    if (file == NULL)
+    switch (result)
     {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+        case InterpretOk: return 0;
+        case InterpretCompileError: return 65;
+        case InterpretRuntimeError: return 70;
     }
+    return 70;
+}
+
+static int run_file(VM* vm, const char* path)
+{
+    char* source = read_source_file(path, stderr);
+    if (source == NULL)
+        return 74;
+
+    const InterpretResult result = vm_interpret(vm, source);
+    free(source);
+    return exit_code(result);
+}
+
+typedef struct
+{
+    const char* path;
+    char*       out;
+    size_t      out_size;
+    char*       err;
+    size_t      err_size;
+    int         status;
+    bool        done;
+} Script;
 
-    fseek(file, 0L, SEEK_END);
-    const size_t file_size = ftell(file);
-    fseek(file, 0L, SEEK_SET);
+// Workers claim scripts in argument order, while the main thread writes
+// out each script's captured output as soon as it and all earlier scripts
+// are done, so the combined output does not depend on scheduling.
+typedef struct
+{
+    Script*         scripts;
+    int             count;
+    int             next;
+    pthread_mutex_t lock;
+    pthread_cond_t  finished;
+} ScriptPool;
 
-    char* buffer = (char*)malloc(file_size + 1);
-    if (buffer == NULL)
+static void run_script(Script* script)
+{
+    FILE* out = open_memstream(&script->out, &script->out_size);
+    FILE* err = open_memstream(&script->err, &script->err_size);
+    if (out == NULL || err == NULL)
     {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+        fprintf(stderr, "Could not capture output of \"%s\".\n", script->path);
         exit(74);
     }
 
-    const size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
-    if (bytes_read < file_size)
+    char* source = read_source_file(script->path, err);
+    if (source == NULL)
+        script->status = 74;
+    else
+    {
+        VM* vm  = vm_new();
+        vm->out = out;
+        vm->err = err;
+
+        script->status = exit_code(vm_interpret(vm, source));
+
+        vm_free(vm);
+        free(source);
+    }
+
+    fclose(out);
+    fclose(err);
+}
+
+static void* script_worker(void* arg)
+{
+    ScriptPool* pool = (ScriptPool*)arg;
+    while (true)
+    {
+        pthread_mutex_lock(&pool->lock);
+        const int index = pool->next < pool->count ? pool->next++ : -1;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (index == -1)
+            return NULL;
+
+        run_script(&pool->scripts[index]);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->scripts[index].done = true;
+        pthread_cond_broadcast(&pool->finished);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Runs every script in a fresh VM on a pool of jobs threads. The exit code
+// is that of the first script, in argument order, which failed.
+static int run_files(int jobs, int count, const char* paths[])
+{
+    if (jobs > count)
+        jobs = count;
+
+    Script*    scripts = (Script*)calloc(count, sizeof(Script));
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * jobs);
+    if (scripts == NULL || threads == NULL)
     {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        fprintf(stderr, "Not enough memory to run %d scripts.\n", count);
         exit(74);
     }
+    for (int i = 0; i < count; i++)
+        scripts[i].path = paths[i];
+
+    ScriptPool pool = {.scripts = scripts, .count = count, .next = 0};
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.finished, NULL);
 
-    buffer[bytes_read] = '\0';
+    for (int i = 0; i < jobs; i++)
+    {
+        if (pthread_create(&threads[i], NULL, script_worker, &pool) != 0)
+        {
+            fprintf(stderr, "Could not start worker thread.\n");
+            exit(71);
+        }
+    }
 
-    fclose(file);
-    return buffer;
+    int status = 0;
+    for (int i = 0; i < count; i++)
+    {
+        Script* script = &scripts[i];
+
+        pthread_mutex_lock(&pool.lock);
+        while (!script->done)
+            pthread_cond_wait(&pool.finished, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        fwrite(script->out, 1, script->out_size, stdout);
+        fwrite(script->err, 1, script->err_size, stderr);
+        free(script->out);
+        free(script->err);
+
+        if (status == 0)
+            status = script->status;
+    }
+
+    for (int i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&pool.finished);
+    pthread_mutex_destroy(&pool.lock);
+    free(threads);
+    free(scripts);
+    return status;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: clocks [options] [path]\n"
+                    "       clocks -j jobs path...\n"
+                    "\n"
+                    "Options:\n"
+                    "  --profile-opcodes[=file.json]  count the opcodes executed\n"
+                    "  --profile-samples[=file]       sample the stacks, as folded stacks\n"
+                    "  --sample-rate=hz               samples a second, 1000 by default\n"
+                    "  --profile-allocations[=file]   sample the objects allocated\n"
+                    "  --allocation-interval=bytes    bytes between samples, 512 by default\n"
+                    "  --heap-snapshot=file.json      write a heap snapshot at exit\n"
+                    "  --perf-map                     name Lox functions for perf\n"
+                    "  --trace[=file]                 trace the instructions executed\n"
+                    "  --disasm[=file]                disassemble the code compiled\n"
+                    "  --trace-gc[=file]              trace allocations and collections\n"
+                    "  --trace-ring=bytes             keep only the end of each trace\n");
+    exit(64);
 }
 
-static void run_file(const char* path)
+typedef struct
 {
-    char* source = read_file(path);
+    bool        profile_opcodes;
+    const char* opcode_profile_path;
+    bool        profile_samples;
+    const char* samples_path;
+    int         sample_rate;
+    bool        profile_allocations;
+    const char* allocations_path;
+    int         allocation_interval;
+    const char* heap_snapshot_path;
+    bool        perf_map;
+    bool        trace_execution;
+    const char* trace_execution_path;
+    bool        trace_code;
+    const char* trace_code_path;
+    bool        trace_gc;
+    const char* trace_gc_path;
+    int         trace_ring_size;
+} Options;
 
-    const InterpretResult result = interpret(source);
-    free(source);
+// Matches both --name and --name=value, setting value to NULL for the
+// former.
+static bool match_option(const char* arg, const char* name, const char** value)
+{
+    const size_t length = strlen(name);
+    if (strncmp(arg, name, length) != 0 || (arg[length] != '\0' && arg[length] != '='))
+        return false;
 
-    if (result == InterpretCompileError)
-        exit(65);
-    if (result == InterpretRuntimeError)
-        exit(70);
+    *value = arg[length] == '=' ? arg + length + 1 : NULL;
+    return true;
 }
 
-int main(int argc, const char* argv[])
+static int parse_int_option(const char* value, long max)
 {
-    init_vm();
+    char*      end    = NULL;
+    const long number = value != NULL ? strtol(value, &end, 10) : 0;
+    if (end == NULL || *end != '\0' || number < 1 || number > max)
+        usage();
+    return (int)number;
+}
 
-    if (argc == 1)
-        repl();
-    else if (argc == 2)
-        run_file(argv[1]);
-    else
+// Returns the index of the first argument after the options.
+static int parse_options(int argc, const char* argv[], Options* options)
+{
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++)
+    {
+        const char* value;
+        if (match_option(argv[arg], "--profile-opcodes", &value))
+        {
+            options->profile_opcodes     = true;
+            options->opcode_profile_path = value;
+        }
+        else if (match_option(argv[arg], "--profile-samples", &value))
+        {
+            options->profile_samples = true;
+            options->samples_path    = value;
+        }
+        else if (match_option(argv[arg], "--sample-rate", &value))
+            options->sample_rate = parse_int_option(value, 10000);
+        else if (match_option(argv[arg], "--profile-allocations", &value))
+        {
+            options->profile_allocations = true;
+            options->allocations_path    = value;
+        }
+        else if (match_option(argv[arg], "--allocation-interval", &value))
+            options->allocation_interval = parse_int_option(value, 1 << 30);
+        else if (match_option(argv[arg], "--heap-snapshot", &value) && value != NULL)
+            options->heap_snapshot_path = value;
+        else if (match_option(argv[arg], "--perf-map", &value) && value == NULL)
+            options->perf_map = true;
+        else if (match_option(argv[arg], "--trace", &value))
+        {
+            options->trace_execution      = true;
+            options->trace_execution_path = value;
+        }
+        else if (match_option(argv[arg], "--disasm", &value))
+        {
+            options->trace_code      = true;
+            options->trace_code_path = value;
+        }
+        else if (match_option(argv[arg], "--trace-gc", &value))
+        {
+            options->trace_gc      = true;
+            options->trace_gc_path = value;
+        }
+        else if (match_option(argv[arg], "--trace-ring", &value))
+            options->trace_ring_size = parse_int_option(value, 1 << 30);
+        else
+            usage();
+    }
+    return arg;
+}
+
+// Writes the report to path, or to stderr if there is none.
+static bool write_report(const char* path, const void* profile,
+                         bool (*write)(const void* profile, FILE* out))
+{
+    if (path == NULL)
+        return write(profile, stderr);
+
+    FILE* out = fopen(path, "w");
+    if (out == NULL || !write(profile, out))
+    {
+        fprintf(stderr, "Could not write \"%s\".\n", path);
+        if (out != NULL)
+            fclose(out);
+        return false;
+    }
+    return fclose(out) == 0;
+}
+
+#ifdef PROFILE_OPCODES
+// Printed for people, unless it goes to a file.
+static bool write_opcode_profile(const void* profile, FILE* out)
+{
+    if (out == stderr)
+    {
+        print_opcode_profile((const OpcodeProfile*)profile, out);
+        return true;
+    }
+    return write_opcode_profile_json((const OpcodeProfile*)profile, out);
+}
+#endif
+
+static bool write_allocation_profile(const void* profile, FILE* out)
+{
+    print_allocation_profile((const AllocationProfile*)profile, out);
+    return !ferror(out);
+}
+
+#ifdef __linux__
+static bool write_samples(const void* sampler, FILE* out)
+{
+    return write_folded_stacks((const Sampler*)sampler, out);
+}
+#endif
+
+static bool same_path(const char* a, const char* b)
+{
+    return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+static FILE* open_trace_with(const Options* options, const char* path)
+{
+#ifdef __linux__
+    if (options->trace_ring_size != 0)
+        return open_trace_ring(path, (size_t)options->trace_ring_size);
+#endif
+    return open_trace(path);
+}
+
+// Traces asked for to the same path share a stream. Returns the exit code
+// if a trace can't be opened, or 0.
+static int start_tracing(VM* vm, const Options* options, FILE* traces[3])
+{
+#ifndef __linux__
+    if (options->trace_ring_size != 0)
     {
-        fprintf(stderr, "Usage: clocks [path]\n");
-        exit(64);
+        fprintf(stderr, "Ring buffers for traces are only supported on Linux.\n");
+        return 64;
     }
+#endif
+
+    const bool  wanted[3] = {options->trace_execution, options->trace_code, options->trace_gc};
+    const char* paths[3]  = {options->trace_execution_path, options->trace_code_path,
+                             options->trace_gc_path};
+    for (int i = 0; i < 3; i++)
+    {
+        if (!wanted[i])
+            continue;
 
-    free_vm();
+        for (int j = 0; j < i && traces[i] == NULL; j++)
+        {
+            if (wanted[j] && same_path(paths[i], paths[j]))
+                traces[i] = traces[j];
+        }
+        if (traces[i] == NULL)
+            traces[i] = open_trace_with(options, paths[i]);
+        if (traces[i] == NULL)
+        {
+            fprintf(stderr, "Could not open \"%s\" for tracing.\n",
+                    paths[i] != NULL ? paths[i] : "stderr");
+            return 74;
+        }
+    }
 
+    if (wanted[0])
+        vm->trace_execution = traces[0];
+    if (wanted[1])
+        vm->trace_code = traces[1];
+    if (wanted[2])
+        vm->trace_gc = traces[2];
     return 0;
 }
+
+// Closes each of the traces opened once. Returns false if any could not be
+// written.
+static bool finish_tracing(VM* vm, FILE* traces[3])
+{
+    if (traces[0] != NULL)
+        vm->trace_execution = NULL;
+    if (traces[1] != NULL)
+        vm->trace_code = NULL;
+    if (traces[2] != NULL)
+        vm->trace_gc = NULL;
+
+    bool written = true;
+    for (int i = 0; i < 3; i++)
+    {
+        bool shared = false;
+        for (int j = 0; j < i; j++)
+            shared = shared || traces[j] == traces[i];
+
+        if (traces[i] != NULL && !shared)
+            written = fclose(traces[i]) == 0 && written;
+    }
+    return written;
+}
+
+// Returns the exit code if a profiler can't be started, or 0.
+static int start_profiling(VM* vm, const Options* options)
+{
+    if (options->profile_samples)
+    {
+#ifdef __linux__
+        if (start_sampler(vm, options->sample_rate) == NULL)
+        {
+            fprintf(stderr, "Could not start sampling.\n");
+            return 71;
+        }
+#else
+        fprintf(stderr, "Sampling is only supported on Linux.\n");
+        return 64;
+#endif
+    }
+
+    if (options->perf_map)
+    {
+#ifdef PERF_MAP
+        vm->perf_map = new_perf_map();
+        if (vm->perf_map == NULL)
+        {
+            fprintf(stderr, "Could not create the perf map.\n");
+            return 73;
+        }
+#else
+        fprintf(stderr, "clocks was built without PERF_MAP, see common.h.\n");
+        return 64;
+#endif
+    }
+
+    if (options->profile_allocations)
+        vm->allocation_profile = new_allocation_profile(options->allocation_interval);
+
+    if (options->profile_opcodes)
+    {
+#ifdef PROFILE_OPCODES
+        vm->opcode_profile = new_opcode_profile();
+#else
+        fprintf(stderr, "clocks was built without PROFILE_OPCODES, see common.h.\n");
+        return 64;
+#endif
+    }
+    return 0;
+}
+
+// Writes out and frees the profiles. Returns false if any could not be
+// written.
+static bool finish_profiling(VM* vm, const Options* options)
+{
+    bool written = true;
+#ifdef __linux__
+    if (vm->sampler != NULL)
+    {
+        stop_sampler(vm->sampler);
+        written = write_report(options->samples_path, vm->sampler, write_samples);
+        free_sampler(vm->sampler);
+    }
+#endif
+    if (vm->allocation_profile != NULL)
+    {
+        written = write_report(options->allocations_path, vm->allocation_profile,
+                               write_allocation_profile)
+                  && written;
+        free_allocation_profile(vm->allocation_profile);
+        vm->allocation_profile = NULL;
+    }
+#ifdef PROFILE_OPCODES
+    if (vm->opcode_profile != NULL)
+    {
+        written = write_report(options->opcode_profile_path, vm->opcode_profile,
+                               write_opcode_profile)
+                  && written;
+        free_opcode_profile(vm->opcode_profile);
+        vm->opcode_profile = NULL;
+    }
+#endif
+    return written;
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "-j") == 0)
+    {
+        char*      end  = NULL;
+        const long jobs = argc >= 3 ? strtol(argv[2], &end, 10) : 0;
+        if (end == NULL || *end != '\0' || jobs < 1 || jobs > 1024 || argc < 4)
+            usage();
+
+        return run_files((int)jobs, argc - 3, &argv[3]);
+    }
+
+    Options options = {.profile_opcodes      = false,
+                       .opcode_profile_path  = NULL,
+                       .profile_samples      = false,
+                       .samples_path         = NULL,
+                       .sample_rate          = 1000,
+                       .profile_allocations  = false,
+                       .allocations_path     = NULL,
+                       .allocation_interval  = 512,
+                       .heap_snapshot_path   = NULL,
+                       .perf_map             = false,
+                       .trace_execution      = false,
+                       .trace_execution_path = NULL,
+                       .trace_code           = false,
+                       .trace_code_path      = NULL,
+                       .trace_gc             = false,
+                       .trace_gc_path        = NULL,
+                       .trace_ring_size      = 0};
+
+    const int arg = parse_options(argc, argv, &options);
+    if (argc - arg > 1)
+        usage();
+
+    VM* vm = vm_new();
+
+    FILE* traces[3] = {NULL, NULL, NULL};
+    int   status    = start_tracing(vm, &options, traces);
+    if (status == 0)
+        status = start_profiling(vm, &options);
+    if (status == 0)
+    {
+        if (arg == argc)
+            repl(vm);
+        else
+            status = run_file(vm, argv[arg]);
+
+        if (options.heap_snapshot_path != NULL
+            && !save_heap_snapshot(vm, options.heap_snapshot_path))
+        {
+            fprintf(stderr, "Could not write \"%s\".\n", options.heap_snapshot_path);
+            if (status == 0)
+                status = 74;
+        }
+
+        if (!finish_profiling(vm, &options) && status == 0)
+            status = 74;
+    }
+
+    if (!finish_tracing(vm, traces) && status == 0)
+        status = 74;
+
+    vm_free(vm);
+
+    return status;
+}
@@ -1,37 +1,43 @@
 #include "clocks/memory.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <clocks/chunk.h>
 #include <clocks/common.h>
 #include <clocks/compiler.h>
+#include <clocks/heap_snapshot.h>
+#include <clocks/isolate.h>
 #include <clocks/object.h>
+#include <clocks/probes.h>
 #include <clocks/table.h>
 #include <clocks/value.h>
 #include <clocks/vm.h>
 
-#ifdef DEBUG_LOG_GC
-#include <stdio.h>
-
-#include <clocks/debug.h>
-#endif
-
 #define GC_HEAP_GROW_FACTOR 2
 
-static void blacken_object(Obj* gray_obj);
-static void free_object(Obj* object);
+static void blacken_object(VM* vm, Obj* gray_obj);
+static void free_object(VM* vm, Obj* object);
 
-void* reallocate(void* pointer, size_t old_size, size_t new_size)
+static void mark_array(VM* vm, ValueArray* array)
 {
-    vm.bytes_allocated += (new_size - old_size);
+    for (int i = 0; i < array->count; i++)
+        mark_value(vm, array->values[i]);
+}
+
+void* reallocate(VM* vm, void* pointer, size_t old_size, size_t new_size)
+{
+    vm->bytes_allocated += (new_size - old_size);
 
     if (new_size > old_size)
     {
 #ifdef DEBUG_STRESS_GC
-        collect_garbage();
+        collect_garbage(vm);
 #endif
-        if (vm.bytes_allocated > vm.next_gc_thresh)
-            collect_garbage();
+        if (vm->bytes_allocated > vm->next_gc_thresh)
+            collect_garbage(vm);
     }
 
     if (new_size == 0)
@@ -47,231 +53,385 @@ void* reallocate(void* pointer, size_t old_size, size_t new_size)
     return result;
 }
 
-void mark_object(Obj* object)
+void mark_object(VM* vm, Obj* object)
 {
+    if (vm->heap_snapshot != NULL && object != NULL)
+        record_reference(vm->heap_snapshot, object);
+
     if (object == NULL
 #ifdef GC_OPTIMIZE_CLEARING_MARK
-        || object->mark == vm.mark_value)
+        || obj_mark(object) == vm->mark_value)
 #else
-        || object->is_marked)
+        || obj_mark(object))
 #endif
     {
         return;
     }
 
-#ifdef DEBUG_LOG_GC
-    printf("%p mark ", (void*)object);
-    print_value(OBJ_VAL(object));
-    printf("\n");
-#endif
+    if (vm->trace_gc != NULL)
+    {
+        fprintf(vm->trace_gc, "%p mark ", (void*)object);
+        print_value(vm->trace_gc, OBJ_VAL(object));
+        fputc('\n', vm->trace_gc);
+    }
 
 #ifdef GC_OPTIMIZE_CLEARING_MARK
-    object->mark = vm.mark_value;
+    obj_set_mark(object, vm->mark_value);
 #else
-    object->is_marked = true;
+    obj_set_mark(object, true);
 #endif
 
-    if (object->type == ObjTypeString || object->type == ObjTypeNative)
+    const ObjType type = obj_type(object);
+    if (type == ObjTypeString || type == ObjTypeNative || type == ObjTypeChannel)
     {
-        blacken_object(object);
+        blacken_object(vm, object);
         return;
     }
 
-    if (vm.gray_capacity < vm.gray_count + 1)
+    if (vm->gray_capacity < vm->gray_count + 1)
     {
-        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-        vm.gray_stack    = (Obj**)realloc(vm.gray_stack,
-                                          sizeof(Obj*) * vm.gray_capacity);
-        if (vm.gray_stack == NULL)
+        vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+        vm->gray_stack    = (Obj**)realloc(vm->gray_stack,
+                                           sizeof(Obj*) * vm->gray_capacity);
+        if (vm->gray_stack == NULL)
             exit(1);
     }
 
-    vm.gray_stack[vm.gray_count++] = object;
+    vm->gray_stack[vm->gray_count++] = object;
 }
 
-void mark_value(Value value)
+void mark_value(VM* vm, Value value)
 {
     if (IS_OBJ(value))
-        mark_object(AS_OBJ(value));
+        mark_object(vm, AS_OBJ(value));
 }
 
-static void mark_roots()
+static void mark_stack(VM* vm, Value* stack, const Value* stack_top,
+                       const CallFrame* frames, int frame_count,
+                       ObjUpvalue* open_upvalues)
 {
-    for (Value* slot = vm.stack; slot < vm.stack_top; slot++)
-        mark_value(*slot);
+    for (Value* slot = stack; slot < stack_top; slot++)
+        mark_value(vm, *slot);
 
-    for (int i = 0; i < vm.frame_count; i++)
-        mark_object((Obj*)vm.frames[i].closure);
+    for (int i = 0; i < frame_count; i++)
+        mark_object(vm, (Obj*)frames[i].closure);
 
-    for (ObjUpvalue* upvalue = vm.open_upvalues_head;
+    for (ObjUpvalue* upvalue = open_upvalues;
          upvalue != NULL;
          upvalue = upvalue->next)
     {
-        mark_object((Obj*)upvalue);
+        mark_object(vm, (Obj*)upvalue);
     }
-
-    mark_table(&vm.globals);
-    mark_compiler_roots();
-    mark_object((Obj*)vm.init_string);
 }
 
-static void mark_array(ValueArray* array)
+static void mark_roots(VM* vm)
 {
-    for (int i = 0; i < array->count; i++)
-        mark_value(array->values[i]);
+    mark_stack(vm, vm->stack, vm->stack_top, vm->frames, vm->frame_count,
+               vm->open_upvalues_head);
+    mark_object(vm, (Obj*)vm->fiber);
+    mark_object(vm, (Obj*)vm->main_fiber);
+#ifdef __linux__
+    mark_event_loop(vm);
+    if (vm->sampler != NULL)
+        mark_sampler(vm, vm->sampler);
+#endif
+    if (vm->allocation_profile != NULL)
+        mark_allocation_profile(vm, vm->allocation_profile);
+#ifdef PROFILE_OPCODES
+    if (vm->opcode_profile != NULL)
+        mark_opcode_profile(vm, vm->opcode_profile);
+#endif
+
+    mark_table(vm, &vm->globals);
+    mark_compiler_roots(vm);
+    mark_object(vm, (Obj*)vm->init_string);
+#ifdef OBJECT_METHOD_SELECTORS
+    mark_array(vm, &vm->selectors);
+#endif
 }
 
-static void mark_upvalues(ObjClosure* closure)
+static void mark_upvalues(VM* vm, ObjClosure* closure)
 {
     for (int i = 0; i < closure->upvalue_count; i++)
-        mark_object((Obj*)closure->upvalues[i]);
+#ifdef COMPILER_CAPTURE_BY_VALUE
+        mark_value(vm, closure->upvalues[i]);
+#else
+        mark_object(vm, (Obj*)closure->upvalues[i]);
+#endif
 }
 
-static void blacken_object(Obj* gray_obj)
+static void blacken_object(VM* vm, Obj* gray_obj)
 {
-#ifdef DEBUG_LOG_GC
-    printf("%p blacken ", (void*)gray_obj);
-    print_value(OBJ_VAL(gray_obj));
-    printf("\n");
-#endif
+    if (vm->trace_gc != NULL)
+    {
+        fprintf(vm->trace_gc, "%p blacken ", (void*)gray_obj);
+        print_value(vm->trace_gc, OBJ_VAL(gray_obj));
+        fputc('\n', vm->trace_gc);
+    }
 
-    switch (gray_obj->type)
+    switch (obj_type(gray_obj))
     {
         case ObjTypeFunction:
         {
             ObjFunction* func = (ObjFunction*)gray_obj;
-            mark_object((Obj*)func->name);
-            mark_array(&func->chunk.constants);
+            mark_object(vm, (Obj*)func->name);
+            mark_array(vm, &func->chunk.constants);
+#ifdef OBJECT_CACHE_SUPER_CALLS
+            for (int i = 0; i < func->super_cache_count; i++)
+            {
+                mark_object(vm, (Obj*)func->super_caches[i].superclass);
+                mark_object(vm, (Obj*)func->super_caches[i].method);
+            }
+#endif
             break;
         }
 
         case ObjTypeClosure:
         {
             ObjClosure* closure = (ObjClosure*)gray_obj;
-            mark_object((Obj*)closure->func);
-            mark_upvalues(closure);
+            mark_object(vm, (Obj*)closure->func);
+            mark_upvalues(vm, closure);
             break;
         }
 
         case ObjTypeUpvalue:
-            mark_value(((ObjUpvalue*)gray_obj)->closed);
+        {
+            ObjUpvalue* upvalue = (ObjUpvalue*)gray_obj;
+            mark_value(vm, upvalue->closed);
+            if (upvalue->location != &upvalue->closed)
+                mark_object(vm, (Obj*)upvalue->fiber);
             break;
+        }
+
+        case ObjTypeFiber:
+        {
+            ObjFiber* fiber = (ObjFiber*)gray_obj;
+            mark_object(vm, (Obj*)fiber->closure);
+            mark_object(vm, (Obj*)fiber->caller);
+            // The running fiber's registers live in the VM, see mark_roots().
+            if (fiber != vm->fiber)
+                mark_stack(vm, fiber->stack, fiber->stack_top, fiber->frames,
+                           fiber->frame_count, fiber->open_upvalues);
+            break;
+        }
 
         case ObjTypeClass:
         {
             ObjClass* klass = (ObjClass*)gray_obj;
-            mark_object((Obj*)klass->name);
-            mark_table(&klass->methods);
+            mark_object(vm, (Obj*)klass->name);
+#ifdef OBJECT_METHOD_SELECTORS
+            for (int i = 0; i < klass->method_capacity; i++)
+                mark_value(vm, klass->methods[i]);
+#else
+            mark_table(vm, &klass->methods);
+#endif
             break;
         }
 
         case ObjTypeInstance:
         {
             ObjInstance* instance = (ObjInstance*)gray_obj;
-            mark_object((Obj*)instance->klass);
-            mark_table(&instance->fields);
+            mark_object(vm, (Obj*)instance->klass);
+            mark_table(vm, &instance->fields);
             break;
         }
 
         case ObjTypeBoundMethod:
         {
             ObjBoundMethod* bound = (ObjBoundMethod*)gray_obj;
-            mark_value(bound->recv);
-            mark_object((Obj*)bound->method);
+            mark_value(vm, bound->recv);
+            mark_object(vm, (Obj*)bound->method);
             break;
         }
 
         case ObjTypeString:
         case ObjTypeNative:
+        case ObjTypeChannel:
             break;
     }
 }
 
-static void trace_references()
+static void trace_references(VM* vm)
 {
-    while (vm.gray_count > 0)
+    while (vm->gray_count > 0)
     {
-        Obj* gray_object = vm.gray_stack[--vm.gray_count];
-        blacken_object(gray_object);
+        Obj* gray_object = vm->gray_stack[--vm->gray_count];
+        blacken_object(vm, gray_object);
     }
 }
 
-static void sweep()
+void mark_heap(VM* vm)
+{
+    HeapSnapshot* snapshot = vm->heap_snapshot;
+    snapshot->source       = NULL;
+    mark_roots(vm);
+
+    while (vm->gray_count > 0)
+    {
+        Obj* gray_object = vm->gray_stack[--vm->gray_count];
+        snapshot->source = gray_object;
+        blacken_object(vm, gray_object);
+    }
+}
+
+void unmark_heap(VM* vm)
+{
+    for (Obj* object = vm->obj_head; object != NULL; object = obj_next(object))
+#ifdef GC_OPTIMIZE_CLEARING_MARK
+        obj_set_mark(object, !vm->mark_value);
+#else
+        obj_set_mark(object, false);
+#endif
+}
+
+bool is_marked(const VM* vm, const Obj* object)
+{
+#ifdef GC_OPTIMIZE_CLEARING_MARK
+    return obj_mark(object) == vm->mark_value;
+#else
+    (void)vm;
+    return obj_mark(object);
+#endif
+}
+
+static void sweep(VM* vm)
 {
     Obj* prev = NULL;
-    Obj* curr = vm.obj_head;
+    Obj* curr = vm->obj_head;
     while (curr != NULL)
     {
 #ifdef GC_OPTIMIZE_CLEARING_MARK
-        if (curr->mark == vm.mark_value)
+        if (obj_mark(curr) == vm->mark_value)
         {
 #else
-        if (curr->is_marked)
+        if (obj_mark(curr))
         {
-            curr->is_marked = false;
+            obj_set_mark(curr, false);
 #endif
             prev = curr;
-            curr = curr->next;
+            curr = obj_next(curr);
         }
         else
         {
             Obj* unreached = curr;
 
-            curr = curr->next;
+            curr = obj_next(curr);
             if (prev != NULL)
-                prev->next = curr;
+                obj_set_next(prev, curr);
             else
-                vm.obj_head = curr;
+                vm->obj_head = curr;
 
-            free_object(unreached);
+            free_object(vm, unreached);
         }
     }
 }
 
-void collect_garbage()
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void init_gc_stats(GcStats* stats)
 {
-#ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
-    size_t before = vm.bytes_allocated;
+    memset(stats, 0, sizeof(GcStats));
+    stats->start_ns = monotonic_ns();
+
+    const char* log = getenv("CLOCKS_GC_LOG");
+    stats->log      = log != NULL && log[0] != '\0' && strcmp(log, "0") != 0;
+}
+
+static void record_collection(VM* vm, size_t before, uint64_t start, uint64_t marked,
+                              uint64_t end)
+{
+    GcStats*       stats = &vm->gc_stats;
+    const uint64_t pause = end - start;
+    const size_t   freed = before - vm->bytes_allocated;
+
+    stats->collections++;
+    stats->total_pause_ns += pause;
+    stats->mark_ns += marked - start;
+    stats->sweep_ns += end - marked;
+    stats->bytes_freed += freed;
+    stats->last_bytes_freed = freed;
+    if (pause > stats->max_pause_ns)
+        stats->max_pause_ns = pause;
+    if (before > stats->peak_heap)
+        stats->peak_heap = before;
+
+    int      bucket = 0;
+    uint64_t limit  = 100000;
+    for (; bucket < GC_PAUSE_BUCKETS - 1 && pause >= limit; bucket++)
+        limit *= 10;
+    stats->pauses[bucket]++;
+
+    if (stats->log)
+    {
+        fprintf(vm->err,
+                "[gc %llu] at %.3f s: %zu -> %zu bytes, freed %zu in %.3f ms "
+                "(mark %.3f ms, sweep %.3f ms), next at %zu\n",
+                (unsigned long long)stats->collections,
+                (double)(start - stats->start_ns) / 1e9, before, vm->bytes_allocated, freed,
+                (double)pause / 1e6, (double)(marked - start) / 1e6,
+                (double)(end - marked) / 1e6, vm->next_gc_thresh);
+    }
+}
+
+void collect_garbage(VM* vm)
+{
+    if (vm->trace_gc != NULL)
+        fputs("-- gc begin\n", vm->trace_gc);
+    const size_t   before = vm->bytes_allocated;
+    const uint64_t start  = monotonic_ns();
+#ifdef USDT_PROBES
+    CLOCKS_GC_BEGIN(before);
 #endif
 
-    mark_roots();
-    trace_references();
-    table_remove_white(&vm.strings);
-    sweep();
+    mark_roots(vm);
+    trace_references(vm);
+    const uint64_t marked = monotonic_ns();
+
+    table_remove_white(vm, &vm->strings);
+    if (vm->allocation_profile != NULL)
+        sweep_allocation_profile(vm, vm->allocation_profile);
+    sweep(vm);
 
 #ifdef GC_OPTIMIZE_CLEARING_MARK
-    vm.mark_value = !vm.mark_value;
+    vm->mark_value = !vm->mark_value;
 #endif
 
-    vm.next_gc_thresh = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
-
-#ifdef DEBUG_LOG_GC
-    printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-           before - vm.bytes_allocated, before, vm.bytes_allocated,
-           vm.next_gc_thresh);
+    vm->next_gc_thresh = vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
+    const uint64_t end = monotonic_ns();
+    record_collection(vm, before, start, marked, end);
+#ifdef USDT_PROBES
+    CLOCKS_GC_END(vm->bytes_allocated, before - vm->bytes_allocated, end - start);
 #endif
+
+    if (vm->trace_gc != NULL)
+    {
+        fputs("-- gc end\n", vm->trace_gc);
+        fprintf(vm->trace_gc, "   collected %zu bytes (from %zu to %zu) next at %zu\n",
+                before - vm->bytes_allocated, before, vm->bytes_allocated,
+                vm->next_gc_thresh);
+    }
 }
 
-static void free_object(Obj* object)
+static void free_object(VM* vm, Obj* object)
 {
-#ifdef DEBUG_LOG_GC
-    static const char* types[] = {"ObjString", "ObjFunction", "ObjNative", "ObjClosure",
-                                  "ObjUpvalue", "ObjClass", "ObjInstance", "ObjBoundMethod"};
-    printf("%p free type %s\n", (void*)object, types[object->type]);
-#endif
+    if (vm->trace_gc != NULL)
+        fprintf(vm->trace_gc, "%p free type %s\n", (void*)object, obj_type_name(obj_type(object)));
 
-    switch (object->type)
+    switch (obj_type(object))
     {
         case ObjTypeString:
         {
             ObjString* string = (ObjString*)object;
 #ifdef OBJECT_STRING_FLEXIBLE_ARRAY
-            reallocate(object, sizeof(ObjString) + string->length + 1, 0);
+            reallocate(vm, object, sizeof(ObjString) + string->length + 1, 0);
 #else
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            FREE_ARRAY(vm, char, string->chars, string->length + 1);
+            FREE(vm, ObjString, object);
 #endif
             break;
         }
@@ -279,58 +439,150 @@ static void free_object(Obj* object)
         case ObjTypeFunction:
         {
             ObjFunction* func = (ObjFunction*)object;
-            free_chunk(&func->chunk);
-            FREE(ObjFunction, object);
+            free_chunk(vm, &func->chunk);
+#ifdef OBJECT_CACHE_SUPER_CALLS
+            FREE_ARRAY(vm, SuperCallCache, func->super_caches, func->super_cache_count);
+#endif
+            FREE(vm, ObjFunction, object);
             break;
         }
 
         case ObjTypeNative:
-            FREE(ObjNative, object);
+            FREE(vm, ObjNative, object);
             break;
 
         case ObjTypeClosure:
         {
             ObjClosure* closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-            FREE(ObjClosure, object);
+#ifdef OBJECT_CLOSURE_FLEXIBLE_ARRAY
+            reallocate(vm, object, sizeof(ObjClosure) + sizeof(UpvalueSlot) * closure->upvalue_count, 0);
+#else
+            FREE_ARRAY(vm, UpvalueSlot, closure->upvalues, closure->upvalue_count);
+            FREE(vm, ObjClosure, object);
+#endif
             break;
         }
 
         case ObjTypeUpvalue:
-            FREE(ObjUpvalue, object);
+            FREE(vm, ObjUpvalue, object);
             break;
 
         case ObjTypeClass:
         {
             ObjClass* klass = (ObjClass*)object;
-            free_table(&klass->methods);
-            FREE(ObjClass, object);
+#ifdef OBJECT_METHOD_SELECTORS
+            FREE_ARRAY(vm, Value, klass->methods, klass->method_capacity);
+#else
+            free_table(vm, &klass->methods);
+#endif
+            FREE(vm, ObjClass, object);
             break;
         }
 
         case ObjTypeInstance:
         {
             ObjInstance* instance = (ObjInstance*)object;
-            free_table(&instance->fields);
-            FREE(ObjInstance, instance);
+            free_table(vm, &instance->fields);
+            FREE(vm, ObjInstance, instance);
             break;
         }
 
         case ObjTypeBoundMethod:
-            FREE(ObjBoundMethod, object);
+            FREE(vm, ObjBoundMethod, object);
             break;
+
+        case ObjTypeChannel:
+            channel_release(((ObjChannel*)object)->channel);
+            FREE(vm, ObjChannel, object);
+            break;
+
+        case ObjTypeFiber:
+        {
+            ObjFiber* fiber = (ObjFiber*)object;
+            FREE_ARRAY(vm, Value, fiber->stack, fiber->stack_capacity);
+            FREE_ARRAY(vm, CallFrame, fiber->frames, fiber->frame_capacity);
+            FREE(vm, ObjFiber, object);
+            break;
+        }
     }
 }
 
-void free_objects()
+void free_objects(VM* vm)
 {
-    Obj* curr = vm.obj_head;
+    Obj* curr = vm->obj_head;
     while (curr != NULL)
     {
-        Obj* next = curr->next;
-        free_object(curr);
+        Obj* next = obj_next(curr);
+        free_object(vm, curr);
         curr = next;
     }
 
-    free(vm.gray_stack);
+    free(vm->gray_stack);
+}
+
+size_t object_size(const Obj* object)
+{
+    switch (obj_type(object))
+    {
+        case ObjTypeString:
+        {
+            const ObjString* string = (const ObjString*)object;
+            return sizeof(ObjString) + string->length + 1;
+        }
+
+        case ObjTypeFunction:
+        {
+            const ObjFunction* func = (const ObjFunction*)object;
+            size_t             size = sizeof(ObjFunction) + func->chunk.capacity
+                        + sizeof(Value) * func->chunk.constants.capacity;
+#ifdef CHUNK_LINE_RUN_LENGTH_ENCODING
+            size += sizeof(LineStart) * func->chunk.line_capacity;
+#else
+            size += sizeof(int) * func->chunk.capacity;
+#endif
+#ifdef OBJECT_CACHE_SUPER_CALLS
+            size += sizeof(SuperCallCache) * func->super_cache_count;
+#endif
+            return size;
+        }
+
+        case ObjTypeNative:
+            return sizeof(ObjNative);
+
+        case ObjTypeClosure:
+        {
+            const ObjClosure* closure = (const ObjClosure*)object;
+            return sizeof(ObjClosure) + sizeof(UpvalueSlot) * closure->upvalue_count;
+        }
+
+        case ObjTypeUpvalue:
+            return sizeof(ObjUpvalue);
+
+        case ObjTypeClass:
+        {
+            const ObjClass* klass = (const ObjClass*)object;
+#ifdef OBJECT_METHOD_SELECTORS
+            return sizeof(ObjClass) + sizeof(Value) * klass->method_capacity;
+#else
+            return sizeof(ObjClass) + table_bytes(&klass->methods);
+#endif
+        }
+
+        case ObjTypeInstance:
+            return sizeof(ObjInstance) + table_bytes(&((const ObjInstance*)object)->fields);
+
+        case ObjTypeBoundMethod:
+            return sizeof(ObjBoundMethod);
+
+        case ObjTypeChannel:
+            return sizeof(ObjChannel);
+
+        case ObjTypeFiber:
+        {
+            const ObjFiber* fiber = (const ObjFiber*)object;
+            return sizeof(ObjFiber) + sizeof(Value) * fiber->stack_capacity
+                   + sizeof(CallFrame) * fiber->frame_capacity;
+        }
+    }
+    return 0;
 }
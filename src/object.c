@@ -6,46 +6,68 @@
 #include <clocks/chunk.h>
 #include <clocks/common.h>
 #include <clocks/memory.h>
+#include <clocks/probes.h>
 #include <clocks/table.h>
 #include <clocks/value.h>
 #include <clocks/vm.h>
 
 #define ALLOCATE_OBJ(type, obj_type) \
-    (type*)allocate_obj(sizeof(type), obj_type)
+    (type*)allocate_obj(vm, sizeof(type), obj_type)
 
-static Obj* allocate_obj(size_t size, ObjType type)
+static const char* const TYPE_NAMES[] = {"string",  "function", "native",       "closure",
+                                         "upvalue", "class",    "instance",     "bound method",
+                                         "channel", "fiber"};
+
+const char* obj_type_name(ObjType type)
 {
-    Obj* object  = (Obj*)reallocate(NULL, 0, size);
+    return TYPE_NAMES[type];
+}
+
+static Obj* allocate_obj(VM* vm, size_t size, ObjType type)
+{
+    Obj* object = (Obj*)reallocate(vm, NULL, 0, size);
+#ifdef OBJECT_COMPACT_HEADER
+    object->header = (uintptr_t)type << OBJ_HEADER_TYPE_SHIFT;
+#else
     object->type = type;
+#endif
 
 #ifdef GC_OPTIMIZE_CLEARING_MARK
-    object->mark = !vm.mark_value;
+    obj_set_mark(object, !vm->mark_value);
 #else
-    object->is_marked = false;
+    obj_set_mark(object, false);
 #endif
 
-    object->next = vm.obj_head;
-    vm.obj_head  = object;
+    obj_set_next(object, vm->obj_head);
+    vm->obj_head = object;
+
+    if (vm->allocation_profile != NULL)
+        profile_allocation(vm, vm->allocation_profile, object, size);
 
-#ifdef DEBUG_LOG_GC
-    static const char* types[] = {"ObjString", "ObjFunction", "ObjNative", "ObjClosure",
-                                  "ObjUpvalue", "ObjClass", "ObjInstance", "ObjBoundMethod"};
-    printf("%p allocate %zu bytes for %s\n", (void*)object, size, types[type]);
+#ifdef USDT_PROBES
+    if (CLOCKS_PROBE_ENABLED(object__alloc))
+        CLOCKS_OBJECT_ALLOC(obj_type_name(type), size);
 #endif
 
+    if (vm->trace_gc != NULL)
+        fprintf(vm->trace_gc, "%p allocate %zu bytes for %s\n", (void*)object, size, obj_type_name(type));
+
     return object;
 }
 
 #ifndef OBJECT_STRING_FLEXIBLE_ARRAY
-static ObjString* allocate_string(char* chars, int length, uint32_t hash)
+static ObjString* allocate_string(VM* vm, char* chars, int length, uint32_t hash)
 {
     ObjString* string = ALLOCATE_OBJ(ObjString, ObjTypeString);
     string->length    = length;
     string->chars     = chars;
     string->hash      = hash;
-    push(OBJ_VAL(string));
-    table_insert(&vm.strings, string, NIL_VAL);
-    pop();
+#ifdef OBJECT_METHOD_SELECTORS
+    string->selector = NO_SELECTOR;
+#endif
+    push(vm, OBJ_VAL(string));
+    table_insert(vm, &vm->strings, string, NIL_VAL);
+    pop(vm);
     return string;
 }
 #endif
@@ -70,125 +92,260 @@ uint32_t hash_string(const char* key, int length)
 }
 
 #ifdef OBJECT_STRING_FLEXIBLE_ARRAY
-ObjString* allocate_string(int length)
+ObjString* allocate_string(VM* vm, int length)
 {
-    ObjString* string = (ObjString*)allocate_obj(sizeof(ObjString) + length + 1, ObjTypeString);
+    ObjString* string = (ObjString*)allocate_obj(vm, sizeof(ObjString) + length + 1, ObjTypeString);
     string->length    = length;
+#ifdef OBJECT_METHOD_SELECTORS
+    string->selector = NO_SELECTOR;
+#endif
     return string;
 }
 
-static void intern_string(ObjString* string)
+static void intern_string(VM* vm, ObjString* string)
 {
-    push(OBJ_VAL(string));
-    table_insert(&vm.strings, string, NIL_VAL);
-    pop();
+    push(vm, OBJ_VAL(string));
+    table_insert(vm, &vm->strings, string, NIL_VAL);
+    pop(vm);
 }
 
-static void init_string(ObjString* string, const char* chars,
+ObjString* intern_allocated_string(VM* vm, ObjString* string)
+{
+    string->hash = hash_string(string->chars, string->length);
+
+    ObjString* interned = table_find_string(&vm->strings, string->chars,
+                                            string->length, string->hash);
+#ifdef USDT_PROBES
+    CLOCKS_STRING_INTERN((const char*)string->chars, string->length, interned != NULL);
+#endif
+    if (interned != NULL)
+        return interned;
+
+    intern_string(vm, string);
+    return string;
+}
+
+static void init_string(VM* vm, ObjString* string, const char* chars,
                         int length, uint32_t hash)
 {
     memcpy(string->chars, chars, length);
     string->hash          = hash;
     string->chars[length] = '\0';
-    intern_string(string);
+    intern_string(vm, string);
 }
 #else
-ObjString* take_string(char* chars, const int length)
+ObjString* take_string(VM* vm, char* chars, const int length)
 {
     const uint32_t hash = hash_string(chars, length);
 
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+    ObjString* interned = table_find_string(&vm->strings, chars, length, hash);
+#ifdef USDT_PROBES
+    CLOCKS_STRING_INTERN(chars, length, interned != NULL);
+#endif
     if (interned != NULL)
     {
-        FREE_ARRAY(char, chars, length + 1);
+        FREE_ARRAY(vm, char, chars, length + 1);
         return interned;
     }
 
-    return allocate_string(chars, length, hash);
+    return allocate_string(vm, chars, length, hash);
 }
 #endif
 
-ObjString* copy_string(const char* chars, int length)
+ObjString* copy_string(VM* vm, const char* chars, int length)
 {
     const uint32_t hash = hash_string(chars, length);
 
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+    ObjString* interned = table_find_string(&vm->strings, chars, length, hash);
+#ifdef USDT_PROBES
+    CLOCKS_STRING_INTERN(chars, length, interned != NULL);
+#endif
     if (interned != NULL)
         return interned;
 
 #ifdef OBJECT_STRING_FLEXIBLE_ARRAY
-    ObjString* string = allocate_string(length);
-    init_string(string, chars, length, hash);
+    ObjString* string = allocate_string(vm, length);
+    init_string(vm, string, chars, length, hash);
 
     return string;
 #else
-    char* heap_chars = ALLOCATE(char, length + 1);
+    char* heap_chars = ALLOCATE(vm, char, length + 1);
     memcpy(heap_chars, chars, length);
     heap_chars[length] = '\0';
 
-    return allocate_string(heap_chars, length, hash);
+    return allocate_string(vm, heap_chars, length, hash);
 #endif
 }
 
-ObjFunction* new_function()
+Value string_value(VM* vm, const char* chars, int length)
+{
+#ifdef VALUE_SHORT_STRINGS
+    // A short string's length ends at its first zero byte, so strings that
+    // hold one stay on the heap.
+    if (length <= SHORT_STRING_MAX && memchr(chars, '\0', length) == NULL)
+        return short_string_val(chars, length);
+#endif
+    return OBJ_VAL(copy_string(vm, chars, length));
+}
+
+ObjFunction* new_function(VM* vm)
 {
     ObjFunction* func   = ALLOCATE_OBJ(ObjFunction, ObjTypeFunction);
     func->arity         = 0;
     func->upvalue_count = 0;
     func->name          = NULL;
+#ifdef OBJECT_CACHE_SUPER_CALLS
+    func->super_cache_count = 0;
+    func->super_caches      = NULL;
+#endif
+#ifdef PERF_MAP
+    func->trampoline = NULL;
+#endif
     init_chunk(&func->chunk);
     return func;
 }
 
-ObjNative* new_native(NativeFn func)
+ObjNative* new_native(VM* vm, NativeFn func)
 {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, ObjTypeNative);
     native->func      = func;
     return native;
 }
 
-ObjClosure* new_closure(ObjFunction* func)
+ObjClosure* new_closure(VM* vm, ObjFunction* func)
 {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, func->upvalue_count);
+#ifdef OBJECT_CLOSURE_FLEXIBLE_ARRAY
+    const size_t size    = sizeof(ObjClosure) + sizeof(UpvalueSlot) * func->upvalue_count;
+    ObjClosure*  closure = (ObjClosure*)allocate_obj(vm, size, ObjTypeClosure);
+    UpvalueSlot* upvalues = closure->upvalues;
+#else
+    UpvalueSlot* upvalues = ALLOCATE(vm, UpvalueSlot, func->upvalue_count);
+#endif
     for (int i = 0; i < func->upvalue_count; i++)
+#ifdef COMPILER_CAPTURE_BY_VALUE
+        upvalues[i] = NIL_VAL;
+#else
         upvalues[i] = NULL;
+#endif
 
-    ObjClosure* closure    = ALLOCATE_OBJ(ObjClosure, ObjTypeClosure);
+#ifndef OBJECT_CLOSURE_FLEXIBLE_ARRAY
+    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, ObjTypeClosure);
+    closure->upvalues   = upvalues;
+#endif
     closure->func          = func;
-    closure->upvalues      = upvalues;
     closure->upvalue_count = func->upvalue_count;
     return closure;
 }
 
-ObjUpvalue* new_upvalue(Value* slot)
+ObjUpvalue* new_upvalue(VM* vm, Value* slot)
 {
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, ObjTypeUpvalue);
     upvalue->location   = slot;
     upvalue->closed     = NIL_VAL;
     upvalue->next       = NULL;
+    upvalue->fiber      = vm->fiber;
     return upvalue;
 }
 
-ObjClass* new_class(ObjString* name)
+ObjClass* new_class(VM* vm, ObjString* name)
 {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, ObjTypeClass);
     klass->name     = name;
 #ifdef OBJECT_CACHE_CLASS_INITIALIZER
     klass->initializer = NIL_VAL;
 #endif
+#ifdef TABLE_SMALL_LINEAR
+    klass->field_count = 0;
+#endif
+#ifdef OBJECT_METHOD_SELECTORS
+    klass->method_base     = 0;
+    klass->method_capacity = 0;
+    klass->methods         = NULL;
+#else
     init_table(&klass->methods);
+#endif
     return klass;
 }
 
-ObjInstance* new_instance(ObjClass* klass)
+#ifdef OBJECT_METHOD_SELECTORS
+static int method_selector(VM* vm, ObjString* name)
+{
+    if (name->selector == NO_SELECTOR)
+    {
+        write_value_array(vm, &vm->selectors, OBJ_VAL(name));
+        name->selector = vm->selectors.count - 1;
+    }
+    return name->selector;
+}
+
+// Widens the vector to cover selector. Growing upwards doubles it, since a
+// class's own methods are usually handed increasing selectors one at a time.
+static void widen_method_range(VM* vm, ObjClass* klass, int selector)
+{
+    const int old_end = klass->method_base + klass->method_capacity;
+    int       base    = selector;
+    int       end     = selector + 1;
+    if (klass->method_capacity > 0)
+    {
+        base = selector < klass->method_base ? selector : klass->method_base;
+        end  = selector < old_end ? old_end : selector + 1;
+        if (selector >= old_end && end < base + GROW_CAPACITY(klass->method_capacity))
+            end = base + GROW_CAPACITY(klass->method_capacity);
+    }
+
+    Value* methods = ALLOCATE(vm, Value, end - base);
+    for (int i = 0; i < end - base; i++)
+        methods[i] = NIL_VAL;
+    for (int i = 0; i < klass->method_capacity; i++)
+        methods[klass->method_base - base + i] = klass->methods[i];
+
+    FREE_ARRAY(vm, Value, klass->methods, klass->method_capacity);
+    klass->methods         = methods;
+    klass->method_base     = base;
+    klass->method_capacity = end - base;
+}
+
+// Overriding a selector already in range reuses its slot without growing.
+void class_define_method(VM* vm, ObjClass* klass, ObjString* name, Value method)
+{
+    const int selector = method_selector(vm, name);
+    if (selector < klass->method_base ||
+        selector >= klass->method_base + klass->method_capacity)
+        widen_method_range(vm, klass, selector);
+
+    klass->methods[selector - klass->method_base] = method;
+}
+
+void class_inherit(VM* vm, ObjClass* subclass, const ObjClass* superclass)
+{
+    Value* methods = ALLOCATE(vm, Value, superclass->method_capacity);
+    for (int i = 0; i < superclass->method_capacity; i++)
+        methods[i] = superclass->methods[i];
+
+    FREE_ARRAY(vm, Value, subclass->methods, subclass->method_capacity);
+    subclass->methods         = methods;
+    subclass->method_base     = superclass->method_base;
+    subclass->method_capacity = superclass->method_capacity;
+}
+#endif
+
+ObjInstance* new_instance(VM* vm, ObjClass* klass)
 {
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, ObjTypeInstance);
     instance->klass       = klass;
     init_table(&instance->fields);
+#ifdef TABLE_SMALL_LINEAR
+    if (klass->field_count > 0)
+    {
+        push(vm, OBJ_VAL(instance));
+        table_reserve_small(vm, &instance->fields, klass->field_count);
+        pop(vm);
+    }
+#endif
     return instance;
 }
 
-ObjBoundMethod* new_bound_method(Value recv, ObjClosure* method)
+ObjBoundMethod* new_bound_method(VM* vm, Value recv, ObjClosure* method)
 {
     ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, ObjTypeBoundMethod);
     bound->recv           = recv;
@@ -196,41 +353,77 @@ ObjBoundMethod* new_bound_method(Value recv, ObjClosure* method)
     return bound;
 }
 
-static void print_function(const ObjFunction* func)
+ObjChannel* new_channel(VM* vm, Channel* channel)
+{
+    ObjChannel* object = ALLOCATE_OBJ(ObjChannel, ObjTypeChannel);
+    object->channel    = channel;
+    return object;
+}
+
+ObjFiber* new_fiber(VM* vm, ObjClosure* closure, int frame_capacity)
+{
+    // The arrays aren't objects, so allocating them can't collect anything
+    // the fiber is about to refer to.
+    const int  stack_capacity = frame_capacity * UINT8_COUNT;
+    Value*     stack          = ALLOCATE(vm, Value, stack_capacity);
+    CallFrame* frames         = ALLOCATE(vm, CallFrame, frame_capacity);
+
+    ObjFiber* fiber       = ALLOCATE_OBJ(ObjFiber, ObjTypeFiber);
+    fiber->closure        = closure;
+    fiber->caller         = NULL;
+    fiber->state          = FiberNew;
+    fiber->stack          = stack;
+    fiber->stack_top      = stack;
+    fiber->stack_capacity = stack_capacity;
+    fiber->frames         = frames;
+    fiber->frame_count    = 0;
+    fiber->frame_capacity = frame_capacity;
+    fiber->open_upvalues  = NULL;
+    fiber->scheduled      = false;
+    return fiber;
+}
+
+static void print_function(FILE* out, const ObjFunction* func)
 {
     if (func->name == NULL)
-        printf("<script>");
+        fprintf(out, "<script>");
     else
-        printf("<fn %s>", func->name->chars);
+        fprintf(out, "<fn %s>", func->name->chars);
 }
 
-void print_object(const Value* value)
+void print_object(FILE* out, const Value* value)
 {
     switch (OBJ_TYPE(*value))
     {
         case ObjTypeString:
-            printf("%s", AS_CSTRING(*value));
+            fprintf(out, "%s", AS_CSTRING(*value));
             break;
         case ObjTypeFunction:
-            print_function(AS_FUNCTION(*value));
+            print_function(out, AS_FUNCTION(*value));
             break;
         case ObjTypeNative:
-            printf("<native fn>");
+            fprintf(out, "<native fn>");
             break;
         case ObjTypeClosure:
-            print_function(AS_CLOSURE(*value)->func);
+            print_function(out, AS_CLOSURE(*value)->func);
             break;
         case ObjTypeUpvalue:
-            printf("upvalue");
+            fprintf(out, "upvalue");
             break;
         case ObjTypeClass:
-            printf("%s", AS_CLASS(*value)->name->chars);
+            fprintf(out, "%s", AS_CLASS(*value)->name->chars);
             break;
         case ObjTypeInstance:
-            printf("%s instance", AS_INSTANCE(*value)->klass->name->chars);
+            fprintf(out, "%s instance", AS_INSTANCE(*value)->klass->name->chars);
             break;
         case ObjTypeBoundMethod:
-            print_function(AS_BOUND_METHOD(*value)->method->func);
+            print_function(out, AS_BOUND_METHOD(*value)->method->func);
+            break;
+        case ObjTypeChannel:
+            fprintf(out, "<channel>");
+            break;
+        case ObjTypeFiber:
+            fprintf(out, "<fiber>");
             break;
     }
 }
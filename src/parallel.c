@@ -0,0 +1,373 @@
+#include "clocks/parallel.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <clocks/chunk.h>
+#include <clocks/common.h>
+#include <clocks/isolate.h>
+#include <clocks/memory.h>
+#include <clocks/object.h>
+#include <clocks/table.h>
+#include <clocks/value.h>
+#include <clocks/vm.h>
+
+#define MAX_WORKERS 64
+
+// Each worker starts with several chunks of the inputs, so there is still
+// work left to steal when some inputs take longer than others.
+#define CHUNKS_PER_WORKER 8
+
+// Closures captured deeper than this are assumed to capture themselves.
+#define MAX_CLONE_DEPTH 64
+
+// Chunks left to a worker. The worker pops from the bottom, and workers
+// which run out steal from the top.
+typedef struct
+{
+    pthread_mutex_t lock;
+    int*            chunks;
+    int             top;
+    int             bottom;
+} Deque;
+
+// The inputs are replaced by their results in place, each by the worker
+// that ran it, and read back once every worker has been joined.
+typedef struct
+{
+    const VM* parent;
+    Value     fn;
+    Message** items;
+    int       item_count;
+    int       chunk_size;
+    Deque*    deques;
+    int       worker_count;
+} MapJob;
+
+typedef struct
+{
+    MapJob*   job;
+    int       index;
+    pthread_t thread;
+    bool      started;
+} MapWorker;
+
+static void* allocate_or_exit(size_t size)
+{
+    void* result = malloc(size);
+    if (result == NULL)
+        exit(1);
+    return result;
+}
+
+static bool can_clone_value(Value value, int depth)
+{
+    if (IS_NIL(value) || IS_BOOL(value) || IS_NUMBER(value) || IS_STRING(value))
+        return true;
+    if (!IS_CLOSURE(value) || depth == MAX_CLONE_DEPTH)
+        return false;
+
+    const ObjClosure* closure = AS_CLOSURE(value);
+#ifdef COMPILER_CAPTURE_BY_VALUE
+    for (int i = 0; i < closure->upvalue_count; i++)
+    {
+        const Value captured = closure->upvalues[i];
+        if (IS_UPVALUE(captured) || !can_clone_value(captured, depth + 1))
+            return false;
+    }
+    return true;
+#else
+    return closure->upvalue_count == 0;
+#endif
+}
+
+bool can_clone_function(Value fn)
+{
+    return IS_CLOSURE(fn) && can_clone_value(fn, 0);
+}
+
+static int chunk_line(const Chunk* chunk, int offset)
+{
+#ifdef CHUNK_LINE_RUN_LENGTH_ENCODING
+    return get_line(chunk, offset);
+#else
+    return chunk->lines[offset];
+#endif
+}
+
+static Value clone_value(VM* vm, const VM* parent, Value value);
+
+// Identifiers are string constants, so any global func may refer to is
+// named by one of its constants.
+static void clone_globals(VM* vm, const VM* parent, const ObjFunction* func)
+{
+    const ValueArray* constants = &func->chunk.constants;
+    for (int i = 0; i < constants->count; i++)
+    {
+        if (!IS_OBJ(constants->values[i]) || !IS_STRING(constants->values[i]))
+            continue;
+
+        const ObjString* name = AS_STRING(constants->values[i]);
+        Value            global;
+        if (!table_find(&parent->globals, name, &global) || !can_clone_value(global, 0))
+            continue;
+
+        ObjString* copy = copy_string(vm, name->chars, name->length);
+        push(vm, OBJ_VAL(copy));
+
+        // Defined before cloning, so a function referring to itself finds it.
+        Value existing;
+        if (!table_find(&vm->globals, copy, &existing))
+        {
+            table_insert(vm, &vm->globals, copy, NIL_VAL);
+            table_insert(vm, &vm->globals, copy, clone_value(vm, parent, global));
+        }
+
+        pop(vm);
+    }
+}
+
+static ObjFunction* clone_function(VM* vm, const VM* parent, const ObjFunction* src)
+{
+    ObjFunction* func = new_function(vm);
+    push(vm, OBJ_VAL(func));
+
+    func->arity         = src->arity;
+    func->upvalue_count = src->upvalue_count;
+    if (src->name != NULL)
+        func->name = copy_string(vm, src->name->chars, src->name->length);
+
+    for (int i = 0; i < src->chunk.count; i++)
+        write_chunk(vm, &func->chunk, src->chunk.code[i], chunk_line(&src->chunk, i));
+
+    for (int i = 0; i < src->chunk.constants.count; i++)
+    {
+        const Value constant = clone_value(vm, parent, src->chunk.constants.values[i]);
+        push(vm, constant);
+        add_constant(vm, &func->chunk, constant);
+        pop(vm);
+    }
+
+#ifdef OBJECT_CACHE_SUPER_CALLS
+    func->super_caches = ALLOCATE(vm, SuperCallCache, src->super_cache_count);
+    for (int i = 0; i < src->super_cache_count; i++)
+    {
+        func->super_caches[i].superclass = NULL;
+        func->super_caches[i].method     = NULL;
+    }
+    func->super_cache_count = src->super_cache_count;
+#endif
+
+    clone_globals(vm, parent, src);
+
+    pop(vm);
+    return func;
+}
+
+static Value clone_value(VM* vm, const VM* parent, Value value)
+{
+    if (IS_FUNCTION(value))
+        return OBJ_VAL(clone_function(vm, parent, AS_FUNCTION(value)));
+
+    if (IS_CLOSURE(value))
+    {
+        const ObjClosure* src  = AS_CLOSURE(value);
+        ObjFunction*      func = clone_function(vm, parent, src->func);
+        push(vm, OBJ_VAL(func));
+        ObjClosure* closure = new_closure(vm, func);
+        push(vm, OBJ_VAL(closure));
+#ifdef COMPILER_CAPTURE_BY_VALUE
+        for (int i = 0; i < src->upvalue_count; i++)
+            closure->upvalues[i] = clone_value(vm, parent, src->upvalues[i]);
+#endif
+        pop(vm);
+        pop(vm);
+        return OBJ_VAL(closure);
+    }
+
+    if (IS_OBJ(value) && IS_STRING(value))
+        return OBJ_VAL(copy_string(vm, AS_CSTRING(value), AS_STRING(value)->length));
+
+    return value;
+}
+
+static int pop_chunk(Deque* deque)
+{
+    pthread_mutex_lock(&deque->lock);
+    const int chunk = deque->bottom > deque->top ? deque->chunks[--deque->bottom] : -1;
+    pthread_mutex_unlock(&deque->lock);
+    return chunk;
+}
+
+static int steal_chunk(Deque* deque)
+{
+    pthread_mutex_lock(&deque->lock);
+    const int chunk = deque->bottom > deque->top ? deque->chunks[deque->top++] : -1;
+    pthread_mutex_unlock(&deque->lock);
+    return chunk;
+}
+
+// No chunks are added once the workers start, so a worker is done once
+// every deque is empty.
+static int next_chunk(const MapJob* job, int index)
+{
+    const int chunk = pop_chunk(&job->deques[index]);
+    if (chunk != -1)
+        return chunk;
+
+    for (int i = 1; i < job->worker_count; i++)
+    {
+        const int victim = steal_chunk(&job->deques[(index + i) % job->worker_count]);
+        if (victim != -1)
+            return victim;
+    }
+    return -1;
+}
+
+static void* map_worker(void* arg)
+{
+    const MapWorker* worker = (const MapWorker*)arg;
+    MapJob*          job    = worker->job;
+
+    VM* vm  = vm_new();
+    vm->out = job->parent->out;
+    vm->err = job->parent->err;
+
+    const Value fn = clone_value(vm, job->parent, job->fn);
+    push(vm, fn);
+
+    int chunk;
+    while ((chunk = next_chunk(job, worker->index)) != -1)
+    {
+        const int start = chunk * job->chunk_size;
+        const int end   = start + job->chunk_size < job->item_count
+                              ? start + job->chunk_size
+                              : job->item_count;
+        for (int i = start; i < end; i++)
+        {
+            const Value input = message_decode(vm, job->items[i]);
+
+            Value result;
+            if (vm_call(vm, fn, 1, &input, &result) != InterpretOk)
+            {
+                // The error reset the stack, fn included.
+                result = NIL_VAL;
+                push(vm, fn);
+            }
+
+            Message* message = message_encode(result);
+            job->items[i]    = message != NULL ? message : message_encode(NIL_VAL);
+        }
+    }
+
+    vm_free(vm);
+    return NULL;
+}
+
+static int worker_count_for(int chunk_count)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1)
+        count = 1;
+    if (count > MAX_WORKERS)
+        count = MAX_WORKERS;
+    return count < chunk_count ? (int)count : chunk_count;
+}
+
+static void run_job(MapJob* job)
+{
+    const int chunk_count = (job->item_count + job->chunk_size - 1) / job->chunk_size;
+
+    MapWorker workers[MAX_WORKERS];
+    Deque     deques[MAX_WORKERS];
+    job->deques = deques;
+
+    for (int i = 0; i < job->worker_count; i++)
+    {
+        Deque* deque = &deques[i];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->chunks = (int*)allocate_or_exit(sizeof(int) * (chunk_count / job->worker_count + 1));
+        deque->top    = 0;
+        deque->bottom = 0;
+    }
+    for (int chunk = 0; chunk < chunk_count; chunk++)
+    {
+        Deque* deque                    = &deques[chunk % job->worker_count];
+        deque->chunks[deque->bottom++] = chunk;
+    }
+
+    // The calling thread works too, and steals whatever a worker that
+    // failed to start would have run.
+    for (int i = 0; i < job->worker_count; i++)
+    {
+        workers[i].job     = job;
+        workers[i].index   = i;
+        workers[i].started = i > 0
+                             && pthread_create(&workers[i].thread, NULL, map_worker, &workers[i]) == 0;
+    }
+    map_worker(&workers[0]);
+
+    for (int i = 1; i < job->worker_count; i++)
+    {
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < job->worker_count; i++)
+    {
+        pthread_mutex_destroy(&deques[i].lock);
+        free(deques[i].chunks);
+    }
+}
+
+Channel* parallel_map(VM* vm, Value fn, Channel* inputs)
+{
+    int       capacity = 0;
+    int       count    = 0;
+    Message** items    = NULL;
+    while (true)
+    {
+        const Value input = channel_receive(vm, inputs);
+        if (IS_NIL(input))
+            break;
+
+        if (capacity < count + 1)
+        {
+            capacity = GROW_CAPACITY(capacity);
+            items    = (Message**)realloc(items, sizeof(Message*) * capacity);
+            if (items == NULL)
+                exit(1);
+        }
+        items[count++] = message_encode(input);
+    }
+
+    if (!can_clone_function(fn))
+    {
+        for (int i = 0; i < count; i++)
+            message_free(items[i]);
+        free(items);
+        return NULL;
+    }
+
+    Channel* results = channel_create();
+    if (count > 0)
+    {
+        const int workers    = worker_count_for(count);
+        const int chunk_size = count / (workers * CHUNKS_PER_WORKER);
+
+        MapJob job = {.parent       = vm,
+                      .fn           = fn,
+                      .items        = items,
+                      .item_count   = count,
+                      .chunk_size   = chunk_size > 0 ? chunk_size : 1,
+                      .worker_count = workers};
+        run_job(&job);
+
+        for (int i = 0; i < count; i++)
+            channel_put(results, items[i]);
+    }
+
+    free(items);
+    return results;
+}
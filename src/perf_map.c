@@ -0,0 +1,151 @@
+#include "clocks/perf_map.h"
+
+#ifdef PERF_MAP
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <clocks/chunk.h>
+
+// Trampolines are handed out from blocks of SLOTS_PER_BLOCK slots, all of
+// which are filled in before the block is made executable, so no page is
+// ever writable and executable at once.
+#define SLOT_SIZE       32
+#define SLOTS_PER_BLOCK 2048
+
+// Called with the VM and the function to call with it, which it calls with
+// a frame of its own, so that stacks can be unwound through it by frame
+// pointers.
+#if defined(__x86_64__)
+static const uint8_t TRAMPOLINE[] = {
+    0x55,              // push %rbp
+    0x48, 0x89, 0xe5,  // mov  %rsp, %rbp
+    0xff, 0xd6,        // call *%rsi
+    0x5d,              // pop  %rbp
+    0xc3,              // ret
+};
+#elif defined(__aarch64__)
+static const uint8_t TRAMPOLINE[] = {
+    0xfd, 0x7b, 0xbf, 0xa9,  // stp x29, x30, [sp, #-16]!
+    0xfd, 0x03, 0x00, 0x91,  // mov x29, sp
+    0x20, 0x00, 0x3f, 0xd6,  // blr x1
+    0xfd, 0x7b, 0xc1, 0xa8,  // ldp x29, x30, [sp], #16
+    0xc0, 0x03, 0x5f, 0xd6,  // ret
+};
+#endif
+
+typedef struct Block
+{
+    struct Block* next;
+    uint8_t*      code;
+    int           used;
+} Block;
+
+struct PerfMap
+{
+    FILE*  file;
+    Block* blocks;
+    bool   exhausted;
+};
+
+PerfMap* new_perf_map()
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+
+    PerfMap* map = (PerfMap*)calloc(1, sizeof(PerfMap));
+    if (map == NULL)
+        return NULL;
+
+    map->file = fopen(path, "w");
+    if (map->file == NULL)
+    {
+        free(map);
+        return NULL;
+    }
+    return map;
+}
+
+void free_perf_map(PerfMap* map)
+{
+    Block* block = map->blocks;
+    while (block != NULL)
+    {
+        Block* next = block->next;
+        munmap(block->code, SLOT_SIZE * SLOTS_PER_BLOCK);
+        free(block);
+        block = next;
+    }
+    fclose(map->file);
+    free(map);
+}
+
+static Block* new_block()
+{
+    const size_t size = SLOT_SIZE * SLOTS_PER_BLOCK;
+    uint8_t*     code = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+        return NULL;
+
+    for (int i = 0; i < SLOTS_PER_BLOCK; i++)
+    {
+        uint8_t* slot = code + i * SLOT_SIZE;
+        for (size_t j = 0; j < SLOT_SIZE; j++)
+            slot[j] = j < sizeof(TRAMPOLINE) ? TRAMPOLINE[j] : 0;
+    }
+    __builtin___clear_cache((char*)code, (char*)code + size);
+
+    Block* block = (Block*)malloc(sizeof(Block));
+    if (block == NULL || mprotect(code, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        free(block);
+        munmap(code, size);
+        return NULL;
+    }
+    block->code = code;
+    block->used = 0;
+    return block;
+}
+
+static int first_line(const ObjFunction* func)
+{
+    if (func->chunk.count == 0)
+        return 0;
+#ifdef CHUNK_LINE_RUN_LENGTH_ENCODING
+    return get_line(&func->chunk, 0);
+#else
+    return func->chunk.lines[0];
+#endif
+}
+
+void* perf_trampoline(PerfMap* map, const ObjFunction* func)
+{
+    if (map->exhausted)
+        return NULL;
+
+    if (map->blocks == NULL || map->blocks->used == SLOTS_PER_BLOCK)
+    {
+        Block* block = new_block();
+        if (block == NULL)
+        {
+            map->exhausted = true;
+            return NULL;
+        }
+        block->next = map->blocks;
+        map->blocks = block;
+    }
+
+    uint8_t* slot = map->blocks->code + map->blocks->used++ * SLOT_SIZE;
+
+    // Flushed right away, so the map is complete even if the VM crashes.
+    fprintf(map->file, "%" PRIxPTR " %zx lox::%s:%d\n", (uintptr_t)slot, sizeof(TRAMPOLINE),
+            func->name != NULL ? func->name->chars : "script", first_line(func));
+    fflush(map->file);
+    return slot;
+}
+
+#endif
@@ -0,0 +1,17 @@
+#include "clocks/probes.h"
+
+#ifdef USDT_PROBES
+
+// Tracers find each semaphore through its probe's note, and write to it in
+// the process, so it must have file backed storage rather than be in .bss.
+#define DEFINE_SEMAPHORE(name) \
+    volatile unsigned short clocks_##name##_semaphore __attribute__((section(".probes"))) = 0;
+
+DEFINE_SEMAPHORE(gc__begin)
+DEFINE_SEMAPHORE(gc__end)
+DEFINE_SEMAPHORE(function__entry)
+DEFINE_SEMAPHORE(function__return)
+DEFINE_SEMAPHORE(object__alloc)
+DEFINE_SEMAPHORE(string__intern)
+
+#endif
@@ -0,0 +1,266 @@
+#include "clocks/profile.h"
+
+#ifdef PROFILE_OPCODES
+
+#include <stdlib.h>
+
+#include <clocks/chunk.h>
+#include <clocks/common.h>
+#include <clocks/debug.h>
+#include <clocks/memory.h>
+#include <clocks/object.h>
+
+// Only the most executed pairs and functions are printed, JSON gets all.
+#define PRINT_LIMIT 30
+
+typedef struct
+{
+    uint8_t  first;
+    uint8_t  second;
+    uint64_t count;
+} PairCount;
+
+static void* allocate_or_exit(size_t size)
+{
+    void* result = calloc(1, size);
+    if (result == NULL)
+        exit(1);
+    return result;
+}
+
+OpcodeProfile* new_opcode_profile()
+{
+    OpcodeProfile* profile = (OpcodeProfile*)allocate_or_exit(sizeof(OpcodeProfile));
+    profile->previous      = -1;
+    return profile;
+}
+
+void free_opcode_profile(OpcodeProfile* profile)
+{
+    free(profile->functions);
+    free(profile);
+}
+
+static uint32_t hash_function(const ObjFunction* func, int capacity)
+{
+    return (uint32_t)(((uintptr_t)func >> 4) * 2654435761u) & (uint32_t)(capacity - 1);
+}
+
+static FunctionCount* find_function(FunctionCount* functions, int capacity,
+                                    const ObjFunction* func)
+{
+    uint32_t index = hash_function(func, capacity);
+    while (functions[index].func != NULL && functions[index].func != func)
+        index = (index + 1) & (uint32_t)(capacity - 1);
+    return &functions[index];
+}
+
+static void grow_functions(OpcodeProfile* profile)
+{
+    const int      capacity  = GROW_CAPACITY(profile->function_capacity);
+    FunctionCount* functions = (FunctionCount*)allocate_or_exit(sizeof(FunctionCount)
+                                                                * capacity);
+    for (int i = 0; i < profile->function_capacity; i++)
+    {
+        const FunctionCount* entry = &profile->functions[i];
+        if (entry->func != NULL)
+            *find_function(functions, capacity, entry->func) = *entry;
+    }
+
+    free(profile->functions);
+    profile->functions         = functions;
+    profile->function_capacity = capacity;
+}
+
+uint64_t* function_counter(OpcodeProfile* profile, const ObjFunction* func)
+{
+    if (profile->function_count + 1 > profile->function_capacity * 3 / 4)
+        grow_functions(profile);
+
+    FunctionCount* entry = find_function(profile->functions, profile->function_capacity,
+                                         func);
+    if (entry->func == NULL)
+    {
+        entry->func = func;
+        profile->function_count++;
+    }
+    return &entry->count;
+}
+
+void mark_opcode_profile(VM* vm, const OpcodeProfile* profile)
+{
+    for (int i = 0; i < profile->function_capacity; i++)
+        mark_object(vm, (Obj*)profile->functions[i].func);
+}
+
+// qsort() takes no context, and opcodes are few enough to sort by insertion.
+static void sort_opcodes(const OpcodeProfile* profile, uint8_t* opcodes)
+{
+    for (int i = 0; i < OPCODE_COUNT; i++)
+        opcodes[i] = (uint8_t)i;
+
+    for (int i = 1; i < OPCODE_COUNT; i++)
+    {
+        const uint8_t opcode = opcodes[i];
+        int           j      = i;
+        for (; j > 0 && profile->counts[opcodes[j - 1]] < profile->counts[opcode]; j--)
+            opcodes[j] = opcodes[j - 1];
+        opcodes[j] = opcode;
+    }
+}
+
+static int compare_pairs(const void* a, const void* b)
+{
+    const uint64_t x = ((const PairCount*)a)->count;
+    const uint64_t y = ((const PairCount*)b)->count;
+    return (x < y) - (x > y);
+}
+
+static PairCount* sorted_pairs(const OpcodeProfile* profile, int* out_count)
+{
+    PairCount* pairs = (PairCount*)allocate_or_exit(sizeof(PairCount) * OPCODE_COUNT
+                                                    * OPCODE_COUNT);
+    int count = 0;
+    for (int first = 0; first < OPCODE_COUNT; first++)
+    {
+        for (int second = 0; second < OPCODE_COUNT; second++)
+        {
+            if (profile->pairs[first][second] > 0)
+                pairs[count++] = (PairCount){(uint8_t)first, (uint8_t)second,
+                                             profile->pairs[first][second]};
+        }
+    }
+
+    qsort(pairs, count, sizeof(PairCount), compare_pairs);
+    *out_count = count;
+    return pairs;
+}
+
+static int compare_functions(const void* a, const void* b)
+{
+    const uint64_t x = ((const FunctionCount*)a)->count;
+    const uint64_t y = ((const FunctionCount*)b)->count;
+    return (x < y) - (x > y);
+}
+
+static FunctionCount* sorted_functions(const OpcodeProfile* profile)
+{
+    FunctionCount* functions = (FunctionCount*)allocate_or_exit(
+        sizeof(FunctionCount) * (profile->function_count + 1));
+    int count = 0;
+    for (int i = 0; i < profile->function_capacity; i++)
+    {
+        if (profile->functions[i].func != NULL)
+            functions[count++] = profile->functions[i];
+    }
+
+    qsort(functions, count, sizeof(FunctionCount), compare_functions);
+    return functions;
+}
+
+static uint64_t total_instructions(const OpcodeProfile* profile)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < OPCODE_COUNT; i++)
+        total += profile->counts[i];
+    return total;
+}
+
+static int first_line(const ObjFunction* func)
+{
+#ifdef CHUNK_LINE_RUN_LENGTH_ENCODING
+    return get_line(&func->chunk, 0);
+#else
+    return func->chunk.lines[0];
+#endif
+}
+
+static const char* function_name(const ObjFunction* func)
+{
+    return func->name != NULL ? func->name->chars : "script";
+}
+
+static double percent(uint64_t count, uint64_t total)
+{
+    return total > 0 ? 100.0 * (double)count / (double)total : 0;
+}
+
+void print_opcode_profile(const OpcodeProfile* profile, FILE* out)
+{
+    const uint64_t total = total_instructions(profile);
+
+    uint8_t opcodes[OPCODE_COUNT];
+    sort_opcodes(profile, opcodes);
+
+    fprintf(out, "== opcodes (%llu executed) ==\n", (unsigned long long)total);
+    for (int i = 0; i < OPCODE_COUNT && profile->counts[opcodes[i]] > 0; i++)
+    {
+        const uint64_t count = profile->counts[opcodes[i]];
+        fprintf(out, "%-16s %14llu %6.2f%%\n", opcode_name(opcodes[i]),
+                (unsigned long long)count, percent(count, total));
+    }
+
+    int        pair_count;
+    PairCount* pairs = sorted_pairs(profile, &pair_count);
+    fprintf(out, "== opcode pairs ==\n");
+    for (int i = 0; i < pair_count && i < PRINT_LIMIT; i++)
+    {
+        fprintf(out, "%-16s %-16s %14llu %6.2f%%\n", opcode_name(pairs[i].first),
+                opcode_name(pairs[i].second), (unsigned long long)pairs[i].count,
+                percent(pairs[i].count, total));
+    }
+    free(pairs);
+
+    FunctionCount* functions = sorted_functions(profile);
+    fprintf(out, "== instructions by function ==\n");
+    for (int i = 0; i < profile->function_count && i < PRINT_LIMIT; i++)
+    {
+        const ObjFunction* func = functions[i].func;
+        fprintf(out, "%-24s line %-6d %14llu %6.2f%%\n", function_name(func),
+                first_line(func), (unsigned long long)functions[i].count,
+                percent(functions[i].count, total));
+    }
+    free(functions);
+}
+
+bool write_opcode_profile_json(const OpcodeProfile* profile, FILE* out)
+{
+    uint8_t opcodes[OPCODE_COUNT];
+    sort_opcodes(profile, opcodes);
+
+    fprintf(out, "{\n  \"instructions\": %llu,\n  \"opcodes\": [",
+            (unsigned long long)total_instructions(profile));
+    for (int i = 0; i < OPCODE_COUNT && profile->counts[opcodes[i]] > 0; i++)
+    {
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"count\": %llu}", i > 0 ? "," : "",
+                opcode_name(opcodes[i]), (unsigned long long)profile->counts[opcodes[i]]);
+    }
+
+    int        pair_count;
+    PairCount* pairs = sorted_pairs(profile, &pair_count);
+    fprintf(out, "\n  ],\n  \"pairs\": [");
+    for (int i = 0; i < pair_count; i++)
+    {
+        fprintf(out, "%s\n    {\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}",
+                i > 0 ? "," : "", opcode_name(pairs[i].first), opcode_name(pairs[i].second),
+                (unsigned long long)pairs[i].count);
+    }
+    free(pairs);
+
+    // Identifiers need no escaping.
+    FunctionCount* functions = sorted_functions(profile);
+    fprintf(out, "\n  ],\n  \"functions\": [");
+    for (int i = 0; i < profile->function_count; i++)
+    {
+        const ObjFunction* func = functions[i].func;
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"line\": %d, \"count\": %llu}",
+                i > 0 ? "," : "", function_name(func), first_line(func),
+                (unsigned long long)functions[i].count);
+    }
+    free(functions);
+
+    fprintf(out, "\n  ]\n}\n");
+    return !ferror(out);
+}
+
+#endif
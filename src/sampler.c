@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+
+#include "clocks/sampler.h"
+
+#ifdef __linux__
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <clocks/chunk.h>
+#include <clocks/memory.h>
+#include <clocks/object.h>
+#include <clocks/vm.h>
+
+// Both tables are allocated when sampling starts, as the signal handler
+// can't allocate. Pages which are never touched cost no memory.
+#define STACKS_MAX   (1 << 14)
+#define SAMPLED_MAX  (1 << 18)
+
+// Only named by glibc 2.38 on.
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+typedef struct
+{
+    const ObjFunction* func;
+    int                line;
+} SampleFrame;
+
+// A distinct stack, whose frames are depth entries of Sampler.frames from
+// start on. Empty until sampled once.
+typedef struct
+{
+    uint32_t hash;
+    int      start;
+    int      depth;
+    uint64_t count;
+} Stack;
+
+struct Sampler
+{
+    VM*     vm;
+    timer_t timer;
+    bool    running;
+
+    Stack* stacks;
+    int    stack_count;
+
+    SampleFrame* frames;
+    int          frame_count;
+
+    uint64_t outside;
+    uint64_t dropped;
+};
+
+// Each thread samples its own VM, if any.
+static __thread Sampler* thread_sampler;
+
+static int frame_line(const ObjFunction* func, const uint8_t* ip)
+{
+    // A frame which hasn't run any instruction yet is at its first one.
+    int offset = (int)(ip - func->chunk.code) - 1;
+    if (offset < 0)
+        offset = 0;
+
+#ifdef CHUNK_LINE_RUN_LENGTH_ENCODING
+    return get_line(&func->chunk, offset);
+#else
+    return func->chunk.lines[offset];
+#endif
+}
+
+static bool same_frames(const SampleFrame* a, const SampleFrame* b, int depth)
+{
+    for (int i = 0; i < depth; i++)
+    {
+        if (a[i].func != b[i].func || a[i].line != b[i].line)
+            return false;
+    }
+    return true;
+}
+
+static void record_stack(Sampler* sampler, const SampleFrame* frames, int depth,
+                         uint32_t hash)
+{
+    uint32_t index = hash & (STACKS_MAX - 1);
+    while (true)
+    {
+        Stack* stack = &sampler->stacks[index];
+        if (stack->count == 0)
+            break;
+
+        if (stack->hash == hash && stack->depth == depth
+            && same_frames(&sampler->frames[stack->start], frames, depth))
+        {
+            stack->count++;
+            return;
+        }
+        index = (index + 1) & (STACKS_MAX - 1);
+    }
+
+    if (sampler->stack_count + 1 > STACKS_MAX * 3 / 4
+        || sampler->frame_count + depth > SAMPLED_MAX)
+    {
+        sampler->dropped++;
+        return;
+    }
+
+    // The frames are in place before the count makes them visible to
+    // mark_sampler().
+    for (int i = 0; i < depth; i++)
+        sampler->frames[sampler->frame_count + i] = frames[i];
+
+    Stack* stack = &sampler->stacks[index];
+    stack->hash  = hash;
+    stack->start = sampler->frame_count;
+    stack->depth = depth;
+    stack->count = 1;
+    sampler->frame_count += depth;
+    sampler->stack_count++;
+}
+
+// The VM publishes its frames so that they are always consistent at any
+// instruction the signal can interrupt, see call() and load_fiber(). Every
+// frame below frame_count then holds a live closure, as collections only
+// happen within calls the compiler can't move the frame updates across.
+static void sample(int signal, siginfo_t* info, void* context)
+{
+    (void)signal;
+    (void)info;
+    (void)context;
+
+    Sampler* sampler = thread_sampler;
+    if (sampler == NULL)
+        return;
+
+    const VM*        vm     = sampler->vm;
+    const CallFrame* frames = vm->frames;
+    const int        depth  = vm->frame_count;
+    if (depth == 0)
+    {
+        sampler->outside++;
+        return;
+    }
+
+    SampleFrame stack[FRAMES_MAX];
+    uint32_t    hash = 2166136261u;
+    for (int i = 0; i < depth && i < FRAMES_MAX; i++)
+    {
+        const ObjFunction* func = frames[i].closure->func;
+        stack[i]                = (SampleFrame){func, frame_line(func, frames[i].ip)};
+
+        hash = (hash ^ (uint32_t)((uintptr_t)func >> 4)) * 16777619u;
+        hash = (hash ^ (uint32_t)stack[i].line) * 16777619u;
+    }
+
+    record_stack(sampler, stack, depth < FRAMES_MAX ? depth : FRAMES_MAX, hash);
+}
+
+Sampler* start_sampler(VM* vm, int rate)
+{
+    Sampler* sampler = (Sampler*)calloc(1, sizeof(Sampler));
+    if (sampler == NULL)
+        return NULL;
+
+    sampler->vm     = vm;
+    sampler->stacks = (Stack*)calloc(STACKS_MAX, sizeof(Stack));
+    sampler->frames = (SampleFrame*)calloc(SAMPLED_MAX, sizeof(SampleFrame));
+
+    // The handler stays installed, as a signal still pending once sampling
+    // stops would otherwise end the process.
+    struct sigaction action;
+    action.sa_sigaction = sample;
+    action.sa_flags     = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    struct sigevent event;
+    event.sigev_notify           = SIGEV_THREAD_ID;
+    event.sigev_signo            = SIGPROF;
+    event.sigev_value.sival_ptr  = NULL;
+    event.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+
+    if (sampler->stacks == NULL || sampler->frames == NULL
+        || sigaction(SIGPROF, &action, NULL) == -1
+        || timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &sampler->timer) == -1)
+    {
+        free(sampler->stacks);
+        free(sampler->frames);
+        free(sampler);
+        return NULL;
+    }
+    sampler->running = true;
+    thread_sampler   = sampler;
+    vm->sampler      = sampler;
+
+    const long             interval = 1000000000L / rate;
+    const struct itimerspec spec    = {.it_interval = {interval / 1000000000L,
+                                                      interval % 1000000000L},
+                                       .it_value    = {interval / 1000000000L,
+                                                      interval % 1000000000L}};
+    if (timer_settime(sampler->timer, 0, &spec, NULL) == -1)
+    {
+        free_sampler(sampler);
+        return NULL;
+    }
+    return sampler;
+}
+
+void stop_sampler(Sampler* sampler)
+{
+    if (!sampler->running)
+        return;
+
+    timer_delete(sampler->timer);
+    sampler->running = false;
+    thread_sampler   = NULL;
+}
+
+void free_sampler(Sampler* sampler)
+{
+    stop_sampler(sampler);
+    sampler->vm->sampler = NULL;
+
+    free(sampler->stacks);
+    free(sampler->frames);
+    free(sampler);
+}
+
+void mark_sampler(VM* vm, const Sampler* sampler)
+{
+    for (int i = 0; i < sampler->frame_count; i++)
+        mark_object(vm, (Obj*)sampler->frames[i].func);
+}
+
+static int compare_stacks(const void* a, const void* b)
+{
+    const uint64_t x = (*(const Stack* const*)a)->count;
+    const uint64_t y = (*(const Stack* const*)b)->count;
+    return (x < y) - (x > y);
+}
+
+bool write_folded_stacks(const Sampler* sampler, FILE* out)
+{
+    const Stack** stacks = (const Stack**)malloc(sizeof(Stack*)
+                                                 * (sampler->stack_count + 1));
+    if (stacks == NULL)
+        return false;
+
+    int count = 0;
+    for (int i = 0; i < STACKS_MAX; i++)
+    {
+        if (sampler->stacks[i].count > 0)
+            stacks[count++] = &sampler->stacks[i];
+    }
+    qsort(stacks, count, sizeof(Stack*), compare_stacks);
+
+    for (int i = 0; i < count; i++)
+    {
+        const SampleFrame* frames = &sampler->frames[stacks[i]->start];
+        for (int j = 0; j < stacks[i]->depth; j++)
+        {
+            const ObjFunction* func = frames[j].func;
+            fprintf(out, "%s%s:%d", j > 0 ? ";" : "",
+                    func->name != NULL ? func->name->chars : "script", frames[j].line);
+        }
+        fprintf(out, " %llu\n", (unsigned long long)stacks[i]->count);
+    }
+    free(stacks);
+
+    if (sampler->outside > 0)
+        fprintf(out, "[vm] %llu\n", (unsigned long long)sampler->outside);
+    if (sampler->dropped > 0)
+        fprintf(out, "[dropped] %llu\n", (unsigned long long)sampler->dropped);
+    return !ferror(out);
+}
+
+#endif
@@ -5,20 +5,11 @@
 
 #include <clocks/common.h>
 
-typedef struct
+void init_scanner(Scanner* scanner, const char* source)
 {
-    const char* start;
-    const char* current;
-    int         line;
-} Scanner;
-
-Scanner scanner;
-
-void init_scanner(const char* source)
-{
-    scanner.start   = source;
-    scanner.current = source;
-    scanner.line    = 1;
+    scanner->start   = source;
+    scanner->current = source;
+    scanner->line    = 1;
 }
 
 static bool is_alpha(char c)
@@ -33,89 +24,89 @@ static bool is_digit(char c)
     return c >= '0' && c <= '9';
 }
 
-static bool is_at_end()
+static bool is_at_end(Scanner* scanner)
 {
-    return *scanner.current == '\0';
+    return *scanner->current == '\0';
 }
 
-static char advance()
+static char advance(Scanner* scanner)
 {
-    scanner.current++;
-    return scanner.current[-1];
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static char peek()
+static char peek(Scanner* scanner)
 {
-    return *scanner.current;
+    return *scanner->current;
 }
 
-static char peek_next()
+static char peek_next(Scanner* scanner)
 {
-    if (is_at_end())
+    if (is_at_end(scanner))
         return '\0';
-    return scanner.current[1];
+    return scanner->current[1];
 }
 
-static bool match(char expected)
+static bool match(Scanner* scanner, char expected)
 {
-    if (is_at_end())
+    if (is_at_end(scanner))
         return false;
 
-    if (*scanner.current != expected)
+    if (*scanner->current != expected)
         return false;
 
-    scanner.current++;
+    scanner->current++;
     return true;
 }
 
-static int token_length()
+static int token_length(Scanner* scanner)
 {
-    return (int)(scanner.current - scanner.start);
+    return (int)(scanner->current - scanner->start);
 }
 
-static Token make_token(TokenType type)
+static Token make_token(Scanner* scanner, TokenType type)
 {
     Token token = {
       .type   = type,
-      .start  = scanner.start,
-      .length = token_length(),
-      .line   = scanner.line,
+      .start  = scanner->start,
+      .length = token_length(scanner),
+      .line   = scanner->line,
     };
     return token;
 }
 
-static Token error_token(const char* message)
+static Token error_token(Scanner* scanner, const char* message)
 {
     Token token = {
       .type   = TokenError,
       .start  = message,
       .length = (int)strlen(message),
-      .line   = scanner.line,
+      .line   = scanner->line,
     };
     return token;
 }
 
-static void skip_whitespace()
+static void skip_whitespace(Scanner* scanner)
 {
     while (true)
     {
-        const char c = peek();
+        const char c = peek(scanner);
         switch (c)
         {
             case ' ':
             case '\r':
             case '\t':
-                advance();
+                advance(scanner);
                 break;
             case '\n':
-                scanner.line++;
-                advance();
+                scanner->line++;
+                advance(scanner);
                 break;
             case '/':
-                if (peek_next() == '/')
+                if (peek_next(scanner) == '/')
                 {
-                    while (peek() != '\n' && !is_at_end())
-                        advance();
+                    while (peek(scanner) != '\n' && !is_at_end(scanner))
+                        advance(scanner);
                 }
                 else
                     return;
@@ -126,11 +117,11 @@ static void skip_whitespace()
     }
 }
 
-static TokenType check_keyword(size_t start, size_t length,
+static TokenType check_keyword(Scanner* scanner, size_t start, size_t length,
                                const char* rest, TokenType type)
 {
-    if (token_length() == start + length
-        && memcmp(scanner.start + start, rest, length) == 0)
+    if ((size_t)token_length(scanner) == start + length
+        && memcmp(scanner->start + start, rest, length) == 0)
     {
         return type;
     }
@@ -138,123 +129,123 @@ static TokenType check_keyword(size_t start, size_t length,
 }
 
 // clang-format off
-static TokenType identifier_type()
+static TokenType identifier_type(Scanner* scanner)
 {
-    switch (scanner.start[0])
+    switch (scanner->start[0])
     {
-        case 'a': return check_keyword(1, 2, "nd", TokenAnd);
-        case 'c': return check_keyword(1, 4, "lass", TokenClass);
-        case 'e': return check_keyword(1, 3, "lse", TokenElse);
+        case 'a': return check_keyword(scanner, 1, 2, "nd", TokenAnd);
+        case 'c': return check_keyword(scanner, 1, 4, "lass", TokenClass);
+        case 'e': return check_keyword(scanner, 1, 3, "lse", TokenElse);
         case 'f':
-            if (token_length() > 1)
+            if (token_length(scanner) > 1)
             {
-                switch (scanner.start[1])
+                switch (scanner->start[1])
                 {
-                    case 'a': return check_keyword(2, 3, "lse", TokenFalse);
-                    case 'o': return check_keyword(2, 1, "r", TokenFor);
-                    case 'u': return check_keyword(2, 1, "n", TokenFun);
+                    case 'a': return check_keyword(scanner, 2, 3, "lse", TokenFalse);
+                    case 'o': return check_keyword(scanner, 2, 1, "r", TokenFor);
+                    case 'u': return check_keyword(scanner, 2, 1, "n", TokenFun);
                 }
             }
             break;
-        case 'i': return check_keyword(1, 1, "f", TokenIf);
-        case 'n': return check_keyword(1, 2, "il", TokenNil);
-        case 'o': return check_keyword(1, 1, "r", TokenOr);
-        case 'p': return check_keyword(1, 4, "rint", TokenPrint);
-        case 'r': return check_keyword(1, 5, "eturn", TokenReturn);
-        case 's': return check_keyword(1, 4, "uper", TokenSuper);
+        case 'i': return check_keyword(scanner, 1, 1, "f", TokenIf);
+        case 'n': return check_keyword(scanner, 1, 2, "il", TokenNil);
+        case 'o': return check_keyword(scanner, 1, 1, "r", TokenOr);
+        case 'p': return check_keyword(scanner, 1, 4, "rint", TokenPrint);
+        case 'r': return check_keyword(scanner, 1, 5, "eturn", TokenReturn);
+        case 's': return check_keyword(scanner, 1, 4, "uper", TokenSuper);
         case 't':
-            if (token_length() > 1)
+            if (token_length(scanner) > 1)
             {
-                switch (scanner.start[1])
+                switch (scanner->start[1])
                 {
-                    case 'h': return check_keyword(2, 2, "is", TokenThis);
-                    case 'r': return check_keyword(2, 2, "ue", TokenTrue);
+                    case 'h': return check_keyword(scanner, 2, 2, "is", TokenThis);
+                    case 'r': return check_keyword(scanner, 2, 2, "ue", TokenTrue);
                 }
             }
             break;
-        case 'v': return check_keyword(1, 2, "ar", TokenVar);
-        case 'w': return check_keyword(1, 4, "hile", TokenWhile);
+        case 'v': return check_keyword(scanner, 1, 2, "ar", TokenVar);
+        case 'w': return check_keyword(scanner, 1, 4, "hile", TokenWhile);
     }
     return TokenIdentifier;
 }
 // clang-format on
 
-static Token identifier()
+static Token identifier(Scanner* scanner)
 {
-    while (is_alpha(peek()) || is_digit(peek()))
-        advance();
-    return make_token(identifier_type());
+    while (is_alpha(peek(scanner)) || is_digit(peek(scanner)))
+        advance(scanner);
+    return make_token(scanner, identifier_type(scanner));
 }
 
-static Token number()
+static Token number(Scanner* scanner)
 {
-    while (is_digit(peek()))
-        advance();
+    while (is_digit(peek(scanner)))
+        advance(scanner);
 
-    if (peek() == '.' && is_digit(peek_next()))
-        advance();
+    if (peek(scanner) == '.' && is_digit(peek_next(scanner)))
+        advance(scanner);
 
-    while (is_digit(peek()))
-        advance();
+    while (is_digit(peek(scanner)))
+        advance(scanner);
 
-    return make_token(TokenNumber);
+    return make_token(scanner, TokenNumber);
 }
 
-static Token string()
+static Token string(Scanner* scanner)
 {
-    while (peek() != '"' && !is_at_end())
+    while (peek(scanner) != '"' && !is_at_end(scanner))
     {
-        if (peek() == '\n')
-            scanner.line++;
-        advance();
+        if (peek(scanner) == '\n')
+            scanner->line++;
+        advance(scanner);
     }
 
-    if (is_at_end())
-        return error_token("Unterminated string.");
+    if (is_at_end(scanner))
+        return error_token(scanner, "Unterminated string.");
 
-    advance();
-    return make_token(TokenString);
+    advance(scanner);
+    return make_token(scanner, TokenString);
 }
 
-Token scan_token()
+Token scan_token(Scanner* scanner)
 {
-    skip_whitespace();
+    skip_whitespace(scanner);
 
-    scanner.start = scanner.current;
-    if (is_at_end())
-        return make_token(TokenEOF);
+    scanner->start = scanner->current;
+    if (is_at_end(scanner))
+        return make_token(scanner, TokenEOF);
 
-    const char c = advance();
+    const char c = advance(scanner);
 
     if (is_digit(c))
-        return number();
+        return number(scanner);
 
     if (is_alpha(c))
-        return identifier();
+        return identifier(scanner);
 
     // clang-format off
     switch (c)
     {
-        case '(': return make_token(TokenLeftParen);
-        case ')': return make_token(TokenRightParen);
-        case '{': return make_token(TokenLeftBrace);
-        case '}': return make_token(TokenRightBrace);
-        case ';': return make_token(TokenSemicolon);
-        case ',': return make_token(TokenComma);
-        case '.': return make_token(TokenDot);
-        case '-': return make_token(TokenMinus);
-        case '+': return make_token(TokenPlus);
-        case '/': return make_token(TokenSlash);
-        case '*': return make_token(TokenStar);
-
-        case '!': return make_token(match('=') ? TokenBangEqual : TokenBang);
-        case '=': return make_token(match('=') ? TokenEqualEqual : TokenEqual);
-        case '<': return make_token(match('=') ? TokenLessEqual : TokenLess);
-        case '>': return make_token(match('=') ? TokenGreaterEqual : TokenGreater);
-
-        case '"': return string();
-
-        default: return error_token("Unexpected character.");
+        case '(': return make_token(scanner, TokenLeftParen);
+        case ')': return make_token(scanner, TokenRightParen);
+        case '{': return make_token(scanner, TokenLeftBrace);
+        case '}': return make_token(scanner, TokenRightBrace);
+        case ';': return make_token(scanner, TokenSemicolon);
+        case ',': return make_token(scanner, TokenComma);
+        case '.': return make_token(scanner, TokenDot);
+        case '-': return make_token(scanner, TokenMinus);
+        case '+': return make_token(scanner, TokenPlus);
+        case '/': return make_token(scanner, TokenSlash);
+        case '*': return make_token(scanner, TokenStar);
+
+        case '!': return make_token(scanner, match(scanner, '=') ? TokenBangEqual : TokenBang);
+        case '=': return make_token(scanner, match(scanner, '=') ? TokenEqualEqual : TokenEqual);
+        case '<': return make_token(scanner, match(scanner, '=') ? TokenLessEqual : TokenLess);
+        case '>': return make_token(scanner, match(scanner, '=') ? TokenGreaterEqual : TokenGreater);
+
+        case '"': return string(scanner);
+
+        default: return error_token(scanner, "Unexpected character.");
     }
     // clang-format on
 }
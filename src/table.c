@@ -9,43 +9,78 @@
 
 #define TABLE_MAX_LOAD 0.75
 
+// Hash stored in an empty slot (NULL key), to tell tombstones apart from
+// never used slots without touching the values array while probing.
+#define HASH_EMPTY     0
+#define HASH_TOMBSTONE 1
+
+// The values, keys and hashes arrays share a single allocation, in that
+// order so each array stays aligned to its element size.
+#define SLOT_SIZE (sizeof(Value) + sizeof(ObjString*) + sizeof(uint32_t))
+
+#ifdef TABLE_SMALL_LINEAR
+// Small tables leave out the hashes.
+#define SMALL_SLOT_SIZE (sizeof(Value) + sizeof(ObjString*))
+
+static bool is_small(const Table* table)
+{
+    return table->hashes == NULL;
+}
+
+static size_t block_size(const Table* table)
+{
+    return (is_small(table) ? SMALL_SLOT_SIZE : SLOT_SIZE) * table->capacity;
+}
+#else
+static size_t block_size(const Table* table)
+{
+    return SLOT_SIZE * table->capacity;
+}
+#endif
+
 void init_table(Table* table)
 {
     table->count    = 0;
     table->capacity = 0;
-    table->entries  = NULL;
+    table->keys     = NULL;
+    table->hashes   = NULL;
+    table->values   = NULL;
 }
 
-void free_table(Table* table)
+void free_table(VM* vm, Table* table)
 {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, char, table->values, block_size(table));
     init_table(table);
 }
 
-static Entry* find_entry(Entry* entries, int capacity, const ObjString* key)
+size_t table_bytes(const Table* table)
+{
+    return block_size(table);
+}
+
+static int find_slot(ObjString* const* keys, const uint32_t* hashes,
+                     int capacity, const ObjString* key, uint32_t hash)
 {
 #ifdef TABLE_OPTIMIZED_FIND_ENTRY
-    uint32_t index = key->hash & (capacity - 1);
+    uint32_t index = hash & (capacity - 1);
 #else
-    uint32_t index = key->hash % capacity;
+    uint32_t index = hash % capacity;
 #endif
 
-    Entry* tombstone = NULL;
+    int tombstone = -1;
 
     while (true)
     {
-        Entry* entry = &entries[index];
-
-        if (entry->key == NULL)
+        if (keys[index] == NULL)
         {
-            if (IS_NIL(entry->value))
-                return tombstone == NULL ? entry : tombstone;
+            if (hashes[index] == HASH_EMPTY)
+                return tombstone == -1 ? (int)index : tombstone;
 
-            if (tombstone == NULL)
-                tombstone = entry;
+            if (tombstone == -1)
+                tombstone = (int)index;
         }
-        else if (entry->key == key)
-            return entry;
+        else if (keys[index] == key)
+            return (int)index;
 
 #ifdef TABLE_OPTIMIZED_FIND_ENTRY
         index = (index + 1) & (capacity - 1);
@@ -55,54 +90,154 @@ static Entry* find_entry(Entry* entries, int capacity, const ObjString* key)
     }
 }
 
-static void adjust_capacity(Table* table, int capacity)
+#ifdef TABLE_SMALL_LINEAR
+static int find_small_index(const Table* table, const ObjString* key)
+{
+    for (int i = 0; i < table->count; i++)
+    {
+        if (table->keys[i] == key)
+            return i;
+    }
+    return -1;
+}
+
+static void remove_small_index(Table* table, int index)
+{
+    table->count--;
+    table->keys[index]   = table->keys[table->count];
+    table->values[index] = table->values[table->count];
+}
+
+// Small tables start with room for half their keys, as most instances have
+// only a few fields, unless table_reserve_small() gave them more.
+static void resize_small(VM* vm, Table* table, int capacity)
+{
+    char*       block  = ALLOCATE(vm, char, SMALL_SLOT_SIZE * capacity);
+    Value*      values = (Value*)block;
+    ObjString** keys   = (ObjString**)(values + capacity);
+    for (int i = 0; i < table->count; i++)
+    {
+        keys[i]   = table->keys[i];
+        values[i] = table->values[i];
+    }
+
+    FREE_ARRAY(vm, char, table->values, SMALL_SLOT_SIZE * table->capacity);
+    table->keys     = keys;
+    table->values   = values;
+    table->capacity = capacity;
+}
+
+void table_reserve_small(VM* vm, Table* table, int count)
+{
+    if (table->capacity == 0 && count > 0)
+        resize_small(vm, table, count < TABLE_SMALL_CAPACITY ? count : TABLE_SMALL_CAPACITY);
+}
+#endif
+
+static void adjust_capacity(VM* vm, Table* table, int capacity)
 {
-    Entry* entries = ALLOCATE(Entry, capacity);
+    char*       block  = ALLOCATE(vm, char, SLOT_SIZE * capacity);
+    Value*      values = (Value*)block;
+    ObjString** keys   = (ObjString**)(values + capacity);
+    uint32_t*   hashes = (uint32_t*)(keys + capacity);
     for (int i = 0; i < capacity; i++)
     {
-        entries[i].key   = NULL;
-        entries[i].value = NIL_VAL;
+        keys[i]   = NULL;
+        hashes[i] = HASH_EMPTY;
     }
 
+#ifdef TABLE_SMALL_LINEAR
+    if (is_small(table))
+    {
+        for (int i = 0; i < table->count; i++)
+        {
+            ObjString* key  = table->keys[i];
+            const int  slot = find_slot(keys, hashes, capacity, key, key->hash);
+            keys[slot]      = key;
+            hashes[slot]    = key->hash;
+            values[slot]    = table->values[i];
+        }
+
+        FREE_ARRAY(vm, char, table->values, SMALL_SLOT_SIZE * table->capacity);
+        table->keys     = keys;
+        table->hashes   = hashes;
+        table->values   = values;
+        table->capacity = capacity;
+        return;
+    }
+#endif
+
     table->count = 0;
     for (int i = 0; i < table->capacity; i++)
     {
-        const Entry* entry = &table->entries[i];
-        if (entry->key == NULL)
+        if (table->keys[i] == NULL)
             continue;
 
-        Entry* dest = find_entry(entries, capacity, entry->key);
-        dest->key   = entry->key;
-        dest->value = entry->value;
+        const uint32_t hash = table->hashes[i];
+        const int      slot = find_slot(keys, hashes, capacity, table->keys[i], hash);
+        keys[slot]          = table->keys[i];
+        hashes[slot]        = hash;
+        values[slot]        = table->values[i];
         table->count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries  = entries;
+    FREE_ARRAY(vm, char, table->values, SLOT_SIZE * table->capacity);
+    table->keys     = keys;
+    table->hashes   = hashes;
+    table->values   = values;
     table->capacity = capacity;
 }
 
-bool table_insert(Table* table, ObjString* key, Value value)
+bool table_insert(VM* vm, Table* table, ObjString* key, Value value)
 {
+#ifdef TABLE_SMALL_LINEAR
+    if (is_small(table))
+    {
+        const int index = find_small_index(table, key);
+        if (index != -1)
+        {
+            table->values[index] = value;
+            return false;
+        }
+
+        if (table->count < TABLE_SMALL_CAPACITY)
+        {
+            if (table->count == table->capacity)
+                resize_small(vm, table, table->capacity < TABLE_SMALL_CAPACITY / 2
+                                          ? TABLE_SMALL_CAPACITY / 2
+                                          : TABLE_SMALL_CAPACITY);
+
+            table->keys[table->count]   = key;
+            table->values[table->count] = value;
+            table->count++;
+            return true;
+        }
+
+        adjust_capacity(vm, table, GROW_CAPACITY(TABLE_SMALL_CAPACITY));
+    }
+#endif
+
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
     {
         const int capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
+        adjust_capacity(vm, table, capacity);
     }
 
-    Entry* res = find_entry(table->entries, table->capacity, key);
+    const int slot = find_slot(table->keys, table->hashes, table->capacity,
+                               key, key->hash);
 
-    const bool is_new_key = (res->key == NULL);
+    const bool is_new_key = (table->keys[slot] == NULL);
     if (is_new_key)
     {
-        res->key = key;
-
-        const bool not_tombstone = IS_NIL(res->value);
+        const bool not_tombstone = (table->hashes[slot] == HASH_EMPTY);
         if (not_tombstone)
             table->count++;
+
+        table->keys[slot]   = key;
+        table->hashes[slot] = key->hash;
     }
 
-    res->value = value;
+    table->values[slot] = value;
     return is_new_key;
 }
 
@@ -111,11 +246,24 @@ bool table_find(const Table* table, const ObjString* key, Value* out_val)
     if (table->count == 0)
         return false;
 
-    const Entry* res = find_entry(table->entries, table->capacity, key);
-    if (res->key == NULL)
+#ifdef TABLE_SMALL_LINEAR
+    if (is_small(table))
+    {
+        const int index = find_small_index(table, key);
+        if (index == -1)
+            return false;
+
+        *out_val = table->values[index];
+        return true;
+    }
+#endif
+
+    const int slot = find_slot(table->keys, table->hashes, table->capacity,
+                               key, key->hash);
+    if (table->keys[slot] == NULL)
         return false;
 
-    *out_val = res->value;
+    *out_val = table->values[slot];
     return true;
 }
 
@@ -124,22 +272,43 @@ bool table_remove(Table* table, const ObjString* key)
     if (table->count == 0)
         return false;
 
-    Entry* res = find_entry(table->entries, table->capacity, key);
-    if (res->key == NULL)
+#ifdef TABLE_SMALL_LINEAR
+    if (is_small(table))
+    {
+        const int index = find_small_index(table, key);
+        if (index == -1)
+            return false;
+
+        remove_small_index(table, index);
+        return true;
+    }
+#endif
+
+    const int slot = find_slot(table->keys, table->hashes, table->capacity,
+                               key, key->hash);
+    if (table->keys[slot] == NULL)
         return false;
 
-    res->key   = NULL;
-    res->value = BOOL_VAL(true);
+    table->keys[slot]   = NULL;
+    table->hashes[slot] = HASH_TOMBSTONE;
     return true;
 }
 
-void table_copy(const Table* src, Table* dest)
+void table_copy(VM* vm, const Table* src, Table* dest)
 {
+#ifdef TABLE_SMALL_LINEAR
+    if (is_small(src))
+    {
+        for (int i = 0; i < src->count; i++)
+            table_insert(vm, dest, src->keys[i], src->values[i]);
+        return;
+    }
+#endif
+
     for (int i = 0; i < src->capacity; i++)
     {
-        const Entry* entry = &src->entries[i];
-        if (entry->key != NULL)
-            table_insert(dest, entry->key, entry->value);
+        if (src->keys[i] != NULL)
+            table_insert(vm, dest, src->keys[i], src->values[i]);
     }
 }
 
@@ -149,6 +318,22 @@ ObjString* table_find_string(const Table* table, const char* chars,
     if (table->count == 0)
         return NULL;
 
+#ifdef TABLE_SMALL_LINEAR
+    if (is_small(table))
+    {
+        for (int i = 0; i < table->count; i++)
+        {
+            ObjString* key = table->keys[i];
+            if (key->length == length && key->hash == hash
+                && memcmp(key->chars, chars, length) == 0)
+            {
+                return key;
+            }
+        }
+        return NULL;
+    }
+#endif
+
 #ifdef TABLE_OPTIMIZED_FIND_ENTRY
     uint32_t index = hash & (table->capacity - 1);
 #else
@@ -157,18 +342,18 @@ ObjString* table_find_string(const Table* table, const char* chars,
 
     while (true)
     {
-        const Entry* entry = &table->entries[index];
+        ObjString* key = table->keys[index];
 
-        if (entry->key == NULL)
+        if (key == NULL)
         {
-            const bool not_tombstone = IS_NIL(entry->value);
+            const bool not_tombstone = (table->hashes[index] == HASH_EMPTY);
             if (not_tombstone)
                 return NULL;
         }
-        else if (entry->key->length == length && entry->key->hash == hash
-                 && memcmp(entry->key->chars, chars, length) == 0)
+        else if (table->hashes[index] == hash && key->length == length
+                 && memcmp(key->chars, chars, length) == 0)
         {
-            return entry->key;
+            return key;
         }
 
 #ifdef TABLE_OPTIMIZED_FIND_ENTRY
@@ -179,29 +364,63 @@ ObjString* table_find_string(const Table* table, const char* chars,
     }
 }
 
-void mark_table(const Table* table)
+void mark_table(VM* vm, const Table* table)
 {
+#ifdef TABLE_SMALL_LINEAR
+    if (is_small(table))
+    {
+        for (int i = 0; i < table->count; i++)
+        {
+            mark_object(vm, (Obj*)table->keys[i]);
+            mark_value(vm, table->values[i]);
+        }
+        return;
+    }
+#endif
+
     for (int i = 0; i < table->capacity; i++)
     {
-        const Entry* entry = &table->entries[i];
-        mark_object((Obj*)entry->key);
-        mark_value(entry->value);
+        if (table->keys[i] == NULL)
+            continue;
+
+        mark_object(vm, (Obj*)table->keys[i]);
+        mark_value(vm, table->values[i]);
     }
 }
 
-void table_remove_white(Table* table)
+void table_remove_white(const VM* vm, Table* table)
 {
+#ifndef GC_OPTIMIZE_CLEARING_MARK
+    (void)vm;
+#endif
+#ifdef TABLE_SMALL_LINEAR
+    if (is_small(table))
+    {
+        for (int i = table->count - 1; i >= 0; i--)
+        {
+#ifdef GC_OPTIMIZE_CLEARING_MARK
+            if (obj_mark(&table->keys[i]->obj) != vm->mark_value)
+#else
+            if (!obj_mark(&table->keys[i]->obj))
+#endif
+                remove_small_index(table, i);
+        }
+        return;
+    }
+#endif
+
     for (int i = 0; i < table->capacity; i++)
     {
-        const Entry* entry = &table->entries[i];
-        if (entry->key != NULL
+        const ObjString* key = table->keys[i];
+        if (key != NULL
 #ifdef GC_OPTIMIZE_CLEARING_MARK
-            && entry->key->obj.mark != vm.mark_value)
+            && obj_mark(&key->obj) != vm->mark_value)
 #else
-            && !entry->key->obj.is_marked)
+            && !obj_mark(&key->obj))
 #endif
         {
-            table_remove(table, entry->key);
+            table->keys[i]   = NULL;
+            table->hashes[i] = HASH_TOMBSTONE;
         }
     }
 }
@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+
+#include "clocks/trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// stderr itself is left unbuffered, so that errors still show up right
+// away, and a trace gets a buffered stream of its own on a copy of it.
+static FILE* open_destination(const char* path)
+{
+    if (path != NULL)
+        return fopen(path, "w");
+
+    const int fd = dup(STDERR_FILENO);
+    if (fd == -1)
+        return NULL;
+
+    FILE* out = fdopen(fd, "w");
+    if (out == NULL)
+        close(fd);
+    return out;
+}
+
+FILE* open_trace(const char* path)
+{
+    FILE* trace = open_destination(path);
+    if (trace != NULL)
+        setvbuf(trace, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    return trace;
+}
+
+#ifdef __linux__
+
+typedef struct
+{
+    char*  data;
+    size_t size;
+    size_t end;
+    bool   wrapped;
+    FILE*  out;
+} Ring;
+
+static ssize_t ring_write(void* cookie, const char* buffer, size_t size)
+{
+    Ring*        ring    = (Ring*)cookie;
+    const size_t written = size;
+
+    // Only the end of a write larger than the ring would be kept.
+    if (size > ring->size)
+    {
+        buffer += size - ring->size;
+        size = ring->size;
+    }
+
+    while (size > 0)
+    {
+        const size_t count = size < ring->size - ring->end ? size : ring->size - ring->end;
+        memcpy(ring->data + ring->end, buffer, count);
+        buffer += count;
+        size -= count;
+
+        ring->end += count;
+        if (ring->end == ring->size)
+        {
+            ring->end     = 0;
+            ring->wrapped = true;
+        }
+    }
+    return (ssize_t)written;
+}
+
+// Writes the oldest bytes first, from the end of the ring on, if it has
+// wrapped. The line which was cut in half by newer ones is left out.
+static int ring_close(void* cookie)
+{
+    Ring* ring = (Ring*)cookie;
+
+    size_t start = ring->wrapped ? ring->end : 0;
+    size_t count = ring->wrapped ? ring->size : ring->end;
+    if (ring->wrapped)
+    {
+        for (; count > 0 && ring->data[start] != '\n'; count--)
+            start = (start + 1) % ring->size;
+        if (count > 0)
+        {
+            start = (start + 1) % ring->size;
+            count--;
+        }
+        fputs("...\n", ring->out);
+    }
+
+    const size_t first = count < ring->size - start ? count : ring->size - start;
+    fwrite(ring->data + start, 1, first, ring->out);
+    fwrite(ring->data, 1, count - first, ring->out);
+
+    const bool failed = ferror(ring->out) != 0;
+    const int  closed = fclose(ring->out);
+    free(ring->data);
+    free(ring);
+    return failed || closed != 0 ? EOF : 0;
+}
+
+FILE* open_trace_ring(const char* path, size_t ring_size)
+{
+    Ring* ring = (Ring*)malloc(sizeof(Ring));
+    if (ring == NULL)
+        return NULL;
+
+    ring->data    = (char*)malloc(ring_size);
+    ring->size    = ring_size;
+    ring->end     = 0;
+    ring->wrapped = false;
+    ring->out     = ring->data != NULL ? open_destination(path) : NULL;
+    if (ring->out == NULL)
+    {
+        free(ring->data);
+        free(ring);
+        return NULL;
+    }
+
+    const cookie_io_functions_t functions = {
+        .read = NULL, .write = ring_write, .seek = NULL, .close = ring_close};
+    FILE* trace = fopencookie(ring, "w", functions);
+    if (trace == NULL)
+    {
+        fclose(ring->out);
+        free(ring->data);
+        free(ring);
+        return NULL;
+    }
+    setvbuf(trace, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    return trace;
+}
+
+#endif
@@ -9,6 +9,10 @@
 bool values_equal(Value a, Value b)
 {
 #ifdef VALUE_NAN_BOXING
+#ifdef VALUE_SMALL_INTEGERS
+    if (IS_INTEGER(a) && IS_INTEGER(b))
+        return a == b;
+#endif
     if (IS_NUMBER(a) && IS_NUMBER(b))
         return AS_NUMBER(a) == AS_NUMBER(b);
     return a == b;
@@ -40,20 +44,20 @@ void init_value_array(ValueArray* array)
     array->values   = NULL;
 }
 
-void free_value_array(ValueArray* array)
+void free_value_array(VM* vm, ValueArray* array)
 {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     init_value_array(array);
 }
 
-void write_value_array(ValueArray* array, Value value)
+void write_value_array(VM* vm, ValueArray* array, Value value)
 {
     if (array->capacity < array->count + 1)
     {
         const int old_capacity = array->capacity;
 
         array->capacity = GROW_CAPACITY(old_capacity);
-        array->values   = GROW_ARRAY(Value, array->values,
+        array->values   = GROW_ARRAY(vm, Value, array->values,
                                      old_capacity, array->capacity);
     }
 
@@ -61,31 +65,39 @@ void write_value_array(ValueArray* array, Value value)
     array->count++;
 }
 
-void print_value(Value value)
+void print_value(FILE* out, Value value)
 {
 #ifdef VALUE_NAN_BOXING
     if (IS_BOOL(value))
-        printf(AS_BOOL(value) ? "true" : "false");
+        fprintf(out, AS_BOOL(value) ? "true" : "false");
     else if (IS_NIL(value))
-        printf("nil");
+        fprintf(out, "nil");
     else if (IS_NUMBER(value))
-        printf("%g", AS_NUMBER(value));
+        fprintf(out, "%g", AS_NUMBER(value));
     else if (IS_OBJ(value))
-        print_object(&value);
+        print_object(out, &value);
+#ifdef VALUE_SHORT_STRINGS
+    else if (IS_SHORT_STRING(value))
+    {
+        char      chars[SHORT_STRING_MAX];
+        const int length = short_string_chars(value, chars);
+        fprintf(out, "%.*s", length, chars);
+    }
+#endif
 #else
     switch (value.type)
     {
         case ValBool:
-            printf(AS_BOOL(value) ? "true" : "false");
+            fprintf(out, AS_BOOL(value) ? "true" : "false");
             break;
         case ValNil:
-            printf("nil");
+            fprintf(out, "nil");
             break;
         case ValNumber:
-            printf("%g", AS_NUMBER(value));
+            fprintf(out, "%g", AS_NUMBER(value));
             break;
         case ValObj:
-            print_object(&value);
+            print_object(out, &value);
             break;
     }
 #endif
@@ -2,6 +2,7 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -9,139 +10,556 @@
 #include <clocks/common.h>
 #include <clocks/compiler.h>
 #include <clocks/debug.h>
+#include <clocks/event_loop.h>
+#include <clocks/heap_snapshot.h>
+#include <clocks/isolate.h>
 #include <clocks/memory.h>
 #include <clocks/object.h>
+#include <clocks/parallel.h>
+#include <clocks/probes.h>
+#include <clocks/profile.h>
 #include <clocks/table.h>
 #include <clocks/value.h>
 
-VM vm;
 
-static Value clock_native(__attribute__((unused)) int          arg_count,
+static Value clock_native(__attribute__((unused)) VM*          vm,
+                          __attribute__((unused)) int          arg_count,
                           __attribute__((unused)) const Value* args)
 {
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static Value has_field_native(int arg_count, const Value* args)
+// Seconds on a monotonic wall clock, unlike clock(), which counts the CPU
+// time of every thread in the process.
+static Value now_native(__attribute__((unused)) VM*          vm,
+                        __attribute__((unused)) int          arg_count,
+                        __attribute__((unused)) const Value* args)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return NUMBER_VAL((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+}
+
+static Value has_field_native(__attribute__((unused)) VM* vm, int arg_count,
+                              const Value* args)
 {
     if (arg_count != 2 || !IS_INSTANCE(args[0]) || !IS_STRING(args[1]))
         return NIL_VAL;
 
     ObjInstance* instance = AS_INSTANCE(args[0]);
 
+#ifdef VALUE_SHORT_STRINGS
+    // Field names are interned, so a name that was never interned can't be
+    // a field of any instance.
+    StringView name;
+    string_view(args[1], &name);
+    const ObjString* field = table_find_string(&vm->strings, name.chars, name.length,
+                                               hash_string(name.chars, name.length));
+    if (field == NULL)
+        return FALSE_VAL;
+#else
+    const ObjString* field = AS_STRING(args[1]);
+#endif
+
     Value dummy;
-    return BOOL_VAL(table_find(&instance->fields, AS_STRING(args[1]), &dummy));
+    return BOOL_VAL(table_find(&instance->fields, field, &dummy));
+}
+
+// The key is pushed, as growing the table can collect.
+static void set_number_field(VM* vm, ObjInstance* instance, const char* name, double value)
+{
+    ObjString* key = copy_string(vm, name, (int)strlen(name));
+    push(vm, OBJ_VAL(key));
+    table_insert(vm, &instance->fields, key, NUMBER_VAL(value));
+    pop(vm);
+}
+
+// Returns a GcStats instance holding the collector's numbers so far, with
+// times in milliseconds.
+static Value gc_stats_native(VM*                                   vm,
+                             __attribute__((unused)) int          arg_count,
+                             __attribute__((unused)) const Value* args)
+{
+    const GcStats* stats = &vm->gc_stats;
+
+    ObjString* name = copy_string(vm, "GcStats", 7);
+    push(vm, OBJ_VAL(name));
+    ObjClass* klass = new_class(vm, name);
+    push(vm, OBJ_VAL(klass));
+    ObjInstance* instance = new_instance(vm, klass);
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(instance));
+
+    const double run_ms   = (double)(monotonic_ns() - stats->start_ns) / 1e6;
+    const double pause_ms = (double)stats->total_pause_ns / 1e6;
+
+    set_number_field(vm, instance, "collections", (double)stats->collections);
+    set_number_field(vm, instance, "total_pause_ms", pause_ms);
+    set_number_field(vm, instance, "max_pause_ms", (double)stats->max_pause_ns / 1e6);
+    set_number_field(vm, instance, "mean_pause_ms",
+                     stats->collections > 0 ? pause_ms / (double)stats->collections : 0);
+    set_number_field(vm, instance, "mark_ms", (double)stats->mark_ns / 1e6);
+    set_number_field(vm, instance, "sweep_ms", (double)stats->sweep_ns / 1e6);
+    set_number_field(vm, instance, "run_ms", run_ms);
+    set_number_field(vm, instance, "gc_percent", run_ms > 0 ? 100 * pause_ms / run_ms : 0);
+
+    set_number_field(vm, instance, "bytes_freed", (double)stats->bytes_freed);
+    set_number_field(vm, instance, "last_bytes_freed", (double)stats->last_bytes_freed);
+    set_number_field(vm, instance, "heap_bytes", (double)vm->bytes_allocated);
+    set_number_field(vm, instance, "peak_heap_bytes", (double)stats->peak_heap);
+    set_number_field(vm, instance, "next_gc_bytes", (double)vm->next_gc_thresh);
+
+    static const char* PAUSE_FIELDS[GC_PAUSE_BUCKETS] = {
+        "pauses_under_100us", "pauses_under_1ms", "pauses_under_10ms", "pauses_under_100ms",
+        "pauses_over_100ms"};
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+        set_number_field(vm, instance, PAUSE_FIELDS[i], (double)stats->pauses[i]);
+
+    return pop_and_return(vm);
+}
+
+// Writes a heap snapshot to the path, see heap_snapshot.h. Returns
+// whether it could.
+static Value heap_snapshot_native(VM* vm, int arg_count, const Value* args)
+{
+    if (arg_count != 1 || !IS_STRING(args[0]))
+        return NIL_VAL;
+
+    StringView view;
+    string_view(args[0], &view);
+
+    char* path = (char*)malloc(view.length + 1);
+    if (path == NULL)
+        return BOOL_VAL(false);
+    memcpy(path, view.chars, view.length);
+    path[view.length] = '\0';
+
+    const bool saved = save_heap_snapshot(vm, path);
+    free(path);
+    return BOOL_VAL(saved);
+}
+
+static Value channel_native(VM*                                   vm,
+                            __attribute__((unused)) int          arg_count,
+                            __attribute__((unused)) const Value* args)
+{
+    return OBJ_VAL(new_channel(vm, channel_create()));
+}
+
+static Value send_native(__attribute__((unused)) VM* vm, int arg_count, const Value* args)
+{
+    if (arg_count != 2 || !IS_CHANNEL(args[0]))
+        return NIL_VAL;
+
+    return BOOL_VAL(channel_send(AS_CHANNEL(args[0]), args[1]));
+}
+
+static Value receive_native(VM* vm, int arg_count, const Value* args)
+{
+    if (arg_count != 1 || !IS_CHANNEL(args[0]))
+        return NIL_VAL;
+
+    return channel_receive(vm, AS_CHANNEL(args[0]));
+}
+
+static Value spawn_native(VM* vm, int arg_count, const Value* args)
+{
+    if (arg_count != 2 || !IS_STRING(args[0]) || !IS_CHANNEL(args[1]))
+        return NIL_VAL;
+
+    const char* path = NULL;
+#ifdef VALUE_SHORT_STRINGS
+    char buffer[SHORT_STRING_MAX + 1];
+    if (IS_SHORT_STRING(args[0]))
+    {
+        buffer[short_string_chars(args[0], buffer)] = '\0';
+        path                                        = buffer;
+    }
+    else
+#endif
+        path = AS_CSTRING(args[0]);
+
+    return BOOL_VAL(spawn_isolate(vm, path, AS_CHANNEL(args[1])));
+}
+
+static Value parallel_map_native(VM* vm, int arg_count, const Value* args)
+{
+    if (arg_count != 2 || !IS_CHANNEL(args[1]))
+        return NIL_VAL;
+
+    Channel* results = parallel_map(vm, args[0], AS_CHANNEL(args[1]));
+    if (results == NULL)
+        return NIL_VAL;
+
+    return OBJ_VAL(new_channel(vm, results));
+}
+
+static void save_fiber(VM* vm)
+{
+    ObjFiber* fiber      = vm->fiber;
+    fiber->stack_top     = vm->stack_top;
+    fiber->frame_count   = vm->frame_count;
+    fiber->open_upvalues = vm->open_upvalues_head;
+}
+
+// A sampler's signal handler may read the frames at any point, so there
+// are none while they are switched. The fences only keep the compiler
+// from reordering the stores.
+static void load_fiber(VM* vm, ObjFiber* fiber)
+{
+    vm->frame_count = 0;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+    vm->fiber              = fiber;
+    vm->stack              = fiber->stack;
+    vm->stack_top          = fiber->stack_top;
+    vm->frames             = fiber->frames;
+    vm->frame_capacity     = fiber->frame_capacity;
+    vm->open_upvalues_head = fiber->open_upvalues;
+
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    vm->frame_count = fiber->frame_count;
+}
+
+// Doubles the running fiber's stack and frames, up to FRAMES_MAX frames.
+// Open upvalues into the stack are all on the running fiber's list, so
+// they move along with the frames' slots. Kept out of line, as call() is
+// hot and this rarely runs.
+static __attribute__((noinline, cold)) bool grow_fiber(VM* vm)
+{
+    ObjFiber* fiber = vm->fiber;
+    if (fiber->frame_capacity >= FRAMES_MAX)
+        return false;
+
+    const int frame_capacity = fiber->frame_capacity * 2 < FRAMES_MAX
+                                 ? fiber->frame_capacity * 2
+                                 : FRAMES_MAX;
+    const int stack_capacity = frame_capacity * UINT8_COUNT;
+
+    // Anything collected while allocating is still found in the old arrays.
+    Value*     stack  = ALLOCATE(vm, Value, stack_capacity);
+    CallFrame* frames = ALLOCATE(vm, CallFrame, frame_capacity);
+
+    Value*     old_stack   = vm->stack;
+    CallFrame* old_frames  = vm->frames;
+    const int  frame_count = vm->frame_count;
+
+    // As in load_fiber(), there are no frames while they move.
+    vm->frame_count = 0;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+    memcpy(stack, old_stack, sizeof(Value) * (vm->stack_top - old_stack));
+    for (int i = 0; i < frame_count; i++)
+    {
+        frames[i]       = old_frames[i];
+        frames[i].slots = stack + (old_frames[i].slots - old_stack);
+    }
+    ObjUpvalue* upvalue = vm->open_upvalues_head;
+    while (upvalue != NULL)
+    {
+        upvalue->location = stack + (upvalue->location - old_stack);
+        upvalue           = upvalue->next;
+    }
+
+    FREE_ARRAY(vm, Value, old_stack, fiber->stack_capacity);
+    FREE_ARRAY(vm, CallFrame, old_frames, fiber->frame_capacity);
+
+    fiber->stack          = stack;
+    fiber->stack_capacity = stack_capacity;
+    fiber->frames         = frames;
+    fiber->frame_capacity = frame_capacity;
+
+    vm->stack_top      = stack + (vm->stack_top - old_stack);
+    vm->stack          = stack;
+    vm->frames         = frames;
+    vm->frame_capacity = frame_capacity;
+
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    vm->frame_count = frame_count;
+    return true;
+}
+
+static bool call(VM* vm, const ObjClosure* closure, int arg_count);
+
+static Value fiber_native(VM* vm, int arg_count, const Value* args)
+{
+    if (arg_count != 1 || !IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->func->arity > 1)
+        return NIL_VAL;
+
+    return OBJ_VAL(new_fiber(vm, AS_CLOSURE(args[0]), FIBER_INITIAL_FRAMES));
+}
+
+void vm_transfer(VM* vm, ObjFiber* fiber, Value value)
+{
+    save_fiber(vm);
+    load_fiber(vm, fiber);
+    if (fiber->state == FiberNew)
+    {
+        const int arity = fiber->closure->func->arity;
+        push(vm, OBJ_VAL(fiber->closure));
+        if (arity == 1)
+            push(vm, value);
+        call(vm, fiber->closure, arity);
+    }
+    else
+        push(vm, value);
+
+    fiber->state = FiberRunning;
+}
+
+// Switches to the fiber, leaving the resume call to be completed when it
+// yields or returns. Fibers run by the event loop can't be resumed.
+static Value resume_native(VM* vm, int arg_count, const Value* args)
+{
+    if (arg_count < 1 || arg_count > 2 || !IS_FIBER(args[0]))
+        return NIL_VAL;
+
+    ObjFiber* fiber = AS_FIBER(args[0]);
+    if ((fiber->state != FiberNew && fiber->state != FiberSuspended) || fiber->scheduled)
+        return NIL_VAL;
+
+    const Value value = arg_count == 2 ? args[1] : NIL_VAL;
+    vm->stack_top -= arg_count + 1;
+    fiber->caller = vm->fiber;
+    vm_transfer(vm, fiber, value);
+    return NIL_VAL;
+}
+
+// Suspends the running fiber and completes the resume call that started
+// it with the value. Does nothing on the main fiber. A fiber run by the
+// event loop lets the other ready ones run first instead.
+static Value yield_native(VM* vm, int arg_count, const Value* args)
+{
+    ObjFiber* fiber = vm->fiber;
+    if (arg_count > 1 || fiber->caller == NULL)
+        return NIL_VAL;
+#ifdef __linux__
+    if (fiber->scheduled)
+        return loop_yield(vm, arg_count);
+#endif
+
+    const Value value = arg_count == 1 ? args[0] : NIL_VAL;
+    vm->stack_top -= arg_count + 1;
+
+    ObjFiber* caller = fiber->caller;
+    fiber->caller    = NULL;
+    fiber->state     = FiberSuspended;
+    vm_transfer(vm, caller, value);
+    return NIL_VAL;
 }
 
-static void reset_stack()
+static Value is_done_native(__attribute__((unused)) VM* vm, int arg_count, const Value* args)
 {
-    vm.stack_top   = vm.stack;
-    vm.frame_count = 0;
+    if (arg_count != 1 || !IS_FIBER(args[0]))
+        return NIL_VAL;
+
+    return BOOL_VAL(AS_FIBER(args[0])->state == FiberDone);
 }
 
-static void runtime_error(const char* format, ...)
+// An error unwinds every fiber waiting on the one that failed, back to the
+// main fiber.
+static void reset_stack(VM* vm)
+{
+    ObjFiber* fiber = vm->fiber;
+    while (fiber->caller != NULL)
+    {
+        ObjFiber* caller = fiber->caller;
+        save_fiber(vm);
+        fiber->caller = NULL;
+        fiber->state  = FiberDone;
+        load_fiber(vm, caller);
+        fiber = caller;
+    }
+
+    vm->stack_top   = vm->stack;
+    vm->frame_count = 0;
+#ifdef __linux__
+    reset_event_loop(vm);
+#endif
+}
+
+static void runtime_error(VM* vm, const char* format, ...)
 {
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm->err, format, args);
     va_end(args);
-    fputs("\n== stack trace ==\n", stderr);
+    fputs("\n== stack trace ==\n", vm->err);
 
-    for (int i = vm.frame_count - 1; i >= 0; i--)
+    for (int i = vm->frame_count - 1; i >= 0; i--)
     {
-        const CallFrame*   frame = &vm.frames[i];
+        const CallFrame*   frame = &vm->frames[i];
         const ObjFunction* func  = frame->closure->func;
 
         const size_t instruction_offset = frame->ip - func->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ",
+        fprintf(vm->err, "[line %d] in ",
 #ifdef CHUNK_LINE_RUN_LENGTH_ENCODING
                 get_line(&func->chunk, instruction_offset));
 #else
                 func->chunk.lines[instruction_offset]);
 #endif
         if (func->name == NULL)
-            fprintf(stderr, "script\n");
+            fprintf(vm->err, "script\n");
         else
-            fprintf(stderr, "%s()\n", func->name->chars);
+            fprintf(vm->err, "%s()\n", func->name->chars);
     }
 
-    reset_stack();
+    reset_stack(vm);
 }
 
-static void define_native(const char* name, const NativeFn func)
+void define_native(VM* vm, const char* name, const NativeFn func)
 {
-    push(OBJ_VAL(copy_string(name, (int)strlen(name))));
-    push(OBJ_VAL(new_native(func)));
-    table_insert(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
+    push(vm, OBJ_VAL(copy_string(vm, name, (int)strlen(name))));
+    push(vm, OBJ_VAL(new_native(vm, func)));
+    table_insert(vm, &vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+    pop(vm);
+    pop(vm);
 }
 
-void init_vm()
+VM* vm_new()
 {
-    reset_stack();
-    init_table(&vm.globals);
-    init_table(&vm.strings);
-    vm.init_string        = NULL;
-    vm.obj_head           = NULL;
-    vm.open_upvalues_head = NULL;
-    vm.gray_count         = 0;
-    vm.gray_capacity      = 0;
-    vm.gray_stack         = NULL;
-    vm.bytes_allocated    = 0;
-    vm.next_gc_thresh     = 1024 * 1024;
+    VM* vm = (VM*)malloc(sizeof(VM));
+    if (vm == NULL)
+        exit(1);
+
+    vm->stack_top          = NULL;
+    vm->stack              = NULL;
+    vm->frame_count        = 0;
+    vm->frames             = NULL;
+    vm->fiber              = NULL;
+    vm->main_fiber         = NULL;
+    vm->open_upvalues_head = NULL;
+    init_table(&vm->globals);
+    init_table(&vm->strings);
+    vm->init_string        = NULL;
+#ifdef OBJECT_METHOD_SELECTORS
+    init_value_array(&vm->selectors);
+#endif
+    vm->obj_head           = NULL;
+    vm->gray_count         = 0;
+    vm->gray_capacity      = 0;
+    vm->gray_stack         = NULL;
+    vm->parser             = NULL;
+    vm->out                = stdout;
+    vm->err                = stderr;
+#ifdef DEBUG_TRACE_EXECUTION
+    vm->trace_execution    = stdout;
+#else
+    vm->trace_execution    = NULL;
+#endif
+#ifdef DEBUG_PRINT_CODE
+    vm->trace_code         = stdout;
+#else
+    vm->trace_code         = NULL;
+#endif
+#ifdef DEBUG_LOG_GC
+    vm->trace_gc           = stdout;
+#else
+    vm->trace_gc           = NULL;
+#endif
+    vm->isolates           = NULL;
+#ifdef __linux__
+    vm->event_loop         = NULL;
+    vm->sampler            = NULL;
+#endif
+#ifdef PERF_MAP
+    vm->perf_map           = NULL;
+#endif
+    vm->heap_snapshot      = NULL;
+    vm->allocation_profile = NULL;
+#ifdef PROFILE_OPCODES
+    vm->opcode_profile     = NULL;
+#endif
+    vm->bytes_allocated    = 0;
+    vm->next_gc_thresh     = 1024 * 1024;
+    init_gc_stats(&vm->gc_stats);
 
 #ifdef GC_OPTIMIZE_CLEARING_MARK
-    vm.mark_value = true;
+    vm->mark_value = true;
 #endif
 
-    vm.init_string = copy_string("init", 4);
-
-    define_native("clock", clock_native);
-    define_native("has_field", has_field_native);
+    vm->main_fiber        = new_fiber(vm, NULL, FRAMES_MAX);
+    vm->main_fiber->state = FiberRunning;
+    load_fiber(vm, vm->main_fiber);
+
+    vm->init_string = copy_string(vm, "init", 4);
+
+    define_native(vm, "clock", clock_native);
+    define_native(vm, "now", now_native);
+    define_native(vm, "has_field", has_field_native);
+    define_native(vm, "channel", channel_native);
+    define_native(vm, "send", send_native);
+    define_native(vm, "receive", receive_native);
+    define_native(vm, "spawn", spawn_native);
+    define_native(vm, "parallel_map", parallel_map_native);
+    define_native(vm, "fiber", fiber_native);
+    define_native(vm, "resume", resume_native);
+    define_native(vm, "yield", yield_native);
+    define_native(vm, "is_done", is_done_native);
+    define_native(vm, "gc_stats", gc_stats_native);
+    define_native(vm, "heap_snapshot", heap_snapshot_native);
+#ifdef __linux__
+    define_event_loop_natives(vm);
+#endif
+    return vm;
 }
 
-void free_vm()
+void vm_free(VM* vm)
 {
-    free_table(&vm.globals);
-    free_table(&vm.strings);
-    vm.init_string = NULL;
-    free_objects();
+    join_isolates(vm);
+#ifdef __linux__
+    if (vm->sampler != NULL)
+        free_sampler(vm->sampler);
+    free_event_loop(vm);
+#endif
+#ifdef PERF_MAP
+    if (vm->perf_map != NULL)
+        free_perf_map(vm->perf_map);
+#endif
+    free_table(vm, &vm->globals);
+    free_table(vm, &vm->strings);
+    vm->init_string = NULL;
+#ifdef OBJECT_METHOD_SELECTORS
+    free_value_array(vm, &vm->selectors);
+#endif
+    free_objects(vm);
+    free(vm);
 }
 
-void push(Value value)
+void push(VM* vm, Value value)
 {
-    *vm.stack_top = value;
-    vm.stack_top++;
+    *vm->stack_top = value;
+    vm->stack_top++;
 }
 
 #ifdef VM_OPTIMIZED_POP
-Value pop_and_return()
+Value pop_and_return(VM* vm)
 {
-    vm.stack_top--;
-    return *vm.stack_top;
+    vm->stack_top--;
+    return *vm->stack_top;
 }
 
-void pop()
+void pop(VM* vm)
 {
-    vm.stack_top--;
+    vm->stack_top--;
 }
 #else
-Value pop_and_return()
+Value pop_and_return(VM* vm)
 {
-    return pop();
+    return pop(vm);
 }
 
-Value pop()
+Value pop(VM* vm)
 {
-    vm.stack_top--;
-    return *vm.stack_top;
+    vm->stack_top--;
+    return *vm->stack_top;
 }
 #endif
 
-static Value peek(int distance)
+static Value peek(const VM* vm, int distance)
 {
-    return vm.stack_top[-1 - distance];
+    return vm->stack_top[-1 - distance];
 }
 
 static bool is_falsey(Value value)
@@ -149,87 +567,153 @@ static bool is_falsey(Value value)
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate()
+#ifdef VALUE_SMALL_INTEGERS
+static bool multiply_overflow(int32_t a, int32_t b, int32_t* res)
+{
+    // A zero product with a negative operand is -0, which only a double holds.
+    return __builtin_mul_overflow(a, b, res) || (*res == 0 && (a < 0 || b < 0));
+}
+#endif
+
+// Inlined into both of run()'s loops, which each call it from one place.
+static inline __attribute__((always_inline)) void concatenate(VM* vm)
 {
-    const ObjString* b = AS_STRING(peek(0));
-    const ObjString* a = AS_STRING(peek(1));
+    StringView b;
+    StringView a;
+    string_view(peek(vm, 0), &b);
+    string_view(peek(vm, 1), &a);
+
+    const int length = a.length + b.length;
 
-    const int length = a->length + b->length;
+#ifdef VALUE_SHORT_STRINGS
+    if (length <= SHORT_STRING_MAX && memchr(a.chars, '\0', a.length) == NULL &&
+        memchr(b.chars, '\0', b.length) == NULL)
+    {
+        char chars[SHORT_STRING_MAX];
+        memcpy(chars, a.chars, a.length);
+        memcpy(chars + a.length, b.chars, b.length);
+        pop(vm);
+        pop(vm);
+        push(vm, short_string_val(chars, length));
+        return;
+    }
+#endif
 
 #ifdef OBJECT_STRING_FLEXIBLE_ARRAY
-    ObjString* res = allocate_string(length);
-    memcpy(res->chars, a->chars, a->length);
-    memcpy(res->chars + a->length, b->chars, b->length);
-    res->hash          = hash_string(res->chars, length);
+    ObjString* res = allocate_string(vm, length);
+    memcpy(res->chars, a.chars, a.length);
+    memcpy(res->chars + a.length, b.chars, b.length);
     res->chars[length] = '\0';
+    res                = intern_allocated_string(vm, res);
 #else
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
+    char* chars = ALLOCATE(vm, char, length + 1);
+    memcpy(chars, a.chars, a.length);
+    memcpy(chars + a.length, b.chars, b.length);
     chars[length] = '\0';
 
-    ObjString* res = take_string(chars, length);
+    ObjString* res = take_string(vm, chars, length);
 #endif
-    pop();
-    pop();
-    push(OBJ_VAL(res));
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(res));
 }
 
-static bool call(const ObjClosure* closure, int arg_count)
+#ifdef USDT_PROBES
+static const char* probe_name(const ObjFunction* func)
+{
+    return func->name != NULL ? func->name->chars : "script";
+}
+
+static int probe_line(const ObjFunction* func)
+{
+#ifdef CHUNK_LINE_RUN_LENGTH_ENCODING
+    return get_line(&func->chunk, 0);
+#else
+    return func->chunk.lines[0];
+#endif
+}
+#endif
+
+static bool call(VM* vm, const ObjClosure* closure, int arg_count)
 {
     if (arg_count != closure->func->arity)
     {
-        runtime_error("Expected %d arguments but got %d.",
+        runtime_error(vm, "Expected %d arguments but got %d.",
                       closure->func->arity, arg_count);
         return false;
     }
-    if (vm.frame_count == FRAMES_MAX)
+    if (vm->frame_count == vm->frame_capacity && !grow_fiber(vm))
     {
-        runtime_error("You know it : Stack overflow.");
+        runtime_error(vm, "You know it : Stack overflow.");
         return false;
     }
 
-    CallFrame* frame = &vm.frames[vm.frame_count++];
+    // The frame is only counted once complete, see load_fiber().
+    CallFrame* frame = &vm->frames[vm->frame_count];
     frame->closure   = closure;
     frame->ip        = closure->func->chunk.code;
-    frame->slots     = vm.stack_top - arg_count - 1;
+    frame->slots     = vm->stack_top - arg_count - 1;
+
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    vm->frame_count++;
+
+#ifdef USDT_PROBES
+    if (CLOCKS_PROBE_ENABLED(function__entry))
+        CLOCKS_FUNCTION_ENTRY(probe_name(closure->func), probe_line(closure->func),
+                              vm->frame_count);
+#endif
+
     return true;
 }
 
-static bool call_value(Value callee, int arg_count)
+static bool find_method(const ObjClass* klass, const ObjString* name, Value* method)
+{
+#ifdef OBJECT_METHOD_SELECTORS
+    return class_find_method(klass, name, method);
+#else
+    return table_find(&klass->methods, name, method);
+#endif
+}
+
+static bool call_value(VM* vm, Value callee, int arg_count)
 {
     if (IS_OBJ(callee))
     {
         switch (OBJ_TYPE(callee))
         {
             case ObjTypeClosure:
-                return call(AS_CLOSURE(callee), arg_count);
+                return call(vm, AS_CLOSURE(callee), arg_count);
 
             case ObjTypeNative:
             {
-                const NativeFn native = AS_NATIVE(callee);
-                const Value    result = native(arg_count, vm.stack_top - arg_count);
-                vm.stack_top -= arg_count + 1;
-                push(result);
+                const ObjFiber* fiber  = vm->fiber;
+                const NativeFn  native = AS_NATIVE(callee);
+                const Value     result = native(vm, arg_count, vm->stack_top - arg_count);
+                // Switching fibers completes the call on both stacks.
+                if (vm->fiber != fiber)
+                    return true;
+
+                vm->stack_top -= arg_count + 1;
+                push(vm, result);
                 return true;
             }
 
             case ObjTypeClass:
             {
-                ObjClass* klass              = AS_CLASS(callee);
-                vm.stack_top[-arg_count - 1] = OBJ_VAL(new_instance(klass));
+                ObjClass* klass               = AS_CLASS(callee);
+                vm->stack_top[-arg_count - 1] = OBJ_VAL(new_instance(vm, klass));
 
 #ifdef OBJECT_CACHE_CLASS_INITIALIZER
                 if (!IS_NIL(klass->initializer))
-                    return call(AS_CLOSURE(klass->initializer), arg_count);
+                    return call(vm, AS_CLOSURE(klass->initializer), arg_count);
 #else
                 Value initializer;
-                if (table_find(&klass->methods, vm.init_string, &initializer))
-                    return call(AS_CLOSURE(initializer), arg_count);
+                if (find_method(klass, vm->init_string, &initializer))
+                    return call(vm, AS_CLOSURE(initializer), arg_count);
 #endif
                 if (arg_count != 0)
                 {
-                    runtime_error("Expected 0 arguments but got %d", arg_count);
+                    runtime_error(vm, "Expected 0 arguments but got %d", arg_count);
                     return false;
                 }
 
@@ -239,8 +723,8 @@ static bool call_value(Value callee, int arg_count)
             case ObjTypeBoundMethod:
             {
                 const ObjBoundMethod* bound  = AS_BOUND_METHOD(callee);
-                vm.stack_top[-arg_count - 1] = bound->recv;
-                return call(bound->method, arg_count);
+                vm->stack_top[-arg_count - 1] = bound->recv;
+                return call(vm, bound->method, arg_count);
             }
 
             default:
@@ -248,29 +732,31 @@ static bool call_value(Value callee, int arg_count)
         }
     }
 
-    runtime_error("Can call only functions and classes");
+    runtime_error(vm, "Can call only functions and classes");
     return false;
 }
 
-static bool invoke_from_class(const ObjClass*  klass,
+static bool invoke_from_class(VM* vm, const ObjClass*  klass,
                               const ObjString* name, int arg_count)
 {
     Value method;
-    if (!table_find(&klass->methods, name, &method))
+    if (!find_method(klass, name, &method))
     {
-        runtime_error("Undefined property '%s'.", name->chars);
+        runtime_error(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
 
-    return call(AS_CLOSURE(method), arg_count);
+    return call(vm, AS_CLOSURE(method), arg_count);
 }
 
-static bool invoke(const ObjString* method_name, int arg_count)
+// Inlined into both of run()'s loops, like concatenate().
+static inline __attribute__((always_inline)) bool invoke(VM* vm, const ObjString* method_name,
+                                                         int arg_count)
 {
-    const Value recv = peek(arg_count);
+    const Value recv = peek(vm, arg_count);
     if (!IS_INSTANCE(recv))
     {
-        runtime_error("Only instances have methods.");
+        runtime_error(vm, "Only instances have methods.");
         return false;
     }
 
@@ -279,17 +765,17 @@ static bool invoke(const ObjString* method_name, int arg_count)
     Value value;
     if (table_find(&instance->fields, method_name, &value))
     {
-        vm.stack_top[-arg_count - 1] = value;
-        return call_value(value, arg_count);
+        vm->stack_top[-arg_count - 1] = value;
+        return call_value(vm, value, arg_count);
     }
 
-    return invoke_from_class(instance->klass, method_name, arg_count);
+    return invoke_from_class(vm, instance->klass, method_name, arg_count);
 }
 
-static ObjUpvalue* capture_upvalue(Value* local)
+static ObjUpvalue* capture_upvalue(VM* vm, Value* local)
 {
     ObjUpvalue* prev_upvalue = NULL;
-    ObjUpvalue* upvalue      = vm.open_upvalues_head;
+    ObjUpvalue* upvalue      = vm->open_upvalues_head;
 
     while (upvalue != NULL && upvalue->location > local)
     {
@@ -300,61 +786,126 @@ static ObjUpvalue* capture_upvalue(Value* local)
     if (upvalue != NULL && upvalue->location == local)
         return upvalue;
 
-    ObjUpvalue* captured_upvalue = new_upvalue(local);
+    ObjUpvalue* captured_upvalue = new_upvalue(vm, local);
     captured_upvalue->next       = upvalue;
 
     if (prev_upvalue == NULL)
-        vm.open_upvalues_head = captured_upvalue;
+        vm->open_upvalues_head = captured_upvalue;
     else
         prev_upvalue->next = captured_upvalue;
 
     return captured_upvalue;
 }
 
-static void close_upvalues(const Value* last)
+static void close_upvalues(VM* vm, const Value* last)
 {
-    while (vm.open_upvalues_head != NULL
-           && vm.open_upvalues_head->location >= last)
+    while (vm->open_upvalues_head != NULL
+           && vm->open_upvalues_head->location >= last)
     {
-        ObjUpvalue* hoisted_upvalue = vm.open_upvalues_head;
+        ObjUpvalue* hoisted_upvalue = vm->open_upvalues_head;
         hoisted_upvalue->closed     = *hoisted_upvalue->location;
         hoisted_upvalue->location   = &hoisted_upvalue->closed;
-        vm.open_upvalues_head       = hoisted_upvalue->next;
+        vm->open_upvalues_head      = hoisted_upvalue->next;
     }
 }
 
-static void define_method(ObjString* name)
+static void define_method(VM* vm, ObjString* name)
 {
-    const Value method = peek(0);
-    ObjClass*   klass  = AS_CLASS(peek(1));
+    const Value method = peek(vm, 0);
+    ObjClass*   klass  = AS_CLASS(peek(vm, 1));
 #ifdef OBJECT_CACHE_CLASS_INITIALIZER
-    if (name == vm.init_string)
+    if (name == vm->init_string)
         klass->initializer = method;
 #endif
-    table_insert(&klass->methods, name, method);
-    pop();
+#ifdef OBJECT_METHOD_SELECTORS
+    class_define_method(vm, klass, name, method);
+#else
+    table_insert(vm, &klass->methods, name, method);
+#endif
+    pop(vm);
 }
 
-static bool bind_method(const ObjClass* klass, const ObjString* name)
+static bool bind_method(VM* vm, const ObjClass* klass, const ObjString* name)
 {
     Value method;
-    if (!table_find(&klass->methods, name, &method))
+    if (!find_method(klass, name, &method))
     {
-        runtime_error("Undefined property '%s'.", name->chars);
+        runtime_error(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
 
-    const ObjBoundMethod* bound = new_bound_method(peek(0), AS_CLOSURE(method));
-    pop();
-    push(OBJ_VAL(bound));
+    const ObjBoundMethod* bound = new_bound_method(vm, peek(vm, 0), AS_CLOSURE(method));
+    pop(vm);
+    push(vm, OBJ_VAL(bound));
     return true;
 }
 
-static InterpretResult run()
+// Writes the stack and the instruction at ip to vm->trace_execution.
+static __attribute__((noinline)) void trace_instruction(VM* vm, const CallFrame* frame,
+                                                        const uint8_t* ip)
+{
+    FILE* trace = vm->trace_execution;
+    fputs("          ", trace);
+    for (Value* slot = vm->stack; slot < vm->stack_top; slot++)
+    {
+        fputs("[ ", trace);
+        print_value(trace, *slot);
+        fputs(" ]", trace);
+    }
+    fputc('\n', trace);
+
+    const Chunk* chunk = &frame->closure->func->chunk;
+    disassemble_instruction(trace, chunk, (int)(ip - chunk->code));
+}
+
+#ifdef PERF_MAP
+static InterpretResult run_perf_mapped(VM* vm);
+
+typedef InterpretResult (*RunFn)(VM* vm);
+typedef InterpretResult (*Trampoline)(VM* vm, RunFn run);
+
+// Runs the frame a call on the main fiber just pushed on a loop of its own,
+// entered through the function's trampoline, until it returns. fiber and
+// depth are the running fiber and frame count from before the call, which
+// may as well have run a native or switched fibers. Returns false on an
+// error.
+static bool run_in_trampoline(VM* vm, const ObjFiber* fiber, int depth)
+{
+    if (vm->fiber != fiber || fiber != vm->main_fiber || vm->frame_count == depth)
+        return true;
+
+    ObjFunction* func = vm->frames[vm->frame_count - 1].closure->func;
+    if (func->trampoline == NULL)
+        func->trampoline = perf_trampoline(vm->perf_map, func);
+    if (func->trampoline == NULL)
+        return true;
+
+    const Trampoline trampoline = (Trampoline)func->trampoline;
+    return trampoline(vm, run_perf_mapped) == InterpretOk;
+}
+#endif
+
+// The dispatch loop, instantiated by run() with and without tracing, with
+// calls through perf trampolines, and for the sampler. traced, perf_mapped
+// and sampled are constants in the usual loops, so they have no checks left
+// for any of them.
+static inline __attribute__((always_inline)) InterpretResult execute(VM* vm, const bool traced,
+                                                                     const bool perf_mapped,
+                                                                     const bool sampled)
 {
-    CallFrame* frame = &vm.frames[vm.frame_count - 1];
+    CallFrame* frame = &vm->frames[vm->frame_count - 1];
+#ifdef PERF_MAP
+    // Loops entered through a trampoline return along with the frame they
+    // were entered for, see run_in_trampoline(). The first frame has
+    // nothing to return to.
+    const int exit_depth = vm->frame_count - 1;
+#else
+    (void)perf_mapped;
+#endif
 #ifdef VM_CACHE_IP
     register uint8_t* ip = frame->ip;
+#else
+    (void)sampled;
 #endif
 
 #ifdef VM_CACHE_IP
@@ -368,86 +919,117 @@ static InterpretResult run()
 #define READ_STRING()   AS_STRING(READ_CONSTANT())
 
 #ifdef VM_CACHE_IP
-#define BINARY_OP(value_type, op)                       \
-    do {                                                \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
-        {                                               \
-            frame->ip = ip;                             \
-            runtime_error("Operands must be numbers."); \
-            return InterpretRuntimeError;               \
-        }                                               \
-        const double b = AS_NUMBER(pop_and_return());   \
-        const double a = AS_NUMBER(pop_and_return());   \
-        push(value_type(a op b));                       \
-    }                                                   \
+#define BINARY_OP(value_type, op)                               \
+    do {                                                        \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) \
+        {                                                       \
+            frame->ip = ip;                                     \
+            runtime_error(vm, "Operands must be numbers.");     \
+            return InterpretRuntimeError;                       \
+        }                                                       \
+        const double b = AS_NUMBER(pop_and_return(vm));         \
+        const double a = AS_NUMBER(pop_and_return(vm));         \
+        push(vm, value_type(a op b));                           \
+    }                                                           \
     while (false)
 #else
-#define BINARY_OP(value_type, op)                       \
-    do {                                                \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
-        {                                               \
-            runtime_error("Operands must be numbers."); \
-            return InterpretRuntimeError;               \
-        }                                               \
-        const double b = AS_NUMBER(pop_and_return());   \
-        const double a = AS_NUMBER(pop_and_return());   \
-        push(value_type(a op b));                       \
-    }                                                   \
+#define BINARY_OP(value_type, op)                               \
+    do {                                                        \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) \
+        {                                                       \
+            runtime_error(vm, "Operands must be numbers.");     \
+            return InterpretRuntimeError;                       \
+        }                                                       \
+        const double b = AS_NUMBER(pop_and_return(vm));         \
+        const double a = AS_NUMBER(pop_and_return(vm));         \
+        push(vm, value_type(a op b));                           \
+    }                                                           \
     while (false)
 #endif
 
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("== execution trace ==");
+#ifdef VALUE_SMALL_INTEGERS
+// Integer operands are tried first and leave the instruction with a break.
+// Arithmetic falls through to the double path when the result overflows.
+#define INTEGER_ARITH_OP(checked_op)                                             \
+    if (IS_INTEGER(peek(vm, 0)) && IS_INTEGER(peek(vm, 1)))                      \
+    {                                                                            \
+        int32_t res;                                                             \
+        if (!checked_op(AS_INTEGER(peek(vm, 1)), AS_INTEGER(peek(vm, 0)), &res)) \
+        {                                                                        \
+            pop(vm);                                                             \
+            pop(vm);                                                             \
+            push(vm, INTEGER_VAL(res));                                          \
+            break;                                                               \
+        }                                                                        \
+    }
+#define INTEGER_COMPARE_OP(op)                                             \
+    if (IS_INTEGER(peek(vm, 0)) && IS_INTEGER(peek(vm, 1)))                \
+    {                                                                      \
+        const int32_t b = AS_INTEGER(pop_and_return(vm));                  \
+        const int32_t a = AS_INTEGER(pop_and_return(vm));                  \
+        push(vm, BOOL_VAL(a op b));                                        \
+        break;                                                             \
+    }
+#else
+#define INTEGER_ARITH_OP(checked_op)
+#define INTEGER_COMPARE_OP(op)
 #endif
 
+    if (traced)
+        fputs("== execution trace ==\n", vm->trace_execution);
+
     while (true)
     {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stack_top; slot++)
-        {
-            printf("[ ");
-            print_value(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassemble_instruction(&frame->closure->func->chunk,
-                                (int)(frame->ip - frame->closure->func->chunk.code));
+        if (traced)
+#ifdef VM_CACHE_IP
+            trace_instruction(vm, frame, ip);
+#else
+            trace_instruction(vm, frame, frame->ip);
 #endif
         const uint8_t instruction = READ_BYTE();
+#ifdef VM_CACHE_IP
+        // The sampler reads the running frame's ip too, which is otherwise
+        // only written back at calls.
+        if (sampled)
+            frame->ip = ip;
+#endif
+#ifdef PROFILE_OPCODES
+        if (vm->opcode_profile != NULL)
+            profile_instruction(vm->opcode_profile, frame->closure->func, instruction);
+#endif
         switch (instruction)
         {
             case OpConstant:
             {
                 const Value constant = READ_CONSTANT();
-                push(constant);
+                push(vm, constant);
                 break;
             }
 
             case OpNil:
-                push(NIL_VAL);
+                push(vm, NIL_VAL);
                 break;
             case OpTrue:
-                push(BOOL_VAL(true));
+                push(vm, BOOL_VAL(true));
                 break;
             case OpFalse:
-                push(BOOL_VAL(false));
+                push(vm, BOOL_VAL(false));
                 break;
 
             case OpPop:
-                pop();
+                pop(vm);
                 break;
 
             case OpReadLocal:
             {
                 const uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
+                push(vm, frame->slots[slot]);
                 break;
             }
             case OpAssignLocal:
             {
                 const uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
+                frame->slots[slot] = peek(vm, 0);
                 break;
             }
 
@@ -456,35 +1038,35 @@ static InterpretResult run()
                 const ObjString* name = READ_STRING();
 
                 Value value;
-                if (!table_find(&vm.globals, name, &value))
+                if (!table_find(&vm->globals, name, &value))
                 {
 #ifdef VM_CACHE_IP
                     frame->ip = ip;
 #endif
-                    runtime_error("Undefined variable '%s'.", name->chars);
+                    runtime_error(vm, "Undefined variable '%s'.", name->chars);
                     return InterpretRuntimeError;
                 }
 
-                push(value);
+                push(vm, value);
                 break;
             }
             case OpDefineGlobal:
             {
                 ObjString* name = READ_STRING();
-                table_insert(&vm.globals, name, peek(0));
-                pop();
+                table_insert(vm, &vm->globals, name, peek(vm, 0));
+                pop(vm);
                 break;
             }
             case OpAssignGlobal:
             {
                 ObjString* name = READ_STRING();
-                if (table_insert(&vm.globals, name, peek(0)))
+                if (table_insert(vm, &vm->globals, name, peek(vm, 0)))
                 {
-                    table_remove(&vm.globals, name);
+                    table_remove(&vm->globals, name);
 #ifdef VM_CACHE_IP
                     frame->ip = ip;
 #endif
-                    runtime_error("Undefined variable '%s'.", name->chars);
+                    runtime_error(vm, "Undefined variable '%s'.", name->chars);
                     return InterpretRuntimeError;
                 }
                 break;
@@ -492,61 +1074,76 @@ static InterpretResult run()
             case OpReadUpvalue:
             {
                 const uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
+#ifdef COMPILER_CAPTURE_BY_VALUE
+                const Value captured = frame->closure->upvalues[slot];
+                push(vm, IS_UPVALUE(captured) ? *AS_UPVALUE(captured)->location : captured);
+#else
+                push(vm, *frame->closure->upvalues[slot]->location);
+#endif
                 break;
             }
             case OpAssignUpvalue:
             {
-                const uint8_t slot                        = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                const uint8_t slot = READ_BYTE();
+#ifdef COMPILER_CAPTURE_BY_VALUE
+                *AS_UPVALUE(frame->closure->upvalues[slot])->location = peek(vm, 0);
+#else
+                *frame->closure->upvalues[slot]->location = peek(vm, 0);
+#endif
                 break;
             }
 
             case OpSetField:
             {
-                if (!IS_INSTANCE(peek(1)))
+                if (!IS_INSTANCE(peek(vm, 1)))
                 {
 #ifdef VM_CACHE_IP
                     frame->ip = ip;
 #endif
-                    runtime_error("Only instances have properties.");
+                    runtime_error(vm, "Only instances have properties.");
                     return InterpretRuntimeError;
                 }
 
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                table_insert(&instance->fields, READ_STRING(), peek(0));
+                ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
+#ifdef TABLE_SMALL_LINEAR
+                if (table_insert(vm, &instance->fields, READ_STRING(), peek(vm, 0))
+                    && instance->fields.count > instance->klass->field_count)
+                    instance->klass->field_count = instance->fields.count;
+#else
+                table_insert(vm, &instance->fields, READ_STRING(), peek(vm, 0));
+#endif
 
-                const Value value = pop_and_return();
-                pop();
-                push(value);
+                const Value value = pop_and_return(vm);
+                pop(vm);
+                push(vm, value);
                 break;
             }
 
             case OpGetProperty:
             {
-                if (!IS_INSTANCE(peek(0)))
+                if (!IS_INSTANCE(peek(vm, 0)))
                 {
 #ifdef VM_CACHE_IP
                     frame->ip = ip;
 #endif
-                    runtime_error("Only instances have properties.");
+                    runtime_error(vm, "Only instances have properties.");
                     return InterpretRuntimeError;
                 }
 
-                const ObjInstance* instance = AS_INSTANCE(peek(0));
+                const ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
                 const ObjString*   name     = READ_STRING();
 
                 Value value;
                 if (table_find(&instance->fields, name, &value))
                 {
-                    pop();
-                    push(value);
+                    pop(vm);
+                    push(vm, value);
                     break;
                 }
 #ifdef VM_CACHE_IP
                 frame->ip = ip;
 #endif
-                if (!bind_method(instance->klass, name))
+                if (!bind_method(vm, instance->klass, name))
                     return InterpretRuntimeError;
 
                 break;
@@ -555,11 +1152,11 @@ static InterpretResult run()
             case OpGetSuper:
             {
                 const ObjString* name       = READ_STRING();
-                const ObjClass*  superclass = AS_CLASS(pop_and_return());
+                const ObjClass*  superclass = AS_CLASS(pop_and_return(vm));
 #ifdef VM_CACHE_IP
                 frame->ip = ip;
 #endif
-                if (!bind_method(superclass, name))
+                if (!bind_method(vm, superclass, name))
                     return InterpretRuntimeError;
 
                 break;
@@ -567,42 +1164,54 @@ static InterpretResult run()
 
             case OpEqual:
             {
-                const Value b = pop_and_return();
-                const Value a = pop_and_return();
-                push(BOOL_VAL(values_equal(a, b)));
+                const Value b = pop_and_return(vm);
+                const Value a = pop_and_return(vm);
+                push(vm, BOOL_VAL(values_equal(a, b)));
                 break;
             }
             case OpGreater:
+                INTEGER_COMPARE_OP(>);
                 BINARY_OP(BOOL_VAL, >);
                 break;
             case OpLess:
+                INTEGER_COMPARE_OP(<);
                 BINARY_OP(BOOL_VAL, <);
                 break;
 
             case OpAdd:
             {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-                    concatenate();
-                else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+                INTEGER_ARITH_OP(__builtin_add_overflow);
+                if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1)))
+                {
+                    // Instructions which allocate save ip, so that the
+                    // allocation profile can tell their line.
+#ifdef VM_CACHE_IP
+                    frame->ip = ip;
+#endif
+                    concatenate(vm);
+                }
+                else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1)))
                 {
-                    const double b = AS_NUMBER(pop_and_return());
-                    const double a = AS_NUMBER(pop_and_return());
-                    push(NUMBER_VAL(a + b));
+                    const double b = AS_NUMBER(pop_and_return(vm));
+                    const double a = AS_NUMBER(pop_and_return(vm));
+                    push(vm, NUMBER_VAL(a + b));
                 }
                 else
                 {
 #ifdef VM_CACHE_IP
                     frame->ip = ip;
 #endif
-                    runtime_error("Operands must be two numbers or two strings.");
+                    runtime_error(vm, "Operands must be two numbers or two strings.");
                     return InterpretRuntimeError;
                 }
                 break;
             }
             case OpSubtract:
+                INTEGER_ARITH_OP(__builtin_sub_overflow);
                 BINARY_OP(NUMBER_VAL, -);
                 break;
             case OpMultiply:
+                INTEGER_ARITH_OP(multiply_overflow);
                 BINARY_OP(NUMBER_VAL, *);
                 break;
             case OpDivide:
@@ -610,24 +1219,33 @@ static InterpretResult run()
                 break;
 
             case OpNot:
-                push(BOOL_VAL(is_falsey(pop_and_return())));
+                push(vm, BOOL_VAL(is_falsey(pop_and_return(vm))));
                 break;
 
             case OpNegate:
-                if (!IS_NUMBER(peek(0)))
+                if (!IS_NUMBER(peek(vm, 0)))
                 {
 #ifdef VM_CACHE_IP
                     frame->ip = ip;
 #endif
-                    runtime_error("Operand must be a number");
+                    runtime_error(vm, "Operand must be a number");
                     return InterpretRuntimeError;
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop_and_return())));
+#ifdef VALUE_SMALL_INTEGERS
+                // -0 and -INT32_MIN only exist as doubles.
+                if (IS_INTEGER(peek(vm, 0)) && AS_INTEGER(peek(vm, 0)) != 0
+                    && AS_INTEGER(peek(vm, 0)) != INT32_MIN)
+                {
+                    push(vm, INTEGER_VAL(-AS_INTEGER(pop_and_return(vm))));
+                    break;
+                }
+#endif
+                push(vm, NUMBER_VAL(-AS_NUMBER(pop_and_return(vm))));
                 break;
 
             case OpPrint:
-                print_value(pop_and_return());
-                printf("\n");
+                print_value(vm->out, pop_and_return(vm));
+                fputc('\n', vm->out);
                 break;
 
             case OpJump:
@@ -644,7 +1262,7 @@ static InterpretResult run()
             case OpJumpIfFalse:
             {
                 const uint16_t offset = READ_SHORT();
-                if (is_falsey(peek(0)))
+                if (is_falsey(peek(vm, 0)))
 #ifdef VM_CACHE_IP
                     ip += offset;
 #else
@@ -669,9 +1287,17 @@ static InterpretResult run()
 #ifdef VM_CACHE_IP
                 frame->ip = ip;
 #endif
-                if (!call_value(peek(arg_count), arg_count))
+#ifdef PERF_MAP
+                const ObjFiber* caller_fiber = vm->fiber;
+                const int       caller_depth = vm->frame_count;
+#endif
+                if (!call_value(vm, peek(vm, arg_count), arg_count))
                     return InterpretRuntimeError;
-                frame = &vm.frames[vm.frame_count - 1];
+#ifdef PERF_MAP
+                if (perf_mapped && !run_in_trampoline(vm, caller_fiber, caller_depth))
+                    return InterpretRuntimeError;
+#endif
+                frame = &vm->frames[vm->frame_count - 1];
 #ifdef VM_CACHE_IP
                 ip = frame->ip;
 #endif
@@ -684,10 +1310,18 @@ static InterpretResult run()
 #ifdef VM_CACHE_IP
                 frame->ip = ip;
 #endif
-                if (!invoke(method, arg_count))
+#ifdef PERF_MAP
+                const ObjFiber* caller_fiber = vm->fiber;
+                const int       caller_depth = vm->frame_count;
+#endif
+                if (!invoke(vm, method, arg_count))
+                    return InterpretRuntimeError;
+#ifdef PERF_MAP
+                if (perf_mapped && !run_in_trampoline(vm, caller_fiber, caller_depth))
                     return InterpretRuntimeError;
+#endif
 
-                frame = &vm.frames[vm.frame_count - 1];
+                frame = &vm->frames[vm->frame_count - 1];
 #ifdef VM_CACHE_IP
                 ip = frame->ip;
 #endif
@@ -697,14 +1331,42 @@ static InterpretResult run()
             {
                 const ObjString* method     = READ_STRING();
                 const int        arg_count  = READ_BYTE();
-                const ObjClass*  superclass = AS_CLASS(pop_and_return());
+#ifdef OBJECT_CACHE_SUPER_CALLS
+                SuperCallCache* cache = &frame->closure->func->super_caches[READ_BYTE()];
+#endif
+                const ObjClass* superclass = AS_CLASS(pop_and_return(vm));
 #ifdef VM_CACHE_IP
                 frame->ip = ip;
 #endif
-                if (!invoke_from_class(superclass, method, arg_count))
+#ifdef PERF_MAP
+                const ObjFiber* caller_fiber = vm->fiber;
+                const int       caller_depth = vm->frame_count;
+#endif
+#ifdef OBJECT_CACHE_SUPER_CALLS
+                if (cache->superclass != superclass)
+                {
+                    Value resolved;
+                    if (!find_method(superclass, method, &resolved))
+                    {
+                        runtime_error(vm, "Undefined property '%s'.", method->chars);
+                        return InterpretRuntimeError;
+                    }
+                    cache->superclass = superclass;
+                    cache->method     = AS_CLOSURE(resolved);
+                }
+
+                if (!call(vm, cache->method, arg_count))
+                    return InterpretRuntimeError;
+#else
+                if (!invoke_from_class(vm, superclass, method, arg_count))
+                    return InterpretRuntimeError;
+#endif
+#ifdef PERF_MAP
+                if (perf_mapped && !run_in_trampoline(vm, caller_fiber, caller_depth))
                     return InterpretRuntimeError;
+#endif
 
-                frame = &vm.frames[vm.frame_count - 1];
+                frame = &vm->frames[vm->frame_count - 1];
 #ifdef VM_CACHE_IP
                 ip = frame->ip;
 #endif
@@ -713,39 +1375,91 @@ static InterpretResult run()
 
             case OpClosure:
             {
-                ObjFunction*      func    = AS_FUNCTION(READ_CONSTANT());
-                const ObjClosure* closure = new_closure(func);
-                push(OBJ_VAL(closure));
+                ObjFunction* func = AS_FUNCTION(READ_CONSTANT());
+#ifdef VM_CACHE_IP
+                frame->ip = ip;
+#endif
+                ObjClosure* closure = new_closure(vm, func);
+                push(vm, OBJ_VAL(closure));
                 for (int i = 0; i < closure->upvalue_count; i++)
                 {
+#ifdef COMPILER_CAPTURE_BY_VALUE
+                    const uint8_t capture = READ_BYTE();
+                    const uint8_t index   = READ_BYTE();
+                    switch (capture)
+                    {
+                        case CaptureLocal:
+                            closure->upvalues[i] = OBJ_VAL(capture_upvalue(vm, frame->slots + index));
+                            break;
+                        case CaptureLocalValue:
+                            closure->upvalues[i] = frame->slots[index];
+                            break;
+                        default:
+                            closure->upvalues[i] = frame->closure->upvalues[index];
+                            break;
+                    }
+#else
                     const uint8_t is_local = READ_BYTE();
                     const uint8_t index    = READ_BYTE();
-                    closure->upvalues[i]   = (is_local) ? capture_upvalue(frame->slots + index)
+                    closure->upvalues[i]   = (is_local) ? capture_upvalue(vm, frame->slots + index)
                                                         : frame->closure->upvalues[index];
+#endif
                 }
                 break;
             }
 
             case OpCloseUpvalue:
-                close_upvalues(vm.stack_top - 1);
-                pop();
+                close_upvalues(vm, vm->stack_top - 1);
+                pop(vm);
                 break;
 
             case OpReturn:
             {
-                const Value result = pop_and_return();
+                const Value result = pop_and_return(vm);
 
-                close_upvalues(frame->slots);
-                vm.frame_count--;
-                if (vm.frame_count == 0)
+                close_upvalues(vm, frame->slots);
+#ifdef USDT_PROBES
+                if (CLOCKS_PROBE_ENABLED(function__return))
+                    CLOCKS_FUNCTION_RETURN(probe_name(frame->closure->func),
+                                           probe_line(frame->closure->func), vm->frame_count);
+#endif
+                vm->frame_count--;
+                if (vm->frame_count == 0)
                 {
-                    pop();
-                    return InterpretOk;
+                    ObjFiber* fiber = vm->fiber;
+                    if (fiber->caller == NULL)
+                    {
+                        vm->stack_top = frame->slots;
+                        push(vm, result);
+                        return InterpretOk;
+                    }
+
+                    // A finished fiber completes the resume call in its caller,
+                    // or lets the event loop run the next one.
+                    ObjFiber* caller = fiber->caller;
+                    vm->stack_top    = vm->stack;
+                    fiber->caller    = NULL;
+                    fiber->state     = FiberDone;
+#ifdef __linux__
+                    if (fiber->scheduled)
+                        loop_fiber_done(vm);
+                    else
+#endif
+                        vm_transfer(vm, caller, result);
+                    frame = &vm->frames[vm->frame_count - 1];
+#ifdef VM_CACHE_IP
+                    ip = frame->ip;
+#endif
+                    break;
                 }
 
-                vm.stack_top = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frame_count - 1];
+                vm->stack_top = frame->slots;
+                push(vm, result);
+#ifdef PERF_MAP
+                if (perf_mapped && vm->frame_count == exit_depth && vm->fiber == vm->main_fiber)
+                    return InterpretOk;
+#endif
+                frame = &vm->frames[vm->frame_count - 1];
 #ifdef VM_CACHE_IP
                 ip = frame->ip;
 #endif
@@ -754,26 +1468,39 @@ static InterpretResult run()
 
             case OpInherit:
             {
-                const Value superclass = peek(1);
+                const Value superclass = peek(vm, 1);
                 if (!IS_CLASS(superclass))
                 {
 #ifdef VM_CACHE_IP
                     frame->ip = ip;
 #endif
-                    runtime_error("Superclass must be a class.");
+                    runtime_error(vm, "Superclass must be a class.");
                     return InterpretRuntimeError;
                 }
 
-                ObjClass* subclass = AS_CLASS(peek(0));
-                table_copy(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop();
+                ObjClass* subclass = AS_CLASS(peek(vm, 0));
+#ifdef OBJECT_METHOD_SELECTORS
+                class_inherit(vm, subclass, AS_CLASS(superclass));
+#else
+                table_copy(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
+#endif
+#ifdef OBJECT_CACHE_CLASS_INITIALIZER
+                subclass->initializer = AS_CLASS(superclass)->initializer;
+#endif
+                pop(vm);
                 break;
             }
             case OpClass:
-                push(OBJ_VAL(new_class(READ_STRING())));
+            {
+                ObjString* name = READ_STRING();
+#ifdef VM_CACHE_IP
+                frame->ip = ip;
+#endif
+                push(vm, OBJ_VAL(new_class(vm, name)));
                 break;
+            }
             case OpMethod:
-                define_method(READ_STRING());
+                define_method(vm, READ_STRING());
                 break;
 
             default:
@@ -788,18 +1515,81 @@ static InterpretResult run()
 #undef BINARY_OP
 }
 
-InterpretResult interpret(const char* source)
+static __attribute__((noinline)) InterpretResult run_untraced(VM* vm)
+{
+    return execute(vm, false, false, false);
+}
+
+// Stores ip at every instruction for the sampler. Unlike the loops below it
+// isn't cold, so that it runs the script as fast as the one above, and the
+// samples show where the time usually goes.
+static __attribute__((noinline)) InterpretResult run_sampled(VM* vm)
+{
+    return execute(vm, vm->trace_execution != NULL, false, true);
+}
+
+// Tracing is slow anyway, so its loop is kept away from the hot code.
+static __attribute__((noinline, cold)) InterpretResult run_traced(VM* vm)
+{
+    return execute(vm, true, false, false);
+}
+
+#ifdef PERF_MAP
+// So is a loop entered once per call, which traces as asked rather than
+// being instantiated once more.
+static __attribute__((noinline, cold)) InterpretResult run_perf_mapped(VM* vm)
 {
-    ObjFunction* compiled_source = compile(source);
+    return execute(vm, vm->trace_execution != NULL, true, vm->sampler != NULL);
+}
+#endif
+
+static InterpretResult run(VM* vm)
+{
+#ifdef PERF_MAP
+    if (vm->perf_map != NULL)
+        return run_perf_mapped(vm);
+#endif
+    if (vm->sampler != NULL)
+        return run_sampled(vm);
+    return vm->trace_execution != NULL ? run_traced(vm) : run_untraced(vm);
+}
+
+InterpretResult vm_interpret(VM* vm, const char* source)
+{
+    ObjFunction* compiled_source = compile(vm, source);
     if (compiled_source == NULL)
         return InterpretCompileError;
 
-    push(OBJ_VAL(compiled_source));
-    ObjClosure* top_level_closure = new_closure(compiled_source);
-    pop();
-    push(OBJ_VAL(top_level_closure));
+    push(vm, OBJ_VAL(compiled_source));
+    ObjClosure* top_level_closure = new_closure(vm, compiled_source);
+    pop(vm);
+    push(vm, OBJ_VAL(top_level_closure));
 
-    call(top_level_closure, 0);
+    call(vm, top_level_closure, 0);
+
+    const InterpretResult result = run(vm);
+    if (result == InterpretOk)
+        pop(vm);
+    return result;
+}
+
+InterpretResult vm_call(VM* vm, Value callee, int arg_count, const Value* args,
+                        Value* out_result)
+{
+    push(vm, callee);
+    for (int i = 0; i < arg_count; i++)
+        push(vm, args[i]);
+
+    if (!call_value(vm, callee, arg_count))
+        return InterpretRuntimeError;
+
+    if (vm->frame_count > 0)
+    {
+        const InterpretResult result = run(vm);
+        if (result != InterpretOk)
+            return result;
+    }
 
-    return run();
+    *out_result = pop_and_return(vm);
+    return InterpretOk;
 }
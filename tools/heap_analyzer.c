@@ -0,0 +1,631 @@
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Reads a heap snapshot written by write_heap_snapshot(), finds the
+// immediate dominator of every object, that is the object every path from
+// the roots to it goes through last, and from them the bytes each object
+// retains, which would be freed along with it. Objects are then grouped by
+// class for instances, and by type otherwise.
+
+#define LABEL_MAX 64
+
+// A node's label is its type followed by a name, and both are cut short
+// to fit it whole.
+#define TYPE_NAME_MAX  16
+#define LABEL_NAME_MAX (LABEL_MAX - TYPE_NAME_MAX)
+
+typedef struct
+{
+    uint64_t id;
+    size_t   size;
+    char     label[LABEL_MAX];
+    int      group;
+
+    // Indices into Graph.edges of the objects this one refers to.
+    size_t first_ref;
+    size_t ref_count;
+} Node;
+
+// Node 0 stands for the roots, and refers to every one of them.
+typedef struct
+{
+    Node*  nodes;
+    int    count;
+    int    capacity;
+    int*   edges;
+    size_t edge_count;
+    size_t edge_capacity;
+
+    // The ids the edges refer to until they are resolved to indices.
+    uint64_t* edge_ids;
+
+    char** groups;
+    int    group_count;
+} Graph;
+
+static void* grow_or_exit(void* pointer, size_t size)
+{
+    void* result = realloc(pointer, size);
+    if (result == NULL)
+    {
+        fprintf(stderr, "Not enough memory.\n");
+        exit(74);
+    }
+    return result;
+}
+
+static int find_group(Graph* graph, const char* label)
+{
+    for (int i = 0; i < graph->group_count; i++)
+    {
+        if (strcmp(graph->groups[i], label) == 0)
+            return i;
+    }
+
+    graph->groups = (char**)grow_or_exit(graph->groups,
+                                         sizeof(char*) * (graph->group_count + 1));
+    graph->groups[graph->group_count] = strdup(label);
+    return graph->group_count++;
+}
+
+static Node* add_node(Graph* graph, uint64_t id)
+{
+    if (graph->count == graph->capacity)
+    {
+        graph->capacity = graph->capacity < 8 ? 8 : graph->capacity * 2;
+        graph->nodes    = (Node*)grow_or_exit(graph->nodes, sizeof(Node) * graph->capacity);
+    }
+
+    Node* node = &graph->nodes[graph->count++];
+    memset(node, 0, sizeof(Node));
+    node->id        = id;
+    node->first_ref = graph->edge_count;
+    return node;
+}
+
+// Adds the ids listed from the character after '[' on to the last node.
+static void add_refs(Graph* graph, const char* list)
+{
+    Node* node = &graph->nodes[graph->count - 1];
+    char* end  = NULL;
+    while (*list != ']' && *list != '\0')
+    {
+        const uint64_t id = strtoull(list, &end, 10);
+        if (end == list)
+            break;
+
+        if (graph->edge_count == graph->edge_capacity)
+        {
+            graph->edge_capacity = graph->edge_capacity < 8 ? 8 : graph->edge_capacity * 2;
+            graph->edge_ids      = (uint64_t*)grow_or_exit(
+                graph->edge_ids, sizeof(uint64_t) * graph->edge_capacity);
+        }
+        graph->edge_ids[graph->edge_count++] = id;
+        node->ref_count++;
+
+        list = end;
+        while (*list == ',' || *list == ' ')
+            list++;
+    }
+}
+
+static const char* field(const char* line, const char* name)
+{
+    const char* found = strstr(line, name);
+    return found != NULL ? found + strlen(name) : NULL;
+}
+
+static void copy_label(char* label, int size, const char* quoted)
+{
+    int length = 0;
+    while (quoted[length] != '"' && quoted[length] != '\0' && length < size - 1)
+        length++;
+    memcpy(label, quoted, length);
+    label[length] = '\0';
+}
+
+static void parse_object(Graph* graph, const char* line)
+{
+    const char* id   = field(line, "\"id\": ");
+    const char* type = field(line, "\"type\": \"");
+    const char* size = field(line, "\"size\": ");
+    const char* refs = field(line, "\"refs\": [");
+    if (id == NULL || type == NULL || size == NULL || refs == NULL)
+        return;
+
+    Node* node = add_node(graph, strtoull(id, NULL, 10));
+    node->size = strtoull(size, NULL, 10);
+
+    // Instances are grouped by class, and other objects by type, with the
+    // name of the function or class they are, if any, as their label.
+    char type_name[TYPE_NAME_MAX];
+    copy_label(type_name, TYPE_NAME_MAX, type);
+
+    const char* klass = field(line, "\"class\": \"");
+    const char* name  = field(line, "\"name\": \"");
+    char        label[LABEL_NAME_MAX];
+    if (klass != NULL)
+    {
+        copy_label(label, LABEL_NAME_MAX, klass);
+        node->group = find_group(graph, label);
+        snprintf(node->label, LABEL_MAX, "%s instance", label);
+    }
+    else
+    {
+        node->group = find_group(graph, type_name);
+        if (name != NULL)
+        {
+            copy_label(label, LABEL_NAME_MAX, name);
+            snprintf(node->label, LABEL_MAX, "%s %s", type_name, label);
+        }
+        else
+            snprintf(node->label, LABEL_MAX, "%s", type_name);
+    }
+
+    add_refs(graph, refs);
+}
+
+static bool read_snapshot(Graph* graph, FILE* in)
+{
+    Node* roots     = add_node(graph, 0);
+    roots->group    = find_group(graph, "(roots)");
+    bool  has_roots = false;
+    snprintf(roots->label, LABEL_MAX, "(roots)");
+
+    char*  line     = NULL;
+    size_t capacity = 0;
+    while (getline(&line, &capacity, in) != -1)
+    {
+        if (strncmp(line, "\"roots\": [", 10) == 0)
+        {
+            // The roots come first, so node 0 is still the last one.
+            add_refs(graph, line + 10);
+            has_roots = true;
+        }
+        else if (strncmp(line, "{\"id\": ", 7) == 0)
+            parse_object(graph, line);
+    }
+    free(line);
+    return has_roots;
+}
+
+static uint64_t hash_id(uint64_t id)
+{
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdull;
+    id ^= id >> 33;
+    return id;
+}
+
+// Replaces the ids of the edges by the indices of the nodes, dropping any
+// edge to an object missing from the snapshot.
+static void resolve_edges(Graph* graph)
+{
+    size_t capacity = 16;
+    while (capacity < (size_t)graph->count * 2)
+        capacity *= 2;
+
+    int* slots = (int*)grow_or_exit(NULL, sizeof(int) * capacity);
+    for (size_t i = 0; i < capacity; i++)
+        slots[i] = -1;
+
+    for (int i = 1; i < graph->count; i++)
+    {
+        size_t slot = hash_id(graph->nodes[i].id) & (capacity - 1);
+        while (slots[slot] != -1)
+            slot = (slot + 1) & (capacity - 1);
+        slots[slot] = i;
+    }
+
+    graph->edges = (int*)grow_or_exit(NULL, sizeof(int) * (graph->edge_count + 1));
+    for (int i = 0; i < graph->count; i++)
+    {
+        Node*        node  = &graph->nodes[i];
+        const size_t first = node->first_ref;
+        size_t       kept  = 0;
+        for (size_t e = first; e < first + node->ref_count; e++)
+        {
+            size_t slot = hash_id(graph->edge_ids[e]) & (capacity - 1);
+            while (slots[slot] != -1 && graph->nodes[slots[slot]].id != graph->edge_ids[e])
+                slot = (slot + 1) & (capacity - 1);
+            if (slots[slot] != -1)
+                graph->edges[first + kept++] = slots[slot];
+        }
+        node->ref_count = kept;
+    }
+
+    free(slots);
+    free(graph->edge_ids);
+    graph->edge_ids = NULL;
+}
+
+// Numbers the nodes reachable from node 0 in depth first preorder, and
+// returns how many there are. order lists them by number, and parent gives
+// the number of the node each was reached from.
+static int number_nodes(const Graph* graph, int* number, int* order, int* parent)
+{
+    int*    stack = (int*)grow_or_exit(NULL, sizeof(int) * graph->count);
+    size_t* next  = (size_t*)grow_or_exit(NULL, sizeof(size_t) * graph->count);
+    for (int i = 0; i < graph->count; i++)
+        number[i] = -1;
+
+    int count = 0;
+    int depth = 0;
+    stack[depth++] = 0;
+    next[0]        = 0;
+    number[0]      = count;
+    parent[0]      = 0;
+    order[count++] = 0;
+    while (depth > 0)
+    {
+        const int   top  = stack[depth - 1];
+        const Node* node = &graph->nodes[top];
+        if (next[top] == node->ref_count)
+        {
+            depth--;
+            continue;
+        }
+
+        const int child = graph->edges[node->first_ref + next[top]++];
+        if (number[child] == -1)
+        {
+            number[child]  = count;
+            parent[count]  = number[top];
+            order[count++] = child;
+            next[child]    = 0;
+            stack[depth++] = child;
+        }
+    }
+
+    free(stack);
+    free(next);
+    return count;
+}
+
+// Returns the node with the least semidominator on the path to v in the
+// forest linked so far, compressing the path on the way. Everything is by
+// number. Paths can be as long as the heap is deep, so there's no
+// recursion.
+static int evaluate(int* ancestor, int* label, const int* semi, int* path, int v)
+{
+    if (ancestor[v] == -1)
+        return v;
+
+    int length = 0;
+    for (int u = v; ancestor[ancestor[u]] != -1; u = ancestor[u])
+        path[length++] = u;
+
+    while (length-- > 0)
+    {
+        const int u = path[length];
+        if (semi[label[ancestor[u]]] < semi[label[u]])
+            label[u] = label[ancestor[u]];
+        ancestor[u] = ancestor[ancestor[u]];
+    }
+    return label[v];
+}
+
+// Lengauer and Tarjan's algorithm with path compression. idom is by node,
+// and gives the node which immediately dominates each, with node 0
+// dominating itself.
+static void find_dominators(const Graph* graph, const int* number, const int* order,
+                            const int* parent, int count, int* idom)
+{
+    // The predecessors of each node, by number.
+    int* first_pred = (int*)calloc(count + 1, sizeof(int));
+    int* preds      = (int*)grow_or_exit(NULL, sizeof(int) * (graph->edge_count + 1));
+    int* filled     = (int*)calloc(count, sizeof(int));
+    if (first_pred == NULL || filled == NULL)
+        exit(74);
+
+    for (int v = 0; v < count; v++)
+    {
+        const Node* node = &graph->nodes[order[v]];
+        for (size_t e = 0; e < node->ref_count; e++)
+            first_pred[number[graph->edges[node->first_ref + e]] + 1]++;
+    }
+    for (int v = 0; v < count; v++)
+        first_pred[v + 1] += first_pred[v];
+    for (int v = 0; v < count; v++)
+    {
+        const Node* node = &graph->nodes[order[v]];
+        for (size_t e = 0; e < node->ref_count; e++)
+        {
+            const int w                        = number[graph->edges[node->first_ref + e]];
+            preds[first_pred[w] + filled[w]++] = v;
+        }
+    }
+
+    int* semi     = (int*)grow_or_exit(NULL, sizeof(int) * count);
+    int* dom      = (int*)grow_or_exit(NULL, sizeof(int) * count);
+    int* ancestor = (int*)grow_or_exit(NULL, sizeof(int) * count);
+    int* label    = (int*)grow_or_exit(NULL, sizeof(int) * count);
+    int* path     = (int*)grow_or_exit(NULL, sizeof(int) * count);
+    // The nodes each node is the semidominator of, as linked lists.
+    int* bucket      = (int*)grow_or_exit(NULL, sizeof(int) * count);
+    int* next_bucket = (int*)grow_or_exit(NULL, sizeof(int) * count);
+    for (int v = 0; v < count; v++)
+    {
+        semi[v]     = v;
+        dom[v]      = 0;
+        ancestor[v] = -1;
+        label[v]    = v;
+        bucket[v]   = -1;
+    }
+
+    for (int w = count - 1; w > 0; w--)
+    {
+        for (int p = first_pred[w]; p < first_pred[w + 1]; p++)
+        {
+            const int u = evaluate(ancestor, label, semi, path, preds[p]);
+            if (semi[u] < semi[w])
+                semi[w] = semi[u];
+        }
+        next_bucket[w]     = bucket[semi[w]];
+        bucket[semi[w]]    = w;
+        ancestor[w]        = parent[w];
+
+        for (int v = bucket[parent[w]]; v != -1; v = next_bucket[v])
+        {
+            const int u = evaluate(ancestor, label, semi, path, v);
+            dom[v]      = semi[u] < semi[v] ? u : parent[w];
+        }
+        bucket[parent[w]] = -1;
+    }
+
+    for (int w = 1; w < count; w++)
+    {
+        if (dom[w] != semi[w])
+            dom[w] = dom[dom[w]];
+    }
+
+    for (int i = 0; i < graph->count; i++)
+        idom[i] = -1;
+    for (int w = 0; w < count; w++)
+        idom[order[w]] = order[dom[w]];
+
+    free(first_pred);
+    free(preds);
+    free(filled);
+    free(semi);
+    free(dom);
+    free(ancestor);
+    free(label);
+    free(path);
+    free(bucket);
+    free(next_bucket);
+}
+
+typedef struct
+{
+    int    objects;
+    size_t shallow;
+    size_t retained;
+    // The bytes of the group retained by objects of each other group.
+    size_t* dominated_by;
+} GroupStats;
+
+static int compare_groups_by_retained(const void* a, const void* b, void* stats)
+{
+    const size_t x = ((const GroupStats*)stats)[*(const int*)a].retained;
+    const size_t y = ((const GroupStats*)stats)[*(const int*)b].retained;
+    return (x < y) - (x > y);
+}
+
+static int compare_nodes_by_retained(const void* a, const void* b, void* retained)
+{
+    const size_t x = ((const size_t*)retained)[*(const int*)a];
+    const size_t y = ((const size_t*)retained)[*(const int*)b];
+    return (x < y) - (x > y);
+}
+
+// An object of a group only adds to the group's retained bytes if no other
+// object of the group dominates it, which would already count its bytes.
+// active counts the objects of each group on the dominator tree path.
+static void sum_groups(const Graph* graph, const int* idom, const int* order, int count,
+                       const size_t* retained, GroupStats* stats)
+{
+    int*    first_child = (int*)calloc(graph->count + 1, sizeof(int));
+    int*    children    = (int*)grow_or_exit(NULL, sizeof(int) * (graph->count + 1));
+    int*    active      = (int*)calloc(graph->group_count, sizeof(int));
+    int*    stack       = (int*)grow_or_exit(NULL, sizeof(int) * (graph->count + 1));
+    bool*   entered     = (bool*)calloc(graph->count, sizeof(bool));
+    int*    filled      = (int*)calloc(graph->count, sizeof(int));
+    if (first_child == NULL || active == NULL || entered == NULL || filled == NULL)
+        exit(74);
+
+    for (int k = 0; k < count; k++)
+    {
+        const int node = order[k];
+        if (node != 0)
+            first_child[idom[node] + 1]++;
+    }
+    for (int i = 0; i < graph->count; i++)
+        first_child[i + 1] += first_child[i];
+    for (int k = 0; k < count; k++)
+    {
+        const int node = order[k];
+        if (node != 0)
+            children[first_child[idom[node]] + filled[idom[node]]++] = node;
+    }
+
+    int depth      = 0;
+    stack[depth++] = 0;
+    while (depth > 0)
+    {
+        const int node  = stack[depth - 1];
+        const int group = graph->nodes[node].group;
+        if (entered[node])
+        {
+            active[group]--;
+            depth--;
+            continue;
+        }
+        entered[node] = true;
+
+        GroupStats* group_stats = &stats[group];
+        group_stats->objects++;
+        group_stats->shallow += graph->nodes[node].size;
+        if (active[group] == 0)
+        {
+            group_stats->retained += retained[node];
+            if (node != 0)
+                group_stats->dominated_by[graph->nodes[idom[node]].group] += retained[node];
+        }
+        active[group]++;
+
+        for (int c = first_child[node]; c < first_child[node + 1]; c++)
+            stack[depth++] = children[c];
+    }
+
+    free(first_child);
+    free(children);
+    free(active);
+    free(stack);
+    free(entered);
+    free(filled);
+}
+
+static void print_groups(const Graph* graph, const GroupStats* stats, size_t total, int top)
+{
+    int* groups = (int*)grow_or_exit(NULL, sizeof(int) * graph->group_count);
+    for (int i = 0; i < graph->group_count; i++)
+        groups[i] = i;
+    qsort_r(groups, graph->group_count, sizeof(int), compare_groups_by_retained, (void*)stats);
+
+    printf("== by class or type ==\n");
+    printf("%-24s %10s %12s %12s %7s  %s\n", "group", "objects", "shallow", "retained", "",
+           "mostly retained by");
+    for (int i = 0, shown = 0; i < graph->group_count && shown < top; i++)
+    {
+        const int         group = groups[i];
+        const GroupStats* entry = &stats[group];
+        if (group == graph->nodes[0].group)
+            continue;
+
+        int dominator = -1;
+        for (int g = 0; g < graph->group_count; g++)
+        {
+            if (entry->dominated_by[g] > 0
+                && (dominator == -1 || entry->dominated_by[g] > entry->dominated_by[dominator]))
+                dominator = g;
+        }
+
+        printf("%-24s %10d %12zu %12zu %6.2f%%  %s\n", graph->groups[group], entry->objects,
+               entry->shallow, entry->retained,
+               total > 0 ? 100.0 * (double)entry->retained / (double)total : 0,
+               dominator != -1 ? graph->groups[dominator] : "-");
+        shown++;
+    }
+    free(groups);
+}
+
+static void print_objects(const Graph* graph, const int* idom, const int* order, int count,
+                          const size_t* retained, int top)
+{
+    int* nodes = (int*)grow_or_exit(NULL, sizeof(int) * count);
+    memcpy(nodes, order, sizeof(int) * count);
+    qsort_r(nodes, count, sizeof(int), compare_nodes_by_retained, (void*)retained);
+
+    printf("== objects retaining the most ==\n");
+    printf("%-18s %-32s %12s  %s\n", "id", "object", "retained", "dominator");
+    for (int i = 0, shown = 0; i < count && shown < top; i++)
+    {
+        const int node = nodes[i];
+        if (node == 0)
+            continue;
+
+        printf("%-18" PRIu64 " %-32s %12zu  %s\n", graph->nodes[node].id,
+               graph->nodes[node].label, retained[node], graph->nodes[idom[node]].label);
+        shown++;
+    }
+    free(nodes);
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: clocks_heap_analyzer [-n top] snapshot.json\n");
+    exit(64);
+}
+
+int main(int argc, const char* argv[])
+{
+    int top = 20;
+    int arg = 1;
+    if (argc >= 3 && strcmp(argv[1], "-n") == 0)
+    {
+        top = atoi(argv[2]);
+        arg = 3;
+    }
+    if (argc - arg != 1 || top < 1)
+        usage();
+
+    FILE* in = fopen(argv[arg], "r");
+    if (in == NULL)
+    {
+        fprintf(stderr, "Could not open \"%s\".\n", argv[arg]);
+        return 74;
+    }
+
+    Graph      graph     = {0};
+    const bool has_roots = read_snapshot(&graph, in);
+    fclose(in);
+    if (!has_roots)
+    {
+        fprintf(stderr, "\"%s\" is not a heap snapshot.\n", argv[arg]);
+        return 65;
+    }
+    resolve_edges(&graph);
+
+    int*    number    = (int*)grow_or_exit(NULL, sizeof(int) * graph.count);
+    int*    parent    = (int*)grow_or_exit(NULL, sizeof(int) * graph.count);
+    int*    order     = (int*)grow_or_exit(NULL, sizeof(int) * graph.count);
+    int*    idom      = (int*)grow_or_exit(NULL, sizeof(int) * graph.count);
+    size_t* retained  = (size_t*)grow_or_exit(NULL, sizeof(size_t) * graph.count);
+
+    const int count = number_nodes(&graph, number, order, parent);
+    find_dominators(&graph, number, order, parent, count, idom);
+
+    // Every object comes after its dominator in preorder.
+    for (int i = 0; i < graph.count; i++)
+        retained[i] = graph.nodes[i].size;
+    for (int k = count - 1; k > 0; k--)
+        retained[idom[order[k]]] += retained[order[k]];
+
+    GroupStats* stats = (GroupStats*)calloc(graph.group_count, sizeof(GroupStats));
+    if (stats == NULL)
+        return 74;
+    for (int i = 0; i < graph.group_count; i++)
+    {
+        stats[i].dominated_by = (size_t*)calloc(graph.group_count, sizeof(size_t));
+        if (stats[i].dominated_by == NULL)
+            return 74;
+    }
+    sum_groups(&graph, idom, order, count, retained, stats);
+
+    printf("%d objects, %zu bytes reachable\n", count - 1, retained[0]);
+    print_groups(&graph, stats, retained[0], top);
+    print_objects(&graph, idom, order, count, retained, top);
+
+    for (int i = 0; i < graph.group_count; i++)
+    {
+        free(stats[i].dominated_by);
+        free(graph.groups[i]);
+    }
+    free(stats);
+    free(graph.groups);
+    free(graph.nodes);
+    free(graph.edges);
+    free(number);
+    free(parent);
+    free(order);
+    free(idom);
+    free(retained);
+    return 0;
+}